@@ -54,6 +54,25 @@
 #define NIFFS_ASSERT(x)
 #endif
 
+// called for each page header visited when traversing or scanning the file
+// system, or looked up by a ram index, may be defined for statistics
+#ifndef NIFFS_STAT_TRAVERSE
+#define NIFFS_STAT_TRAVERSE(_fs, _pix)
+#endif
+
+// called for each page moved by garbage collection, may be defined for
+// statistics
+#ifndef NIFFS_STAT_GC_MOVE
+#define NIFFS_STAT_GC_MOVE(_fs)
+#endif
+
+// called with 1 before and 0 after programming data which is already
+// programmed, see NIFFS_INPLACE_MODIFY, may be defined for flash drivers
+// needing to know
+#ifndef NIFFS_HAL_REPROGRAM
+#define NIFFS_HAL_REPROGRAM(_fs, _on)
+#endif
+
 // define maximum name length
 #ifndef NIFFS_NAME_LEN
 #define NIFFS_NAME_LEN          (16)
@@ -75,6 +94,161 @@
 #define NIFFS_LINEAR_AREA       (1)
 #endif
 
+// Enable or disable the span index.
+// The span index is a ram hash table mapping object id and span index to
+// page index. When enabled and given ram by NIFFS_set_span_index, page lookups
+// become O(1) instead of scanning all page headers. Should the table become
+// too full, niffs falls back to scanning until next mount.
+#ifndef NIFFS_SPAN_INDEX
+#define NIFFS_SPAN_INDEX        (0)
+#endif
+
+// Enable or disable the name index.
+// The name index is a ram hash table mapping file name hashes to object header
+// page indices. When enabled and given ram by NIFFS_set_name_index, opening,
+// statting, renaming and creating files need not compare the name of every
+// object header in the filesystem. Should the table become too full, niffs
+// falls back to scanning until next mount.
+#ifndef NIFFS_NAME_INDEX
+#define NIFFS_NAME_INDEX        (0)
+#endif
+
+// Enable or disable the free page map.
+// The free page map is a ram bitmap with one bit per page, set if the page is
+// free. When enabled and given ram by NIFFS_set_free_map, finding a free page
+// takes a word at a time instead of scanning page headers.
+#ifndef NIFFS_FREE_MAP
+#define NIFFS_FREE_MAP          (0)
+#endif
+
+// Enable or disable the object id map.
+// The object id map is a ram bitmap with one bit per object id, set if the id
+// is in use. When enabled and given ram by NIFFS_set_id_map, creating a file
+// need not scan all page headers for a free id. Ids are handed out in a
+// rotating manner, so ids of removed files are not immediately reused.
+#ifndef NIFFS_ID_MAP
+#define NIFFS_ID_MAP            (0)
+#endif
+
+// Enable or disable the sector info table.
+// The sector info table keeps erase count and number of free, deleted and
+// busy pages per sector in ram. When enabled and given ram by
+// NIFFS_set_sector_info, garbage collection selects sectors without reading
+// all page headers.
+#ifndef NIFFS_SECTOR_INFO
+#define NIFFS_SECTOR_INFO       (0)
+#endif
+
+// Enable or disable the linear extent map, only used if NIFFS_LINEAR_AREA.
+// The linear extent map keeps the sectors occupied by each linear file in
+// ram. When enabled and given ram by NIFFS_set_linear_extents, finding space
+// for linear files and growing them need not scan all page headers. Should
+// the map become full, niffs falls back to scanning until next mount.
+#ifndef NIFFS_LINEAR_EXTENTS
+#define NIFFS_LINEAR_EXTENTS    (0)
+#endif
+
+// Enable or disable mount checkpoints.
+// When enabled, NIFFS_unmount writes a checkpoint holding page counts and
+// the contents of all ram indices. A following NIFFS_mount restores state
+// from the checkpoint instead of scanning all page headers. The checkpoint
+// is discarded when mounting, so after an unclean shutdown the filesystem is
+// scanned as usual. Each checkpoint occupies a few pages until next garbage
+// collection of its sectors.
+#ifndef NIFFS_CHECKPOINT
+#define NIFFS_CHECKPOINT        (0)
+#endif
+
+// Enable or disable the write-back cache.
+// When enabled and given ram by NIFFS_set_write_cache, each file descriptor
+// buffers appended data until a page is filled, the descriptor is flushed,
+// seeked, read or closed, or the filesystem is unmounted. This saves page
+// rewrites and object header moves for small writes. Descriptors opened
+// with NIFFS_O_DIRECT and linear files are never cached.
+#ifndef NIFFS_WRITE_CACHE
+#define NIFFS_WRITE_CACHE       (0)
+#endif
+
+// Enable or disable deferred object header length updates.
+// When enabled, appends to a regular file beyond its first page keep the
+// object header marked as moving and only record the new length in the file
+// descriptor. The object header is moved to commit the length once, when the
+// file descriptor is flushed, seeked, read or closed, or the filesystem is
+// unmounted. On power loss, data appended since last commit is dropped by
+// check or when opening the file. Descriptors opened with NIFFS_O_DIRECT
+// update the object header on each append.
+#ifndef NIFFS_DEFER_LEN
+#define NIFFS_DEFER_LEN         (0)
+#endif
+
+// Enable or disable in place appends.
+// When enabled, appending to a partially filled data page programs the new
+// bytes directly into the erased remainder of the page instead of moving the
+// page. Only done if the remainder is still erased and the write address is
+// aligned on NIFFS_WORD_ALIGN.
+#ifndef NIFFS_INPLACE_APPEND
+#define NIFFS_INPLACE_APPEND    (0)
+#endif
+
+// Enable or disable in place modifies.
+// When enabled, modifying file data where the new bytes only clear bits of
+// the stored bytes programs the new bytes directly into the page instead of
+// moving the page. Requires a flash allowing programmed words to be
+// programmed again, i.e. NOR flash without ECC. Unlike a page move, an in
+// place modify aborted by power loss can leave the range partially programmed.
+#ifndef NIFFS_INPLACE_MODIFY
+#define NIFFS_INPLACE_MODIFY    (0)
+#endif
+
+// Number of length slots in the object header, 0 disables.
+// When enabled, appends to a regular file beyond its first page record the
+// new file length by programming the next erased slot of the object header
+// in place, instead of moving the object header page. Each length update
+// uses two slots, one announcing the update before data is written and one
+// holding the new length. The object header is only moved when slots run
+// out. Each slot costs four bytes of the object header page, and is
+// programmed as one u32_t, so NIFFS_WORD_ALIGN must not exceed 4. Another
+// four bytes hold a removal marker, zeroed before the length on remove.
+// Changes the file system layout.
+#ifndef NIFFS_LEN_SLOTS
+#define NIFFS_LEN_SLOTS         (0)
+#endif
+
+// Enable or disable space preallocation.
+// When enabled, NIFFS_fallocate garbage collects up front and reserves free
+// pages for appends to a file descriptor. Appends and length commits covered
+// by the reservation never garbage collect nor erase, other operations leave
+// reserved pages alone. Each append takes the pages it actually writes from
+// the reservation, so many small appends exhaust it early unless
+// NIFFS_WRITE_CACHE gathers them into whole pages. The reservation is
+// released when the descriptor is closed.
+#ifndef NIFFS_FALLOCATE
+#define NIFFS_FALLOCATE         (0)
+#endif
+
+// Enable or disable incremental garbage collection.
+// When enabled, NIFFS_gc_step lets the application garbage collect in small
+// steps when idle, moving a bounded number of pages per call and erasing
+// only when allowed. A sector collected in steps is left alone by other
+// operations until it is erased. Steps only start collecting when free pages
+// drop below a watermark, set by NIFFS_set_gc_watermark and defaulting to two
+// sectors. Foreground garbage collection finishes a collection in progress
+// before collecting on its own.
+#ifndef NIFFS_GC_STEP
+#define NIFFS_GC_STEP           (0)
+#endif
+
+// Enable or disable separate allocation of relocated data.
+// When enabled, pages moved by garbage collection are written from a cold
+// allocation head of their own, and user writes keep clear of the sector it
+// fills, and vice versa, as long as there are free pages elsewhere. Pages
+// surviving garbage collection tend to be long lived, so sectors end up
+// holding either mostly changing or mostly static data, and the static data
+// is not moved over and over again.
+#ifndef NIFFS_COLD_HEAD
+#define NIFFS_COLD_HEAD         (0)
+#endif
+
 // define number of bits used for object ids, used for uniquely identify a file
 #ifndef NIFFS_OBJ_ID_BITS
 #define NIFFS_OBJ_ID_BITS       (8)
@@ -121,6 +295,71 @@
   ((busy) * NIFFS_GC_SCORE_BUSY)
 #endif
 
+// Enable or disable runtime garbage collection policies.
+// When enabled, NIFFS_set_gc_policy replaces NIFFS_GC_SCORE by a scoring
+// function at runtime, either one of the built-in NIFFS_gc_policy_greedy,
+// NIFFS_gc_policy_cost_benefit and NIFFS_gc_policy_wear, or one of the
+// application's own.
+#ifndef NIFFS_GC_POLICY
+#define NIFFS_GC_POLICY         (0)
+#endif
+
+// Length of queue of sectors having all pages deleted, 0 disables.
+// When enabled, deleting the last live page of a sector queues the sector,
+// and garbage collection erases queued sectors before scoring any. Such a
+// sector is reclaimed by one erase, without scanning pages or moving any.
+// Should another sector lag behind in erases, scoring takes over to keep
+// wear leveling going. Sectors not fitting in the queue are left to ordinary
+// garbage collection. Costs one u32_t per entry.
+#ifndef NIFFS_DEAD_ERASE
+#define NIFFS_DEAD_ERASE        (0)
+#endif
+
+// Maximum number of sectors garbage collected in one planned pass, 0
+// disables. When enabled, an operation needing more than a sector's worth
+// of free pages scans sectors once, and collects the best scoring sectors
+// until giving the pages needed, those needing the fewest page moves first,
+// instead of scanning all sectors again for each sector collected. Sectors
+// are scored by NIFFS_GC_SCORE or the policy set by NIFFS_set_gc_policy,
+// like single garbage collection candidates. Costs four u32_t of stack per
+// planned sector.
+#ifndef NIFFS_GC_PLAN
+#define NIFFS_GC_PLAN           (0)
+#endif
+
+// Erase count difference triggering static wear leveling, 0 disables.
+// When enabled, and the least erased sector holding data lags more than
+// this many erases behind the most erased sector, its pages are moved into
+// the most erased totally free sector and the sector is erased, so data
+// that never changes does not pin down sectors that barely wear. Checked at
+// most once per NIFFS_STATIC_WEAR_PERIOD garbage collection erases.
+#ifndef NIFFS_STATIC_WEAR
+#define NIFFS_STATIC_WEAR       (0)
+#endif
+
+// Number of garbage collection erases between static wear leveling checks.
+#ifndef NIFFS_STATIC_WEAR_PERIOD
+#define NIFFS_STATIC_WEAR_PERIOD (16)
+#endif
+
+// Number of bins in the erase count histogram of NIFFS_wear_info, 0
+// disables NIFFS_wear_info. Erase counts and page occupancy are taken from
+// the sector info table if NIFFS_SECTOR_INFO is enabled and given ram, else
+// each sector is scanned.
+#ifndef NIFFS_WEAR_INFO
+#define NIFFS_WEAR_INFO         (0)
+#endif
+
+// Enable or disable split erase HAL.
+// When enabled, NIFFS_set_async_erase hands niffs a HAL function starting an
+// erase and one polling it. NIFFS_gc_step then only starts erasing, and
+// returns while the erase is in flight, finishing it on a later step. Needs
+// NIFFS_GC_STEP. Reading open files meanwhile does not wait for the erase,
+// anything writing or scanning the filesystem does. Other erases block.
+#ifndef NIFFS_ASYNC_ERASE
+#define NIFFS_ASYNC_ERASE       (0)
+#endif
+
 // type sizes, depend of the size of the filesystem and the size of the pages
 
 // must comprise NIFFS_OBJ_ID_BITS
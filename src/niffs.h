@@ -80,6 +80,11 @@
 
 typedef int (* niffs_hal_erase_f)(u8_t *addr, u32_t len);
 typedef int (* niffs_hal_write_f)(u8_t *addr, const u8_t *src, u32_t len);
+#if NIFFS_ASYNC_ERASE
+typedef int (* niffs_hal_erase_start_f)(u8_t *addr, u32_t len);
+// returns 1 while erasing, NIFFS_OK when erased, or error
+typedef int (* niffs_hal_erase_poll_f)(u8_t *addr);
+#endif
 // dummy type, for posix compliance
 typedef u16_t niffs_mode;
 // niffs file descriptor flags
@@ -101,8 +106,83 @@ typedef struct {
   niffs_page_ix cur_pix;
   // file descriptor flags
   niffs_fd_flags flags;
+#if NIFFS_WRITE_CACHE
+  // number of cached bytes not yet appended to file
+  u32_t wc_len;
+#endif
+#if NIFFS_DEFER_LEN
+  // file length not yet committed to object header, 0 if none
+  u32_t pend_len;
+#endif
+#if NIFFS_FALLOCATE
+  // pages reserved for appends by NIFFS_fallocate
+  u32_t resv_pages;
+#endif
 } niffs_file_desc;
 
+#if NIFFS_SPAN_INDEX
+/* span index entry, maps a raw page id to a page index */
+typedef struct {
+  niffs_page_id_raw id;
+  niffs_page_ix pix;
+} niffs_span_index_entry;
+#endif
+
+#if NIFFS_NAME_INDEX
+/* name index entry, maps a file name hash to an object header page index */
+typedef struct {
+  u32_t hash;
+  niffs_page_ix pix;
+} niffs_name_index_entry;
+#endif
+
+#if NIFFS_SECTOR_INFO
+/* sector info, erase count and page occupancy of a sector */
+typedef struct {
+  niffs_erase_cnt era_cnt;
+  niffs_page_ix free_pages;
+  niffs_page_ix dele_pages;
+  niffs_page_ix busy_pages;
+} niffs_sector_info;
+#endif
+
+#if NIFFS_GC_POLICY
+/* sector as seen by a garbage collection policy */
+typedef struct {
+  // sector index
+  u32_t sector;
+  // erase count difference to most erased sector, grows with the age of
+  // the data in the sector
+  u32_t age;
+  // number of pages in sector
+  u32_t pages;
+  // number of free pages in sector
+  u32_t free_pages;
+  // number of deleted pages in sector, reclaimed by collecting it
+  u32_t dele_pages;
+  // number of busy pages in sector, moved by collecting it
+  u32_t busy_pages;
+} niffs_gc_sector;
+
+/* garbage collection policy, scores a sector, the sector with the highest
+   score is collected */
+typedef s32_t (*niffs_gc_policy_f)(const niffs_gc_sector *s);
+#endif
+
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+/* linear extent, the sectors in linear area occupied by a linear file */
+typedef struct {
+  // linear file object header page index
+  niffs_page_ix pix;
+  // linear file object id
+  niffs_obj_id oid;
+  // absolute index of first occupied sector
+  u32_t start_sector;
+  // number of occupied sectors
+  u32_t sectors;
+} niffs_linear_extent;
+#endif
+
 /* fs struct */
 typedef struct {
   /* static cfg */
@@ -128,12 +208,24 @@ typedef struct {
   niffs_hal_write_f hal_wr;
   // HAL erase function
   niffs_hal_erase_f hal_er;
+#if NIFFS_ASYNC_ERASE
+  // HAL erase start function, 0 if all erases block
+  niffs_hal_erase_start_f hal_er_start;
+  // HAL erase poll function
+  niffs_hal_erase_poll_f hal_er_poll;
+#endif
 
   /* dynamics */
   // pages per sector
   u32_t pages_per_sector;
   // last seen free page index
   niffs_page_ix last_free_pix;
+#if NIFFS_COLD_HEAD
+  // last free page index taken for data relocated by garbage collection
+  niffs_page_ix last_cold_pix;
+  // sector being filled by relocated data, or NIFFS_EXCL_SECT_NONE if none
+  u32_t cold_sector;
+#endif
   // whether mounted or not
   u8_t mounted;
   // number of free pages
@@ -146,8 +238,112 @@ typedef struct {
   u32_t descs_len;
   // max erase count
   niffs_erase_cnt max_era;
+#if NIFFS_SPAN_INDEX
+  // span index hash table, 0 if not used
+  niffs_span_index_entry *span_index;
+  // number of entries in span index hash table
+  u32_t span_index_len;
+  // number of occupied entries in span index hash table
+  u32_t span_index_cnt;
+  // set if span index could not hold all pages
+  u8_t span_index_ovf;
+#endif
+#if NIFFS_NAME_INDEX
+  // name index hash table, 0 if not used
+  niffs_name_index_entry *name_index;
+  // number of entries in name index hash table
+  u32_t name_index_len;
+  // number of occupied entries in name index hash table
+  u32_t name_index_cnt;
+  // set if name index could not hold all object headers
+  u8_t name_index_ovf;
+#endif
+#if NIFFS_FREE_MAP
+  // free page bitmap, one bit per page set if free, 0 if not used
+  u32_t *free_map;
+#endif
+#if NIFFS_ID_MAP
+  // object id bitmap, one bit per id set if used, 0 if not used
+  u32_t *id_map;
+  // bit index in object id bitmap where to start looking for next free id
+  u32_t id_cursor;
+#endif
+#if NIFFS_SECTOR_INFO
+  // sector info table, one entry per sector, 0 if not used
+  niffs_sector_info *sector_info;
+#endif
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+  // linear extent map, 0 if not used
+  niffs_linear_extent *lin_extents;
+  // number of entries in linear extent map
+  u32_t lin_extents_len;
+  // number of occupied entries in linear extent map
+  u32_t lin_extents_cnt;
+  // set if linear extent map could not hold all linear files
+  u8_t lin_extents_ovf;
+#endif
+#if NIFFS_CHECKPOINT
+  // generation of last stored or restored checkpoint
+  u32_t ckpt_gen;
+  // set if a flash operation failed since mount, ram state is then not
+  // trusted for a checkpoint
+  u8_t ckpt_unclean;
+#endif
+#if NIFFS_WRITE_CACHE
+  // write-back cache, wcache_len bytes per file descriptor
+  u8_t *wcache;
+  // write-back cache bytes per file descriptor
+  u32_t wcache_len;
+#endif
+#if NIFFS_FALLOCATE
+  // pages reserved by all file descriptors
+  u32_t resv_pages;
+#endif
+#if NIFFS_GC_STEP
+  // free pages below which NIFFS_gc_step starts collecting
+  u32_t gc_watermark;
+  // set while a sector is being collected in steps
+  u8_t gc_active;
+  // sector being collected in steps
+  u32_t gc_sector;
+  // index of next page within sector being collected to examine
+  niffs_page_ix gc_ipix;
+  // free pages of sector being collected, not counted in free_pages meanwhile
+  u32_t gc_free_pages;
+#endif
+#if NIFFS_GC_POLICY
+  // garbage collection policy, 0 if NIFFS_GC_SCORE is used
+  niffs_gc_policy_f gc_policy;
+#endif
+#if NIFFS_DEAD_ERASE
+  // sectors having all pages deleted, to be erased
+  u32_t dead_sectors[NIFFS_DEAD_ERASE];
+  // number of queued sectors
+  u32_t dead_cnt;
+#endif
+#if NIFFS_STATIC_WEAR
+  // garbage collection erases since last static wear leveling check
+  u32_t wear_erases;
+#endif
+#if NIFFS_ASYNC_ERASE
+  // sector being erased by split erase HAL, or NIFFS_EXCL_SECT_NONE if none
+  u32_t er_sector;
+  // erase count of sector being erased, written once erased
+  niffs_erase_cnt er_era_cnt;
+  // pages of sector being erased that will be freed
+  u32_t er_pages;
+#endif
 } niffs;
 
+/* niffs io vector entry, see NIFFS_writev, NIFFS_readv and
+   NIFFS_read_segments */
+typedef struct {
+  // data
+  u8_t *base;
+  // data length
+  u32_t len;
+} niffs_iovec;
+
 /* niffs file status struct */
 typedef struct {
   // file object id
@@ -192,6 +388,10 @@ typedef struct {
    This can happen if filesystem loses power repeatedly during
    garbage collection or check. */
   u8_t overflow;
+#if NIFFS_FALLOCATE
+  /* bytes reserved for appends by NIFFS_fallocate */
+  s32_t resv_bytes;
+#endif
 
   /* total amount of sectors in the linear part of filesystem */
   s32_t lin_total_sectors;
@@ -201,6 +401,35 @@ typedef struct {
   s32_t lin_max_conseq_free;
 } niffs_info;
 
+#if NIFFS_WEAR_INFO
+/* niffs sector wear struct, erase count and page occupancy of a sector */
+typedef struct {
+  niffs_erase_cnt era_cnt;
+  niffs_page_ix free_pages;
+  niffs_page_ix dele_pages;
+  niffs_page_ix busy_pages;
+} niffs_sector_wear;
+
+/* niffs wear info struct */
+typedef struct {
+  /* erase count of least erased sector */
+  niffs_erase_cnt era_min;
+  /* erase count of most erased sector */
+  niffs_erase_cnt era_max;
+  /* mean erase count of all sectors, rounded down */
+  niffs_erase_cnt era_mean;
+  /* number of erase counts covered by each histogram bin */
+  u32_t hist_width;
+  /* number of sectors per bin, bin n counts sectors with an erase count
+     from era_min + n * hist_width up to but not including the next bin */
+  u32_t hist[NIFFS_WEAR_INFO];
+  /* total number of free, deleted and busy pages */
+  u32_t free_pages;
+  u32_t dele_pages;
+  u32_t busy_pages;
+} niffs_wear_info;
+#endif
+
 /**
  * Initializes and configures the file system.
  * The file system needs a ram work buffer being at least a logical page size
@@ -237,8 +466,121 @@ int NIFFS_init(niffs *fs,
     u32_t lin_sectors
     );
 
+#if NIFFS_SPAN_INDEX
+/**
+ * Hands ram to the span index, mapping file id and span index to pages.
+ * Must be called after NIFFS_init and before NIFFS_mount. Each page in use
+ * occupies one niffs_span_index_entry, and the table should have some slack;
+ * e.g. 1.5 entries per page in filesystem. If the table overflows, niffs
+ * falls back to scanning for pages until next mount.
+ * @param fs            the file system struct
+ * @param buf           ram for the index, aligned for niffs_span_index_entry,
+ *                      or 0 to disable the index
+ * @param buf_len       ram length in bytes
+ */
+int NIFFS_set_span_index(niffs *fs, void *buf, u32_t buf_len);
+#endif
+
+#if NIFFS_NAME_INDEX
+/**
+ * Hands ram to the name index, mapping file names to object headers.
+ * Must be called after NIFFS_init and before NIFFS_mount. Each file occupies
+ * one niffs_name_index_entry, and the table should have some slack; e.g. 1.5
+ * entries per expected file. If the table overflows, niffs falls back to
+ * scanning for names until next mount.
+ * @param fs            the file system struct
+ * @param buf           ram for the index, aligned for niffs_name_index_entry,
+ *                      or 0 to disable the index
+ * @param buf_len       ram length in bytes
+ */
+int NIFFS_set_name_index(niffs *fs, void *buf, u32_t buf_len);
+#endif
+
+#if NIFFS_FREE_MAP
+/**
+ * Hands ram to the free page map, having one bit per page telling whether
+ * the page is free. Must be called after NIFFS_init and before NIFFS_mount.
+ * The map needs one u32_t per 32 pages in filesystem, rounded up.
+ * @param fs            the file system struct
+ * @param buf           ram for the map, aligned for u32_t, or 0 to disable
+ *                      the map
+ * @param buf_len       ram length in bytes
+ */
+int NIFFS_set_free_map(niffs *fs, void *buf, u32_t buf_len);
+#endif
+
+#if NIFFS_ID_MAP
+/**
+ * Hands ram to the object id map, having one bit per object id telling
+ * whether the id is used. Must be called after NIFFS_init and before
+ * NIFFS_mount. The map needs one u32_t per 32 pages in filesystem, rounded up.
+ * @param fs            the file system struct
+ * @param buf           ram for the map, aligned for u32_t, or 0 to disable
+ *                      the map
+ * @param buf_len       ram length in bytes
+ */
+int NIFFS_set_id_map(niffs *fs, void *buf, u32_t buf_len);
+#endif
+
+#if NIFFS_SECTOR_INFO
+/**
+ * Hands ram to the sector info table, keeping erase count and page
+ * occupancy per sector for garbage collection. Must be called after
+ * NIFFS_init and before NIFFS_mount. The table needs one niffs_sector_info
+ * per sector.
+ * @param fs            the file system struct
+ * @param buf           ram for the table, aligned for niffs_sector_info, or 0
+ *                      to disable the table
+ * @param buf_len       ram length in bytes
+ */
+int NIFFS_set_sector_info(niffs *fs, void *buf, u32_t buf_len);
+#endif
+
+#if NIFFS_ASYNC_ERASE
+/**
+ * Hands niffs a split erase HAL, used by NIFFS_gc_step to erase without
+ * blocking. Must be called after NIFFS_init and before NIFFS_mount. The start
+ * function starts erasing and returns at once, the poll function returns 1
+ * while still erasing. The memory being erased is never read or written
+ * meanwhile, other memory may be read.
+ * @param fs            the file system struct
+ * @param start_f       the erase start function, or 0 to always use the
+ *                      blocking erase function
+ * @param poll_f        the erase poll function, or 0
+ */
+int NIFFS_set_async_erase(niffs *fs, niffs_hal_erase_start_f start_f, niffs_hal_erase_poll_f poll_f);
+#endif
+
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+/**
+ * Hands ram to the linear extent map, keeping the sectors occupied by each
+ * linear file. Must be called after NIFFS_init and before NIFFS_mount. Each
+ * linear file occupies one niffs_linear_extent. If the map overflows, niffs
+ * falls back to scanning for linear files until next mount.
+ * @param fs            the file system struct
+ * @param buf           ram for the map, aligned for niffs_linear_extent, or 0
+ *                      to disable the map
+ * @param buf_len       ram length in bytes
+ */
+int NIFFS_set_linear_extents(niffs *fs, void *buf, u32_t buf_len);
+#endif
+
+#if NIFFS_WRITE_CACHE
+/**
+ * Hands ram to the write-back cache. Must be called after NIFFS_init and
+ * before NIFFS_mount. The ram is split evenly between file descriptors,
+ * each descriptor needs at least one page.
+ * @param fs            the file system struct
+ * @param buf           ram for the cache, or 0 to disable the cache
+ * @param buf_len       ram length in bytes
+ */
+int NIFFS_set_write_cache(niffs *fs, void *buf, u32_t buf_len);
+#endif
+
 /**
- * Mounts the filesystem
+ * Mounts the filesystem. If NIFFS_CHECKPOINT is enabled and the filesystem
+ * was cleanly unmounted, state is restored from the checkpoint written on
+ * unmount instead of scanning the filesystem.
  * @param fs            the file system struct
  */
 int NIFFS_mount(niffs *fs);
@@ -251,9 +593,24 @@ int NIFFS_mount(niffs *fs);
  * @param overflow      if !0, this means you should delete some files and run a check.
  *                      This can happen if filesystem loses power repeatedly during
  *                      garbage collection or check.
+ * @param resv_bytes    if NIFFS_FALLOCATE, bytes reserved by NIFFS_fallocate
  */
 int NIFFS_info(niffs *fs, niffs_info *i);
 
+#if NIFFS_WEAR_INFO
+/**
+ * Returns erase count statistics and page occupancy of all sectors, linear
+ * area excluded. With a sector info table, no pages are read. Erase counts
+ * are relative the most erased sector, so wrapped counters are handled.
+ * @param fs            the file system struct
+ * @param w             the wear info struct to populate
+ * @param sectors       if not 0, populated with wear of each sector
+ * @param sectors_len   number of entries in sectors, at most this many
+ *                      sectors are populated
+ */
+int NIFFS_wear_info(niffs *fs, niffs_wear_info *w, niffs_sector_wear *sectors, u32_t sectors_len);
+#endif
+
 /**
  * Creates a new file.
  * @param fs            the file system struct
@@ -309,6 +666,22 @@ int NIFFS_open(niffs *fs, const char *name, u8_t flags, niffs_mode mode);
  */
 int NIFFS_read_ptr(niffs *fs, int fd, u8_t **ptr, u32_t *len);
 
+/**
+ * Populates segments pointing directly to the flash where data of given range
+ * of the file resides, one segment per page, or one for a linear file.
+ * Neither uses nor advances the file descriptor offset. The segments are
+ * valid until the file or filesystem is modified.
+ * @param fs            the file system struct
+ * @param fd            the filehandle
+ * @param offs          file offset where range starts
+ * @param len           range length, clamped at end of file
+ * @param segs          segments to populate
+ * @param max_segs      number of segments, if too few the range is only
+ *                      covered partially
+ * @returns number of populated segments, or error
+ */
+int NIFFS_read_segments(niffs *fs, int fd, u32_t offs, u32_t len, niffs_iovec *segs, u32_t max_segs);
+
 /**
  * Reads from given filehandle.
  * NB: consider using NIFFS_read_ptr instead. This will basically copy from your
@@ -322,6 +695,44 @@ int NIFFS_read_ptr(niffs *fs, int fd, u8_t **ptr, u32_t *len);
  */
 int NIFFS_read(niffs *fs, int fd, u8_t *dst, u32_t len);
 
+/**
+ * Reads from given filehandle into several buffers, filling each buffer
+ * before the next. Data is copied from flash one page at a time, regardless
+ * of how it is scattered over the buffers.
+ * @param fs            the file system struct
+ * @param fd            the filehandle
+ * @param iov           buffers where to put read data
+ * @param iovcnt        number of buffers
+ * @returns number of bytes read, or error
+ */
+int NIFFS_readv(niffs *fs, int fd, const niffs_iovec *iov, u32_t iovcnt);
+
+/**
+ * Reads from given filehandle at given file offset. The file descriptor
+ * offset is neither used nor moved, and pages are looked up directly, so
+ * reads at scattered offsets do not disturb other reads of the descriptor.
+ * @param fs            the file system struct
+ * @param fd            the filehandle
+ * @param dst           where to put read data
+ * @param len           how much to read
+ * @param offs          file offset to read from
+ * @returns number of bytes read, or error
+ */
+int NIFFS_pread(niffs *fs, int fd, u8_t *dst, u32_t len, u32_t offs);
+
+/**
+ * Writes to given filehandle at given file offset, modifying and appending as
+ * needed. The file descriptor offset is neither used nor moved. If the file
+ * was opened with NIFFS_O_APPEND, data is appended regardless of offset.
+ * @param fs            the file system struct
+ * @param fd            the filehandle
+ * @param data          the data to write
+ * @param len           how much to write
+ * @param offs          file offset to write at, at most the file length
+ * @returns number of bytes written, or error
+ */
+int NIFFS_pwrite(niffs *fs, int fd, const u8_t *data, u32_t len, u32_t offs);
+
 /**
  * Moves the read/write file offset
  * @param fs            the file system struct
@@ -348,7 +759,9 @@ int NIFFS_remove(niffs *fs, const char *name);
 int NIFFS_fremove(niffs *fs, int fd);
 
 /**
- * Writes to given filehandle.
+ * Writes to given filehandle. If NIFFS_WRITE_CACHE is enabled, appended data
+ * may be held in ram until the filehandle is flushed or closed. Errors
+ * writing cached data are then returned by the flushing call.
  * @param fs            the file system struct
  * @param fd            the filehandle
  * @param buf           the data to write
@@ -358,12 +771,114 @@ int NIFFS_fremove(niffs *fs, int fd);
 int NIFFS_write(niffs *fs, int fd, const u8_t *data, u32_t len);
 
 /**
- * Flushes all pending write operations from cache for given file
+ * Writes several buffers to given filehandle, as if they were one. Data
+ * appended is packed into pages across buffer boundaries, with one space
+ * check and one file length update for the whole vector. Data modified is
+ * written one buffer at a time.
+ * @param fs            the file system struct
+ * @param fd            the filehandle
+ * @param iov           buffers with data to write
+ * @param iovcnt        number of buffers
+ * @returns number of bytes written or error
+ */
+int NIFFS_writev(niffs *fs, int fd, const niffs_iovec *iov, u32_t iovcnt);
+
+/**
+ * Flushes all pending write operations from cache for given file. If
+ * NIFFS_DEFER_LEN is enabled, this also commits the file length so appended
+ * data survives power loss.
  * @param fs            the file system struct
  * @param fd            the filehandle of the file to flush
  */
 int NIFFS_fflush(niffs *fs, int fd);
 
+#if NIFFS_FALLOCATE
+/**
+ * Reserves space for appending len bytes to given file. Garbage collects up
+ * front if needed, so following appends and flushes within the reservation
+ * never garbage collect nor erase. Any previous reservation of the filehandle
+ * is replaced, a zero len releases it. Appends beyond the reservation release
+ * what is left of it and garbage collect as usual. The reservation is
+ * released when the filehandle is closed.
+ * The reservation covers small appends only if NIFFS_WRITE_CACHE gathers
+ * them into whole pages. Uncached, each small append rewrites the partially
+ * filled page and the object header, and may exhaust the reservation early.
+ * @param fs            the file system struct
+ * @param fd            the filehandle of the file to append to
+ * @param len           number of bytes to reserve
+ * @returns NIFFS_OK, ERR_NIFFS_FULL if there is not room enough, or other error
+ */
+int NIFFS_fallocate(niffs *fs, int fd, u32_t len);
+#endif
+
+#if NIFFS_GC_STEP
+/**
+ * Performs a bounded part of garbage collection, meant to be called when the
+ * application is idle. If no sector is being collected and free pages are
+ * below the watermark, a sector is selected. Then at most max_page_moves
+ * busy pages are moved out of the sector, and if all are moved and
+ * allow_erase is set, the sector is erased. Free pages of a sector being
+ * collected are not used until it is erased. With NIFFS_ASYNC_ERASE and a
+ * split erase HAL, the erase is only started, and following steps do
+ * nothing but poll it until it is finished.
+ * @param fs              the file system struct
+ * @param max_page_moves  maximum number of pages to move in this step
+ * @param allow_erase     if zero, the sector is never erased in this step
+ * @returns 1 if more collecting is pending, 0 if not, or error
+ */
+int NIFFS_gc_step(niffs *fs, u32_t max_page_moves, u8_t allow_erase);
+
+/**
+ * Checks if garbage collection is pending, i.e. if a sector is being
+ * collected or erased, if a dead sector is queued and not passed over for
+ * wear leveling, or if free pages are below the watermark and a sector can
+ * be collected in steps. A sector whose page moves would eat into the last
+ * free sector is left to foreground collection, and is not pending.
+ * Agrees with the return value of NIFFS_gc_step. Scans sectors when below
+ * the watermark.
+ * @param fs            the file system struct
+ * @returns 1 if pending, 0 if not, or error
+ */
+int NIFFS_gc_pending(niffs *fs);
+
+/**
+ * Sets the number of free pages below which NIFFS_gc_step starts collecting.
+ * Defaults to the number of pages in two sectors.
+ * @param fs            the file system struct
+ * @param free_pages    the watermark in pages
+ */
+int NIFFS_set_gc_watermark(niffs *fs, u32_t free_pages);
+#endif
+
+#if NIFFS_GC_POLICY
+/**
+ * Sets the policy selecting which sector to garbage collect. May be called
+ * at any time.
+ * @param fs            the file system struct
+ * @param policy        the policy, or 0 to use NIFFS_GC_SCORE
+ */
+int NIFFS_set_gc_policy(niffs *fs, niffs_gc_policy_f policy);
+
+/**
+ * Greedy policy, collects the sector reclaiming the most deleted pages, and
+ * the one with the fewest pages to move among those.
+ */
+s32_t NIFFS_gc_policy_greedy(const niffs_gc_sector *s);
+
+/**
+ * Cost-benefit policy, weighs reclaimed pages times age against the cost of
+ * reading and moving busy pages. Leaves sectors with recently written data
+ * alone for a while, as more of it is likely to be deleted soon.
+ */
+s32_t NIFFS_gc_policy_cost_benefit(const niffs_gc_sector *s);
+
+/**
+ * Wear policy, collects the least erased sector, moving long lived data onto
+ * worn sectors. Deleted pages only break ties.
+ */
+s32_t NIFFS_gc_policy_wear(const niffs_gc_sector *s);
+#endif
+
 /**
  * Gets file status by name
  * @param fs            the file system struct
@@ -420,7 +935,9 @@ niffs_DIR *NIFFS_opendir(niffs *fs, const char *name, niffs_DIR *d);
 int NIFFS_closedir(niffs_DIR *d);
 
 /**
- * Reads a directory into given niffs_dirent struct.
+ * Reads a directory into given niffs_dirent struct. Like NIFFS_fstat, the
+ * size includes data written through open file descriptors but not yet
+ * committed to flash.
  * @param d             pointer to the directory stream
  * @param e             the dirent struct to be populated
  * @returns null if error or end of stream, else given dirent is returned
@@ -429,7 +946,9 @@ struct niffs_dirent *NIFFS_readdir(niffs_DIR *d, struct niffs_dirent *e);
 
 /**
  * Unmounts the file system. All file handles will be flushed of any
- * cached writes and closed.
+ * cached writes and closed. If NIFFS_CHECKPOINT is enabled and no flash
+ * operation failed since mount, a checkpoint for next mount is written. The
+ * file system is unmounted even if writing the checkpoint fails.
  * @param fs            the file system struct
  */
 int NIFFS_unmount(niffs *fs);
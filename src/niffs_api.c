@@ -12,9 +12,17 @@ int NIFFS_info(niffs *fs, niffs_info *i) {
   if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
   if (i == 0) return ERR_NIFFS_NULL_PTR;
 
+  u32_t free_pages = fs->free_pages;
+#if NIFFS_GC_STEP
+  // free pages of sector being collected are free still
+  if (fs->gc_active) free_pages += fs->gc_free_pages;
+#endif
   i->total_bytes = (fs->sectors-1) * fs->pages_per_sector * _NIFFS_SPIX_2_PDATA_LEN(fs, 1);
-  i->used_bytes = ((fs->sectors) * fs->pages_per_sector - (fs->free_pages + fs->dele_pages)) * _NIFFS_SPIX_2_PDATA_LEN(fs, 1);
-  i->overflow = fs->free_pages < fs->pages_per_sector;
+  i->used_bytes = ((fs->sectors) * fs->pages_per_sector - (free_pages + fs->dele_pages)) * _NIFFS_SPIX_2_PDATA_LEN(fs, 1);
+  i->overflow = free_pages < fs->pages_per_sector;
+#if NIFFS_FALLOCATE
+  i->resv_bytes = fs->resv_pages * _NIFFS_SPIX_2_PDATA_LEN(fs, 1);
+#endif
 
 #if NIFFS_LINEAR_AREA
   i->lin_total_sectors = fs->lin_sectors;
@@ -41,6 +49,98 @@ int NIFFS_info(niffs *fs, niffs_info *i) {
   return NIFFS_OK;
 }
 
+#if NIFFS_WEAR_INFO
+int NIFFS_wear_info(niffs *fs, niffs_wear_info *w, niffs_sector_wear *sectors, u32_t sectors_len) {
+  if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
+  if (w == 0) return ERR_NIFFS_NULL_PTR;
+  return niffs_get_wear_info(fs, w, sectors, sectors_len);
+}
+#endif
+
+#if NIFFS_SPAN_INDEX
+int NIFFS_set_span_index(niffs *fs, void *buf, u32_t buf_len) {
+  if (fs->mounted) return ERR_NIFFS_MOUNTED;
+  if (buf && buf_len < sizeof(niffs_span_index_entry)) return ERR_NIFFS_BAD_CONF;
+  fs->span_index = (niffs_span_index_entry *)buf;
+  fs->span_index_len = buf ? buf_len / sizeof(niffs_span_index_entry) : 0;
+  fs->span_index_cnt = 0;
+  fs->span_index_ovf = 0;
+  return NIFFS_OK;
+}
+#endif
+
+#if NIFFS_NAME_INDEX
+int NIFFS_set_name_index(niffs *fs, void *buf, u32_t buf_len) {
+  if (fs->mounted) return ERR_NIFFS_MOUNTED;
+  if (buf && buf_len < sizeof(niffs_name_index_entry)) return ERR_NIFFS_BAD_CONF;
+  fs->name_index = (niffs_name_index_entry *)buf;
+  fs->name_index_len = buf ? buf_len / sizeof(niffs_name_index_entry) : 0;
+  fs->name_index_cnt = 0;
+  fs->name_index_ovf = 0;
+  return NIFFS_OK;
+}
+#endif
+
+#if NIFFS_FREE_MAP
+int NIFFS_set_free_map(niffs *fs, void *buf, u32_t buf_len) {
+  if (fs->mounted) return ERR_NIFFS_MOUNTED;
+  if (buf && buf_len < _NIFFS_FREE_MAP_WORDS(fs) * sizeof(u32_t)) return ERR_NIFFS_BAD_CONF;
+  fs->free_map = (u32_t *)buf;
+  return NIFFS_OK;
+}
+#endif
+
+#if NIFFS_ID_MAP
+int NIFFS_set_id_map(niffs *fs, void *buf, u32_t buf_len) {
+  if (fs->mounted) return ERR_NIFFS_MOUNTED;
+  if (buf && buf_len < _NIFFS_ID_MAP_WORDS(fs) * sizeof(u32_t)) return ERR_NIFFS_BAD_CONF;
+  fs->id_map = (u32_t *)buf;
+  fs->id_cursor = 0;
+  return NIFFS_OK;
+}
+#endif
+
+#if NIFFS_SECTOR_INFO
+int NIFFS_set_sector_info(niffs *fs, void *buf, u32_t buf_len) {
+  if (fs->mounted) return ERR_NIFFS_MOUNTED;
+  if (buf && buf_len < fs->sectors * sizeof(niffs_sector_info)) return ERR_NIFFS_BAD_CONF;
+  fs->sector_info = (niffs_sector_info *)buf;
+  return NIFFS_OK;
+}
+#endif
+
+#if NIFFS_ASYNC_ERASE
+int NIFFS_set_async_erase(niffs *fs, niffs_hal_erase_start_f start_f, niffs_hal_erase_poll_f poll_f) {
+  if (fs->mounted) return ERR_NIFFS_MOUNTED;
+  if ((start_f == 0) != (poll_f == 0)) return ERR_NIFFS_BAD_CONF;
+  fs->hal_er_start = start_f;
+  fs->hal_er_poll = poll_f;
+  return NIFFS_OK;
+}
+#endif
+
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+int NIFFS_set_linear_extents(niffs *fs, void *buf, u32_t buf_len) {
+  if (fs->mounted) return ERR_NIFFS_MOUNTED;
+  if (buf && buf_len < sizeof(niffs_linear_extent)) return ERR_NIFFS_BAD_CONF;
+  fs->lin_extents = (niffs_linear_extent *)buf;
+  fs->lin_extents_len = buf ? buf_len / sizeof(niffs_linear_extent) : 0;
+  fs->lin_extents_cnt = 0;
+  fs->lin_extents_ovf = 0;
+  return NIFFS_OK;
+}
+#endif
+
+#if NIFFS_WRITE_CACHE
+int NIFFS_set_write_cache(niffs *fs, void *buf, u32_t buf_len) {
+  if (fs->mounted) return ERR_NIFFS_MOUNTED;
+  u32_t len = buf ? buf_len / fs->descs_len : 0;
+  if (buf && len < _NIFFS_SPIX_2_PDATA_LEN(fs, 1)) return ERR_NIFFS_BAD_CONF;
+  fs->wcache = (u8_t *)buf;
+  fs->wcache_len = len;
+  return NIFFS_OK;
+}
+#endif
 
 int NIFFS_creat(niffs *fs, const char *name, niffs_mode mode) {
   (void)mode;
@@ -144,10 +244,28 @@ int NIFFS_read_ptr(niffs *fs, int fd, u8_t **ptr, u32_t *len) {
   return niffs_read_ptr(fs, fd, ptr, len);
 }
 
+int NIFFS_read_segments(niffs *fs, int fd, u32_t offs, u32_t len, niffs_iovec *segs, u32_t max_segs) {
+  if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
+  if (segs == 0 && max_segs > 0) return ERR_NIFFS_NULL_PTR;
+  return niffs_read_segments(fs, fd, offs, len, segs, max_segs);
+}
+
 int NIFFS_read(niffs *fs, int fd_ix, u8_t *dst, u32_t len) {
+  niffs_iovec iov = {.base = dst, .len = len};
+  return NIFFS_readv(fs, fd_ix, &iov, 1);
+}
+
+int NIFFS_readv(niffs *fs, int fd_ix, const niffs_iovec *iov, u32_t iovcnt) {
   if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
+  if (iov == 0 && iovcnt > 0) return ERR_NIFFS_NULL_PTR;
 
   int res = NIFFS_OK;
+  u32_t len = 0;
+  u32_t i;
+  for (i = 0; i < iovcnt; i++) {
+    len += iov[i].len;
+  }
+  u32_t iov_offs = 0; // offset in current io vector entry
   s32_t read_len = 0;
   do {
     u8_t *rptr;
@@ -155,12 +273,22 @@ int NIFFS_read(niffs *fs, int fd_ix, u8_t *dst, u32_t len) {
     res = niffs_read_ptr(fs, fd_ix, &rptr, &rlen);
     if (res >= 0 && rlen == 0) res = ERR_NIFFS_END_OF_FILE;
     if (res >= 0) {
-      u32_t clen = NIFFS_MIN(len, rlen);
-      niffs_memcpy(dst, rptr, clen);
-      dst += clen;
-      len -= clen;
-      read_len += clen;
-      res = niffs_seek(fs, fd_ix, clen, NIFFS_SEEK_CUR);
+      // scatter segment over entries, then seek past it
+      u32_t slen = NIFFS_MIN(len, rlen);
+      u32_t soffs = 0;
+      while (soffs < slen) {
+        u32_t clen = NIFFS_MIN(slen - soffs, iov->len - iov_offs);
+        niffs_memcpy(iov->base + iov_offs, rptr + soffs, clen);
+        soffs += clen;
+        iov_offs += clen;
+        if (iov_offs == iov->len) {
+          iov++;
+          iov_offs = 0;
+        }
+      }
+      len -= slen;
+      read_len += slen;
+      res = niffs_seek(fs, fd_ix, slen, NIFFS_SEEK_CUR);
     }
   } while (len > 0 && res >= 0);
 
@@ -171,6 +299,29 @@ int NIFFS_read(niffs *fs, int fd_ix, u8_t *dst, u32_t len) {
   return res == NIFFS_OK ? read_len : res;
 }
 
+int NIFFS_pread(niffs *fs, int fd_ix, u8_t *dst, u32_t len, u32_t offs) {
+  if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
+
+  s32_t read_len = 0;
+  while (len > 0) {
+    // copied a few pages at a time
+    niffs_iovec segs[4];
+    int nsegs = niffs_read_segments(fs, fd_ix, offs, len, segs, sizeof(segs) / sizeof(segs[0]));
+    if (nsegs < 0) return nsegs;
+    if (nsegs == 0) break;
+    int i;
+    for (i = 0; i < nsegs; i++) {
+      niffs_memcpy(dst, segs[i].base, segs[i].len);
+      dst += segs[i].len;
+      offs += segs[i].len;
+      len -= segs[i].len;
+      read_len += segs[i].len;
+    }
+  }
+
+  return read_len;
+}
+
 int NIFFS_lseek(niffs *fs, int fd_ix, s32_t offs, int whence) {
   if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
   int res = niffs_seek(fs, fd_ix, offs, whence);
@@ -200,48 +351,130 @@ int NIFFS_fremove(niffs *fs, int fd) {
   return niffs_truncate(fs, fd, 0);
 }
 
-int NIFFS_write(niffs *fs, int fd_ix, const u8_t *data, u32_t len) {
-  if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
-  int res;
-  niffs_file_desc *fd;
-  res = niffs_get_filedesc(fs, fd_ix, &fd);
-  if (res != NIFFS_OK) return res;
-  niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix);
+static int niffs_write_appendv(niffs *fs, int fd_ix, const niffs_iovec *iov, u32_t offs, u32_t len) {
+#if NIFFS_WRITE_CACHE
+  return niffs_wcache_appendv(fs, fd_ix, iov, offs, len);
+#else
+  return niffs_appendv(fs, fd_ix, iov, offs, len);
+#endif
+}
+
+// Writes given vector at given file offset, modifying existing data entry by
+// entry and appending the rest at once. Appends only, if opened for append.
+static int niffs_writev_at(niffs *fs, int fd_ix, niffs_file_desc *fd, u32_t offs, const niffs_iovec *iov, u32_t iovcnt) {
+  int res = NIFFS_OK;
+  u32_t len = 0;
+  u32_t i;
+  for (i = 0; i < iovcnt; i++) {
+    len += iov[i].len;
+  }
 
   s32_t written = 0;
-  if (fd->flags & NIFFS_O_APPEND) {
-    // always append
-    res = niffs_append(fs, fd_ix, data, len);
-    written += len;
-  } else {
+  if ((fd->flags & NIFFS_O_APPEND) == 0) {
     // check if modify and/or append
-    u32_t mod_len = (ohdr->len == NIFFS_UNDEF_LEN ? 0 : ohdr->len) - fd->offs;
+    u32_t mod_len = niffs_fd_len(fs, fd) - offs;
     mod_len = NIFFS_MIN(mod_len, len);
-    if (mod_len > 0) {
-      res = niffs_modify(fs, fd_ix, fd->offs, data, mod_len);
+    for (i = 0; (u32_t)written < mod_len; i++) {
+      u32_t elen = NIFFS_MIN(iov[i].len, mod_len - written);
+      if (elen == 0) continue;
+      res = niffs_modify(fs, fd_ix, offs + written, iov[i].base, elen);
       if (res != NIFFS_OK) return res;
-      len -= mod_len;
-      data += mod_len;
-      written += mod_len;
-    }
-    if (len > 0) {
-      res = niffs_append(fs, fd_ix, data, len);
-      written += len;
+      written += elen;
     }
   }
-
-//  if (res == NIFFS_OK) {
-//    res = niffs_seek(fs, fd_ix, len, NIFFS_SEEK_CUR);
-//  }
+  if ((u32_t)written < len) {
+    res = niffs_write_appendv(fs, fd_ix, iov, written, len - written);
+    written = len;
+  }
 
   return res == 0 ? written : res;
 }
 
+// one entry vector of given data, only read from when writing
+static niffs_iovec niffs_write_iov(const u8_t *data, u32_t len) {
+  union {
+    const u8_t *src;
+    u8_t *base;
+  } d = {.src = data};
+  niffs_iovec iov = {.base = d.base, .len = len};
+  return iov;
+}
+
+int NIFFS_write(niffs *fs, int fd_ix, const u8_t *data, u32_t len) {
+  niffs_iovec iov = niffs_write_iov(data, len);
+  return NIFFS_writev(fs, fd_ix, &iov, 1);
+}
+
+int NIFFS_pwrite(niffs *fs, int fd_ix, const u8_t *data, u32_t len, u32_t offs) {
+  if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
+  int res;
+  niffs_file_desc *fd;
+  res = niffs_get_filedesc(fs, fd_ix, &fd);
+  if (res != NIFFS_OK) return res;
+
+  if ((fd->flags & NIFFS_O_APPEND) == 0 && offs > niffs_fd_len(fs, fd)) return ERR_NIFFS_MODIFY_BEYOND_FILE;
+  u32_t fd_offs = fd->offs;
+  niffs_page_ix fd_pix = fd->cur_pix;
+
+  niffs_iovec iov = niffs_write_iov(data, len);
+  res = niffs_writev_at(fs, fd_ix, fd, offs, &iov, 1);
+
+  niffs_fd_restore_pos(fs, fd, fd_offs, fd_pix);
+
+  return res;
+}
+
+int NIFFS_writev(niffs *fs, int fd_ix, const niffs_iovec *iov, u32_t iovcnt) {
+  if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
+  int res;
+  niffs_file_desc *fd;
+  res = niffs_get_filedesc(fs, fd_ix, &fd);
+  if (res != NIFFS_OK) return res;
+  if (iov == 0 && iovcnt > 0) return ERR_NIFFS_NULL_PTR;
+
+  return niffs_writev_at(fs, fd_ix, fd, fd->offs, iov, iovcnt);
+}
+
 int NIFFS_fflush(niffs *fs, int fd) {
   if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
+#if _NIFFS_FD_SYNC
+  return niffs_fd_sync(fs, fd);
+#else
   (void)fd;
   return NIFFS_OK;
+#endif
+}
+
+#if NIFFS_FALLOCATE
+int NIFFS_fallocate(niffs *fs, int fd, u32_t len) {
+  if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
+  return niffs_fallocate(fs, fd, len);
+}
+#endif
+
+#if NIFFS_GC_STEP
+int NIFFS_gc_step(niffs *fs, u32_t max_page_moves, u8_t allow_erase) {
+  if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
+  return niffs_gc_step(fs, max_page_moves, allow_erase);
+}
+
+int NIFFS_gc_pending(niffs *fs) {
+  if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
+  return niffs_gc_pending(fs);
+}
+
+int NIFFS_set_gc_watermark(niffs *fs, u32_t free_pages) {
+  fs->gc_watermark = free_pages;
+  return NIFFS_OK;
 }
+#endif
+
+#if NIFFS_GC_POLICY
+int NIFFS_set_gc_policy(niffs *fs, niffs_gc_policy_f policy) {
+  fs->gc_policy = policy;
+  return NIFFS_OK;
+}
+#endif
 
 int NIFFS_stat(niffs *fs, const char *name, niffs_stat *s) {
   if (!fs->mounted) return ERR_NIFFS_NOT_MOUNTED;
@@ -266,7 +499,7 @@ int NIFFS_fstat(niffs *fs, int fd_ix, niffs_stat *s) {
   niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix);
 
   s->obj_id = ohdr->phdr.id.obj_id;
-  s->size = ohdr->len == NIFFS_UNDEF_LEN ? 0 : ohdr->len;
+  s->size = niffs_fd_len(fs, fd);
   s->type = ohdr->type;
   niffs_strncpy((char *)s->name, (char *)ohdr->name, NIFFS_NAME_LEN);
 
@@ -308,7 +541,6 @@ int NIFFS_closedir(niffs_DIR *d) {
 }
 
 static int niffs_readdir_v(niffs *fs, niffs_page_ix pix, niffs_page_hdr *phdr, void *v_arg) {
-  (void)fs;
   struct niffs_dirent *e = (struct niffs_dirent *)v_arg;
   if (_NIFFS_IS_FLAG_VALID(phdr) && !_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr)) {
     if (_NIFFS_IS_OBJ_HDR(phdr)) {
@@ -316,7 +548,7 @@ static int niffs_readdir_v(niffs *fs, niffs_page_ix pix, niffs_page_hdr *phdr, v
       niffs_object_hdr *ohdr = (niffs_object_hdr *)phdr;
       e->obj_id = ohdr->phdr.id.obj_id;
       e->pix = pix;
-      e->size = ohdr->len == NIFFS_UNDEF_LEN ? 0 : ohdr->len;
+      e->size = niffs_obj_len(fs, ohdr);
       e->type = ohdr->type;
       niffs_strncpy((char *)e->name, (char *)ohdr->name, NIFFS_NAME_LEN);
       return NIFFS_OK;
@@ -1,6 +1,15 @@
 #include "niffs_internal.h"
 
 static int niffs_ensure_free_pages(niffs *fs, u32_t pages);
+#if NIFFS_GC_PLAN
+static int niffs_gc_plan(niffs *fs, u32_t gain);
+#endif
+#if NIFFS_STATIC_WEAR
+static int niffs_static_wear(niffs *fs);
+#endif
+#if NIFFS_ASYNC_ERASE
+static int niffs_gc_erase_poll(niffs *fs, u8_t wait);
+#endif
 static int niffs_setup(niffs *fs);
 static int niffs_chk_tidy_movi_objhdr_page(niffs *fs, niffs_page_ix pix, niffs_page_ix *dst_pix);
 
@@ -15,9 +24,626 @@ static int niffs_chk_tidy_movi_objhdr_page(niffs *fs, niffs_page_ix pix, niffs_p
   }\
 }while(0);
 
+/////////////////////////////////// INDEX ////////////////////////////////////
+
+#if NIFFS_SPAN_INDEX
+
+#define _NIFFS_SPAN_INDEX_EMPTY   _NIFFS_PAGE_FREE_ID
+// span index hash table is kept at most three quarters full
+#define _NIFFS_SPAN_INDEX_FULL(_fs) \
+  (((_fs)->span_index_cnt + 1) * 4 > (_fs)->span_index_len * 3)
+
+static niffs_page_id_raw niffs_span_index_key(niffs_obj_id oid, niffs_span_ix spix) {
+  niffs_page_hdr_id id;
+  id.raw = 0;
+  id.obj_id = oid;
+  id.spix = spix;
+  return id.raw;
+}
+
+static u32_t niffs_span_index_hash(niffs *fs, niffs_page_id_raw key) {
+  return ((u32_t)key * 2654435761UL) % fs->span_index_len;
+}
+
+// returns entry index of given key, or of the empty entry ending the probe
+static u32_t niffs_span_index_slot(niffs *fs, niffs_page_id_raw key) {
+  u32_t ix = niffs_span_index_hash(fs, key);
+  while (fs->span_index[ix].id != _NIFFS_SPAN_INDEX_EMPTY && fs->span_index[ix].id != key) {
+    if (++ix >= fs->span_index_len) ix = 0;
+  }
+  return ix;
+}
+
+static void niffs_span_index_reset(niffs *fs) {
+  fs->span_index_cnt = 0;
+  fs->span_index_ovf = 0;
+  if (fs->span_index == 0) return;
+  niffs_memset(fs->span_index, 0xff, fs->span_index_len * sizeof(niffs_span_index_entry));
+}
+
+static void niffs_span_index_put(niffs *fs, niffs_page_id_raw key, niffs_page_ix pix) {
+  if (fs->span_index == 0 || fs->span_index_ovf) return;
+  u32_t ix = niffs_span_index_slot(fs, key);
+  if (fs->span_index[ix].id == _NIFFS_SPAN_INDEX_EMPTY) {
+    if (_NIFFS_SPAN_INDEX_FULL(fs)) {
+      NIFFS_DBG("  sidx: overflow at %i entries, scanning from now on\n", fs->span_index_cnt);
+      fs->span_index_ovf = 1;
+      return;
+    }
+    fs->span_index[ix].id = key;
+    fs->span_index_cnt++;
+  }
+  fs->span_index[ix].pix = pix;
+}
+
+static void niffs_span_index_remove(niffs *fs, niffs_page_id_raw key, niffs_page_ix pix) {
+  if (fs->span_index == 0 || fs->span_index_ovf) return;
+  u32_t ix = niffs_span_index_slot(fs, key);
+  if (fs->span_index[ix].id != key || fs->span_index[ix].pix != pix) return;
+  // backward shift deletion, keeps probe sequences intact without tombstones
+  u32_t nix = ix;
+  while (1) {
+    if (++nix >= fs->span_index_len) nix = 0;
+    if (fs->span_index[nix].id == _NIFFS_SPAN_INDEX_EMPTY) break;
+    u32_t home = niffs_span_index_hash(fs, fs->span_index[nix].id);
+    if ((nix > ix && (home <= ix || home > nix)) ||
+        (nix < ix && (home <= ix && home > nix))) {
+      fs->span_index[ix] = fs->span_index[nix];
+      ix = nix;
+    }
+  }
+  fs->span_index[ix].id = _NIFFS_SPAN_INDEX_EMPTY;
+  fs->span_index_cnt--;
+}
+
+// Looks up page index in span index. Returns NIFFS_VIS_CONT if index cannot
+// be trusted and scanning is needed.
+static int niffs_span_index_find(niffs *fs, niffs_page_ix *pix, niffs_obj_id oid, niffs_span_ix spix) {
+  if (fs->span_index == 0 || fs->span_index_ovf) return NIFFS_VIS_CONT;
+  niffs_page_id_raw key = niffs_span_index_key(oid, spix);
+  u32_t ix = niffs_span_index_slot(fs, key);
+  if (fs->span_index[ix].id != key) return ERR_NIFFS_PAGE_NOT_FOUND;
+  NIFFS_STAT_TRAVERSE(fs, fs->span_index[ix].pix);
+  niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, fs->span_index[ix].pix);
+  if (_NIFFS_IS_FLAG_VALID(phdr) && !_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr) && !_NIFFS_IS_MOVI(phdr) &&
+      phdr->id.obj_id == oid && phdr->id.spix == spix) {
+    *pix = fs->span_index[ix].pix;
+    return NIFFS_OK;
+  }
+  // stale or moving page, let scanning sort it out
+  return NIFFS_VIS_CONT;
+}
+
+// registers a page found when scanning the filesystem
+static void niffs_span_index_scanned(niffs *fs, niffs_page_ix pix, niffs_page_hdr *phdr) {
+  if (fs->span_index == 0 || fs->span_index_ovf) return;
+  niffs_page_id_raw key = niffs_span_index_key(phdr->id.obj_id, phdr->id.spix);
+  u32_t ix = niffs_span_index_slot(fs, key);
+  if (fs->span_index[ix].id == key) {
+    niffs_page_hdr *prev_phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, fs->span_index[ix].pix);
+    if (_NIFFS_IS_MOVI(phdr)) {
+      // prefer written pages
+      return;
+    } else if (!_NIFFS_IS_MOVI(prev_phdr)) {
+      // duplicate pages, aborted operation - leave it to scanning until checked
+      NIFFS_DBG("  sidx: pix %04x duplicate oid:%04x spix:%i, scanning from now on\n", pix, phdr->id.obj_id, phdr->id.spix);
+      fs->span_index_ovf = 1;
+      return;
+    }
+  }
+  niffs_span_index_put(fs, key, pix);
+}
+
+#endif // NIFFS_SPAN_INDEX
+
+#if NIFFS_NAME_INDEX
+
+#define _NIFFS_NAME_INDEX_EMPTY   ((niffs_page_ix)-1)
+// name index hash table is kept at most three quarters full
+#define _NIFFS_NAME_INDEX_FULL(_fs) \
+  (((_fs)->name_index_cnt + 1) * 4 > (_fs)->name_index_len * 3)
+
+// fnv-1a of name, as far as it would be stored in an object header
+static u32_t niffs_name_hash(const u8_t *name) {
+  u32_t hash = 2166136261UL;
+  u32_t i;
+  for (i = 0; i < NIFFS_NAME_LEN && name[i] != 0; i++) {
+    hash = (hash ^ name[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+static void niffs_name_index_reset(niffs *fs) {
+  fs->name_index_cnt = 0;
+  fs->name_index_ovf = 0;
+  if (fs->name_index == 0) return;
+  u32_t ix;
+  for (ix = 0; ix < fs->name_index_len; ix++) {
+    fs->name_index[ix].pix = _NIFFS_NAME_INDEX_EMPTY;
+  }
+}
+
+static void niffs_name_index_put(niffs *fs, u32_t hash, niffs_page_ix pix) {
+  if (fs->name_index == 0 || fs->name_index_ovf) return;
+  u32_t ix = hash % fs->name_index_len;
+  while (fs->name_index[ix].pix != _NIFFS_NAME_INDEX_EMPTY) {
+    if (fs->name_index[ix].pix == pix && fs->name_index[ix].hash == hash) return;
+    if (++ix >= fs->name_index_len) ix = 0;
+  }
+  if (_NIFFS_NAME_INDEX_FULL(fs)) {
+    NIFFS_DBG("  nidx: overflow at %i entries, scanning from now on\n", fs->name_index_cnt);
+    fs->name_index_ovf = 1;
+    return;
+  }
+  fs->name_index[ix].hash = hash;
+  fs->name_index[ix].pix = pix;
+  fs->name_index_cnt++;
+}
+
+static void niffs_name_index_remove(niffs *fs, u32_t hash, niffs_page_ix pix) {
+  if (fs->name_index == 0 || fs->name_index_ovf) return;
+  u32_t ix = hash % fs->name_index_len;
+  while (fs->name_index[ix].pix != pix || fs->name_index[ix].hash != hash) {
+    if (fs->name_index[ix].pix == _NIFFS_NAME_INDEX_EMPTY) return;
+    if (++ix >= fs->name_index_len) ix = 0;
+  }
+  // backward shift deletion, keeps probe sequences intact without tombstones
+  u32_t nix = ix;
+  while (1) {
+    if (++nix >= fs->name_index_len) nix = 0;
+    if (fs->name_index[nix].pix == _NIFFS_NAME_INDEX_EMPTY) break;
+    u32_t home = fs->name_index[nix].hash % fs->name_index_len;
+    if ((nix > ix && (home <= ix || home > nix)) ||
+        (nix < ix && (home <= ix && home > nix))) {
+      fs->name_index[ix] = fs->name_index[nix];
+      ix = nix;
+    }
+  }
+  fs->name_index[ix].pix = _NIFFS_NAME_INDEX_EMPTY;
+  fs->name_index_cnt--;
+}
+
+// Calls visitor for each page in name index whose name hash matches given
+// name. The visitor must verify the page itself, entries may be stale. Like
+// niffs_traverse, returns NIFFS_VIS_END or visitor result. Returns
+// NIFFS_VIS_CONT if index cannot be trusted and scanning is needed.
+static int niffs_name_index_visit(niffs *fs, const char *name, niffs_visitor_f v, void *v_arg) {
+  if (fs->name_index == 0 || fs->name_index_ovf) return NIFFS_VIS_CONT;
+  u32_t hash = niffs_name_hash((const u8_t *)name);
+  u32_t ix = hash % fs->name_index_len;
+  while (fs->name_index[ix].pix != _NIFFS_NAME_INDEX_EMPTY) {
+    if (fs->name_index[ix].hash == hash) {
+      niffs_page_ix pix = fs->name_index[ix].pix;
+      NIFFS_STAT_TRAVERSE(fs, pix);
+      int res = v(fs, pix, (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix), v_arg);
+      if (res != NIFFS_VIS_CONT) return res;
+    }
+    if (++ix >= fs->name_index_len) ix = 0;
+  }
+  return NIFFS_VIS_END;
+}
+
+static u32_t niffs_name_index_page_hash(niffs *fs, niffs_page_ix pix) {
+  niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+  return niffs_name_hash(ohdr->name);
+}
+
+#endif // NIFFS_NAME_INDEX
+
+// Checks if free pages of given sector must not be handed out.
+static int niffs_is_excl_sector(niffs *fs, u32_t sector, u32_t excl_sector, u32_t avoid_sector) {
+#if NIFFS_GC_STEP
+  // sector being collected in steps is about to be erased
+  if (fs->gc_active && sector == fs->gc_sector) return 1;
+#else
+  (void)fs;
+#endif
+  return sector == excl_sector || sector == avoid_sector;
+}
+
+#if NIFFS_FREE_MAP
+
+static void niffs_free_map_set(niffs *fs, niffs_page_ix pix) {
+  fs->free_map[pix/32] |= (1UL<<(pix&31));
+}
+
+static void niffs_free_map_clr(niffs *fs, niffs_page_ix pix) {
+  fs->free_map[pix/32] &= ~(1UL<<(pix&31));
+}
+
+// Finds first free page from given page, wrapping. Stale bits are cleared
+// on the way. Returns NIFFS_VIS_CONT if map is not used and scanning is needed.
+static int niffs_free_map_find(niffs *fs, niffs_page_ix *pix, niffs_page_ix start_pix, u32_t excl_sector, u32_t avoid_sector) {
+  if (fs->free_map == 0) return NIFFS_VIS_CONT;
+  u32_t words = _NIFFS_FREE_MAP_WORDS(fs);
+  if (start_pix >= fs->pages_per_sector * fs->sectors) start_pix = 0;
+  u32_t wix = start_pix/32;
+  // first word, ignore pages before start
+  u32_t mask = (u32_t)-1 << (start_pix&31);
+  u32_t i;
+  // one extra word to get the pages before start in first word
+  for (i = 0; i <= words; i++) {
+    u32_t w = fs->free_map[wix] & mask;
+    while (w) {
+      niffs_page_ix fpix = wix*32 + niffs_ctz(w);
+      w &= w - 1;
+      if (niffs_is_excl_sector(fs, _NIFFS_PIX_2_SECTOR(fs, fpix), excl_sector, avoid_sector)) {
+        continue;
+      }
+      niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, fpix);
+      if (_NIFFS_IS_FREE(phdr) && _NIFFS_IS_CLEA(phdr)) {
+        *pix = fpix;
+        return NIFFS_OK;
+      }
+      // page taken without being registered, e.g. aborted write or hard delete
+      niffs_free_map_clr(fs, fpix);
+    }
+    mask = (u32_t)-1;
+    if (++wix >= words) wix = 0;
+  }
+  return ERR_NIFFS_NO_FREE_PAGE;
+}
+
+#endif // NIFFS_FREE_MAP
+
+#if NIFFS_ID_MAP
+
+static void niffs_id_map_set(niffs *fs, niffs_obj_id oid) {
+  u32_t bix = (u32_t)oid - 1;
+  // ids of bad pages might be anything
+  if (oid == 0 || bix >= _NIFFS_ID_MAP_IDS(fs)) return;
+  fs->id_map[bix/32] |= (1UL<<(bix&31));
+}
+
+static void niffs_id_map_clr(niffs *fs, niffs_obj_id oid) {
+  u32_t bix = (u32_t)oid - 1;
+  if (oid == 0 || bix >= _NIFFS_ID_MAP_IDS(fs)) return;
+  fs->id_map[bix/32] &= ~(1UL<<(bix&31));
+}
+
+// Finds first unused id from cursor, wrapping, and moves cursor past it.
+static int niffs_id_map_alloc(niffs *fs, niffs_obj_id *oid) {
+  u32_t ids = _NIFFS_ID_MAP_IDS(fs);
+  u32_t words = _NIFFS_ID_MAP_WORDS(fs);
+  if (fs->id_cursor >= ids) fs->id_cursor = 0;
+  u32_t wix = fs->id_cursor/32;
+  // first word, ignore ids before cursor
+  u32_t mask = (u32_t)-1 << (fs->id_cursor&31);
+  u32_t i;
+  // one extra word to get the ids before cursor in first word
+  for (i = 0; i <= words; i++) {
+    u32_t w = ~fs->id_map[wix] & mask;
+    if (w) {
+      u32_t bix = wix*32 + niffs_ctz(w);
+      if (bix < ids) {
+        *oid = bix + 1;
+        fs->id_cursor = bix + 1;
+        return NIFFS_OK;
+      }
+      // only bits beyond last id left, wrap
+    }
+    mask = (u32_t)-1;
+    if (++wix >= words) wix = 0;
+  }
+  return ERR_NIFFS_NO_FREE_ID;
+}
+
+#endif // NIFFS_ID_MAP
+
+#if NIFFS_LINEAR_AREA
+
+// number of linear sectors occupied by given linear file
+static u32_t niffs_linear_file_sectors(niffs *fs, niffs_linear_file_hdr *lfhdr) {
+  u32_t file_len = _NIFFS_OHDR_FILE_LEN(&lfhdr->ohdr);
+  u32_t resv_sects = lfhdr->resv_sectors;
+  u32_t file_sects = (file_len + fs->sector_size - 1) / fs->sector_size;
+  u32_t sects = NIFFS_MAX(resv_sects, file_sects);
+  return NIFFS_MAX(1, sects);
+}
+
+#if NIFFS_LINEAR_EXTENTS
+
+static void niffs_lin_extents_reset(niffs *fs) {
+  fs->lin_extents_cnt = 0;
+  fs->lin_extents_ovf = 0;
+}
+
+// Registers or updates the extent of given page, if it is a linear file
+// object header. Each header page has its own extent, just as when scanning.
+static void niffs_lin_extents_put(niffs *fs, niffs_page_ix pix, niffs_page_hdr *phdr) {
+  if (fs->lin_extents == 0 || fs->lin_extents_ovf) return;
+  if (!_NIFFS_IS_FLAG_VALID(phdr) || _NIFFS_IS_FREE(phdr) || _NIFFS_IS_DELE(phdr) ||
+      !_NIFFS_IS_OBJ_HDR(phdr) || ((niffs_object_hdr *)phdr)->type != _NIFFS_FTYPE_LINFILE) {
+    return;
+  }
+  niffs_linear_file_hdr *lfhdr = (niffs_linear_file_hdr *)phdr;
+  u32_t sects = niffs_linear_file_sectors(fs, lfhdr);
+  if (sects > fs->lin_sectors) {
+    // length oob, do not let this file contaminate the map
+    return;
+  }
+  u32_t ix;
+  for (ix = 0; ix < fs->lin_extents_cnt; ix++) {
+    if (fs->lin_extents[ix].pix == pix) break;
+  }
+  if (ix == fs->lin_extents_cnt) {
+    if (ix >= fs->lin_extents_len) {
+      NIFFS_DBG("  lext: overflow at %i entries, scanning from now on\n", fs->lin_extents_cnt);
+      fs->lin_extents_ovf = 1;
+      return;
+    }
+    fs->lin_extents_cnt++;
+  }
+  niffs_linear_extent *ext = &fs->lin_extents[ix];
+  ext->pix = pix;
+  ext->oid = phdr->id.obj_id;
+  ext->start_sector = lfhdr->start_sector;
+  ext->sectors = sects;
+}
+
+static void niffs_lin_extents_remove(niffs *fs, niffs_page_ix pix) {
+  if (fs->lin_extents == 0 || fs->lin_extents_ovf) return;
+  u32_t ix;
+  for (ix = 0; ix < fs->lin_extents_cnt; ix++) {
+    if (fs->lin_extents[ix].pix == pix) {
+      fs->lin_extents[ix] = fs->lin_extents[--fs->lin_extents_cnt];
+      return;
+    }
+  }
+}
+
+static void niffs_lin_extents_remove_sector(niffs *fs, u32_t sector_ix) {
+  if (fs->lin_extents == 0 || fs->lin_extents_ovf) return;
+  u32_t ix = 0;
+  while (ix < fs->lin_extents_cnt) {
+    if (_NIFFS_PIX_2_SECTOR(fs, fs->lin_extents[ix].pix) == sector_ix) {
+      fs->lin_extents[ix] = fs->lin_extents[--fs->lin_extents_cnt];
+    } else {
+      ix++;
+    }
+  }
+}
+
+#endif // NIFFS_LINEAR_EXTENTS
+
+#endif // NIFFS_LINEAR_AREA
+
+// called when a page has been given an id
+static void niffs_index_page_written(niffs *fs, niffs_page_ix pix) {
+  niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+#if NIFFS_SPAN_INDEX
+  niffs_span_index_put(fs, niffs_span_index_key(phdr->id.obj_id, phdr->id.spix), pix);
+#endif
+#if NIFFS_NAME_INDEX
+  if (phdr->id.spix == 0) {
+    niffs_name_index_put(fs, niffs_name_index_page_hash(fs, pix), pix);
+  }
+#endif
+#if NIFFS_FREE_MAP
+  if (fs->free_map) niffs_free_map_clr(fs, pix);
+#endif
+#if NIFFS_ID_MAP
+  if (fs->id_map) niffs_id_map_set(fs, phdr->id.obj_id);
+#endif
+#if NIFFS_SECTOR_INFO
+  if (fs->sector_info) {
+    // written pages are always free before
+    niffs_sector_info *si = &fs->sector_info[_NIFFS_PIX_2_SECTOR(fs, pix)];
+    si->free_pages--;
+    si->busy_pages++;
+  }
+#endif
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+  niffs_lin_extents_put(fs, pix, phdr);
+#endif
+  (void)phdr;
+}
+
+// called when an object header has been updated in place
+static void niffs_index_ohdr_updated(niffs *fs, niffs_page_ix pix) {
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+  niffs_lin_extents_put(fs, pix, (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix));
+#endif
+  (void)fs;
+  (void)pix;
+}
+
+// called when a file and all its pages have been removed
+static void niffs_index_file_removed(niffs *fs, niffs_obj_id oid) {
+#if NIFFS_ID_MAP
+  if (fs->id_map) niffs_id_map_clr(fs, oid);
+#endif
+  (void)fs;
+  (void)oid;
+}
+
+// called when a page having given id has been deleted
+static void niffs_index_page_deleted(niffs *fs, niffs_page_ix pix, niffs_page_hdr_id id) {
+#if NIFFS_SPAN_INDEX
+  niffs_span_index_remove(fs, niffs_span_index_key(id.obj_id, id.spix), pix);
+#endif
+#if NIFFS_NAME_INDEX
+  // name is still readable, only the id is cleared on deletion
+  if (id.spix == 0) {
+    niffs_name_index_remove(fs, niffs_name_index_page_hash(fs, pix), pix);
+  }
+#endif
+#if NIFFS_SECTOR_INFO
+  // pages with bad flags already count as deleted
+  if (fs->sector_info && _NIFFS_IS_FLAG_VALID((niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix))) {
+    niffs_sector_info *si = &fs->sector_info[_NIFFS_PIX_2_SECTOR(fs, pix)];
+    si->busy_pages--;
+    si->dele_pages++;
+  }
+#endif
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+  if (id.spix == 0) {
+    niffs_lin_extents_remove(fs, pix);
+  }
+#endif
+  (void)fs;
+  (void)pix;
+  (void)id;
+}
+
+#if NIFFS_CHECKPOINT
+// called when a free page is taken and deleted without its contents ever
+// being registered
+static void niffs_index_page_dropped(niffs *fs, niffs_page_ix pix) {
+#if NIFFS_FREE_MAP
+  if (fs->free_map) niffs_free_map_clr(fs, pix);
+#endif
+#if NIFFS_SECTOR_INFO
+  if (fs->sector_info) {
+    niffs_sector_info *si = &fs->sector_info[_NIFFS_PIX_2_SECTOR(fs, pix)];
+    si->free_pages--;
+    si->dele_pages++;
+  }
+#endif
+  (void)fs;
+  (void)pix;
+}
+#endif
+
+// called when scanning the filesystem, before any page is registered
+static void niffs_index_reset(niffs *fs) {
+#if NIFFS_SPAN_INDEX
+  niffs_span_index_reset(fs);
+#endif
+#if NIFFS_NAME_INDEX
+  niffs_name_index_reset(fs);
+#endif
+#if NIFFS_FREE_MAP
+  if (fs->free_map) niffs_memset(fs->free_map, 0, _NIFFS_FREE_MAP_WORDS(fs) * sizeof(u32_t));
+#endif
+#if NIFFS_ID_MAP
+  if (fs->id_map) niffs_memset(fs->id_map, 0, _NIFFS_ID_MAP_WORDS(fs) * sizeof(u32_t));
+  fs->id_cursor = 0;
+#endif
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+  niffs_lin_extents_reset(fs);
+#endif
+  (void)fs;
+}
+
+// called when scanning the filesystem, before any page in sector is registered
+static void niffs_index_sector_scanned(niffs *fs, u32_t sector_ix) {
+#if NIFFS_SECTOR_INFO
+  if (fs->sector_info) {
+    niffs_sector_info *si = &fs->sector_info[sector_ix];
+    si->era_cnt = ((niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(fs, sector_ix))->era_cnt;
+    si->free_pages = 0;
+    si->dele_pages = 0;
+    si->busy_pages = 0;
+  }
+#endif
+  (void)fs;
+  (void)sector_ix;
+}
+
+// called when a sector has been erased, all its pages being free
+static void niffs_index_sector_erased(niffs *fs, u32_t sector_ix) {
+#if NIFFS_SECTOR_INFO
+  if (fs->sector_info) {
+    niffs_sector_info *si = &fs->sector_info[sector_ix];
+    si->era_cnt = ((niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(fs, sector_ix))->era_cnt;
+    si->free_pages = fs->pages_per_sector;
+    si->dele_pages = 0;
+    si->busy_pages = 0;
+  }
+#endif
+#if NIFFS_FREE_MAP
+  if (fs->free_map) {
+    niffs_page_ix ipix;
+    for (ipix = 0; ipix < fs->pages_per_sector; ipix++) {
+      niffs_free_map_set(fs, _NIFFS_PIX_AT_SECTOR(fs, sector_ix) + ipix);
+    }
+  }
+#endif
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+  niffs_lin_extents_remove_sector(fs, sector_ix);
+#endif
+  (void)fs;
+  (void)sector_ix;
+}
+
+// called for each page when scanning the filesystem
+static void niffs_index_page_scanned(niffs *fs, niffs_page_ix pix, niffs_page_hdr *phdr) {
+#if NIFFS_SPAN_INDEX
+  if (_NIFFS_IS_FLAG_VALID(phdr) && !_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr)) {
+    niffs_span_index_scanned(fs, pix, phdr);
+  }
+#endif
+#if NIFFS_NAME_INDEX
+  if (_NIFFS_IS_FLAG_VALID(phdr) && !_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr) && phdr->id.spix == 0) {
+    niffs_name_index_put(fs, niffs_name_index_page_hash(fs, pix), pix);
+  }
+#endif
+#if NIFFS_FREE_MAP
+  if (fs->free_map && _NIFFS_IS_FREE(phdr) && _NIFFS_IS_CLEA(phdr)) {
+    niffs_free_map_set(fs, pix);
+  }
+#endif
+#if NIFFS_ID_MAP
+  if (fs->id_map && !_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr)) {
+    niffs_id_map_set(fs, phdr->id.obj_id);
+  }
+#endif
+#if NIFFS_SECTOR_INFO
+  if (fs->sector_info) {
+    niffs_sector_info *si = &fs->sector_info[_NIFFS_PIX_2_SECTOR(fs, pix)];
+    if (_NIFFS_IS_FREE(phdr) && _NIFFS_IS_CLEA(phdr)) {
+      si->free_pages++;
+    } else if (_NIFFS_IS_DELE(phdr) || !_NIFFS_IS_FLAG_VALID(phdr)) {
+      si->dele_pages++;
+    } else {
+      si->busy_pages++;
+    }
+  }
+#endif
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+  niffs_lin_extents_put(fs, pix, phdr);
+#endif
+  (void)fs;
+  (void)pix;
+  (void)phdr;
+}
+
 //////////////////////////////////// BASE ////////////////////////////////////
 
+#if NIFFS_ASYNC_ERASE
+// flash cannot be written while erasing, nor can the sector being erased be
+// read, so finish any erase in flight first
+#define NIFFS_ERASE_WAIT(_fs) do { \
+    if ((_fs)->er_sector != NIFFS_EXCL_SECT_NONE) { \
+      int _res = niffs_gc_erase_poll((_fs), 1); \
+      if (_res) return _res; \
+    } \
+  } while (0)
+#else
+#define NIFFS_ERASE_WAIT(_fs)
+#endif
+
+static int niffs_hal_write(niffs *fs, u8_t *addr, const u8_t *src, u32_t len) {
+  NIFFS_ERASE_WAIT(fs);
+  int res = fs->hal_wr(addr, src, len);
+#if NIFFS_CHECKPOINT
+  if (res) fs->ckpt_unclean = 1;
+#endif
+  return res;
+}
+
+static int niffs_hal_erase(niffs *fs, u8_t *addr, u32_t len) {
+  NIFFS_ERASE_WAIT(fs);
+  int res = fs->hal_er(addr, len);
+#if NIFFS_CHECKPOINT
+  if (res) fs->ckpt_unclean = 1;
+#endif
+  return res;
+}
+
 int niffs_traverse(niffs *fs, niffs_page_ix pix_start, niffs_page_ix pix_end, niffs_visitor_f v, void *v_arg) {
+  NIFFS_ERASE_WAIT(fs);
   int res = NIFFS_OK;
   int v_res = NIFFS_OK;
   niffs_page_ix pix = pix_start;
@@ -27,6 +653,7 @@ int niffs_traverse(niffs *fs, niffs_page_ix pix_start, niffs_page_ix pix_end, ni
   }
   do {
     niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+    NIFFS_STAT_TRAVERSE(fs, pix);
     v_res = v(fs, pix, phdr, v_arg);
     if (v_res != NIFFS_VIS_CONT) {
       res = v_res;
@@ -94,6 +721,38 @@ static void niffs_inform_page_delete(niffs *fs, niffs_page_ix pix) {
   }
 }
 
+#if NIFFS_DEAD_ERASE
+// Queues sector for erase if all its pages are deleted.
+static void niffs_dead_sector_check(niffs *fs, u32_t sector) {
+#if NIFFS_SECTOR_INFO
+  if (fs->sector_info) {
+    if (fs->sector_info[sector].dele_pages != fs->pages_per_sector) return;
+  } else
+#endif
+  {
+    niffs_page_ix ipix;
+    for (ipix = 0; ipix < fs->pages_per_sector; ipix++) {
+      niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, _NIFFS_PIX_AT_SECTOR(fs, sector) + ipix);
+      if (!_NIFFS_IS_DELE(phdr) && _NIFFS_IS_FLAG_VALID(phdr)) return;
+    }
+  }
+  if (fs->dead_cnt < NIFFS_DEAD_ERASE) {
+    NIFFS_DBG("  dead: sector %i queued\n", sector);
+    fs->dead_sectors[fs->dead_cnt++] = sector;
+  }
+}
+
+static void niffs_dead_sector_remove(niffs *fs, u32_t sector) {
+  u32_t i;
+  for (i = 0; i < fs->dead_cnt; i++) {
+    if (fs->dead_sectors[i] == sector) {
+      fs->dead_sectors[i] = fs->dead_sectors[--fs->dead_cnt];
+      return;
+    }
+  }
+}
+#endif
+
 TESTATIC int niffs_delete_page(niffs *fs, niffs_page_ix pix) {
   niffs_page_id_raw delete_raw_id = _NIFFS_PAGE_DELE_ID;
 
@@ -103,11 +762,16 @@ TESTATIC int niffs_delete_page(niffs *fs, niffs_page_ix pix) {
   }
   if (_NIFFS_IS_DELE(phdr)) check(ERR_NIFFS_DELETING_DELETED_PAGE);
   NIFFS_DBG("  dele: pix %04x\n", pix);
-  int res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + offsetof(niffs_page_hdr, id), (u8_t *)&delete_raw_id, sizeof(niffs_page_id_raw));
+  niffs_page_hdr_id id = phdr->id;
+  int res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + offsetof(niffs_page_hdr, id), (u8_t *)&delete_raw_id, sizeof(niffs_page_id_raw));
   check(res);
   if (res == NIFFS_OK) {
     fs->dele_pages++;
+    niffs_index_page_deleted(fs, pix, id);
     niffs_inform_page_delete(fs, pix);
+#if NIFFS_DEAD_ERASE
+    niffs_dead_sector_check(fs, _NIFFS_PIX_2_SECTOR(fs, pix));
+#endif
   }
   return res;
 }
@@ -121,15 +785,18 @@ int niffs_get_filedesc(niffs *fs, int fd_ix, niffs_file_desc **fd) {
 
 typedef struct {
   const char *conflict_name;
+  u8_t map_ids;
 } niffs_find_free_id_arg;
 
 static int niffs_find_free_id_v(niffs *fs, niffs_page_ix pix, niffs_page_hdr *phdr, void *v_arg) {
   (void)pix;
   niffs_find_free_id_arg *arg = (niffs_find_free_id_arg *)v_arg;
   if (!_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr)) {
-    niffs_obj_id oid = phdr->id.obj_id;
-    --oid;
-    fs->buf[oid/8] |= 1<<(oid&7);
+    if (arg->map_ids) {
+      niffs_obj_id oid = phdr->id.obj_id;
+      --oid;
+      fs->buf[oid/8] |= 1<<(oid&7);
+    }
     if (arg->conflict_name && phdr->id.spix == 0) {
       // object header page
       niffs_object_hdr *ohdr = (niffs_object_hdr *)phdr;
@@ -143,9 +810,34 @@ static int niffs_find_free_id_v(niffs *fs, niffs_page_ix pix, niffs_page_hdr *ph
 
 TESTATIC int niffs_find_free_id(niffs *fs, niffs_obj_id *oid, const char *conflict_name) {
   if (oid == 0) check(ERR_NIFFS_NULL_PTR);
+  niffs_find_free_id_arg arg = {.conflict_name = conflict_name, .map_ids = 0};
+  int res;
+#if NIFFS_NAME_INDEX
+  if (conflict_name) {
+    res = niffs_name_index_visit(fs, conflict_name, niffs_find_free_id_v, &arg);
+    if (res == NIFFS_VIS_END) {
+      // no conflict, no need to compare names when scanning
+      arg.conflict_name = 0;
+    } else if (res != NIFFS_VIS_CONT) {
+      check(res);
+    }
+  }
+#endif
+#if NIFFS_ID_MAP
+  if (fs->id_map) {
+    if (arg.conflict_name) {
+      // ids are known, only scan for names
+      res = niffs_traverse(fs, 0, 0, niffs_find_free_id_v, &arg);
+      if (res != NIFFS_VIS_END) check(res);
+    }
+    res = niffs_id_map_alloc(fs, oid);
+    check(res);
+    return res;
+  }
+#endif
   niffs_memset(fs->buf, 0, fs->buf_len);
-  niffs_find_free_id_arg arg = {.conflict_name = conflict_name};
-  int res = niffs_traverse(fs, 0, 0, niffs_find_free_id_v, &arg);
+  arg.map_ids = 1;
+  res = niffs_traverse(fs, 0, 0, niffs_find_free_id_v, &arg);
 
   if (res != NIFFS_VIS_END) check(res);
 
@@ -170,11 +862,12 @@ TESTATIC int niffs_find_free_id(niffs *fs, niffs_obj_id *oid, const char *confli
 typedef struct {
   niffs_page_ix *pix;
   u32_t excl_sector;
+  u32_t avoid_sector;
 } niffs_find_free_page_arg;
 
 static int niffs_find_free_page_v(niffs *fs, niffs_page_ix pix, niffs_page_hdr *phdr, void *v_arg) {
   niffs_find_free_page_arg *arg = (niffs_find_free_page_arg *)v_arg;
-  if (arg->excl_sector != NIFFS_EXCL_SECT_NONE && _NIFFS_PIX_2_SECTOR(fs, pix) == arg->excl_sector) {
+  if (niffs_is_excl_sector(fs, _NIFFS_PIX_2_SECTOR(fs, pix), arg->excl_sector, arg->avoid_sector)) {
     return NIFFS_VIS_CONT;
   }
   if (_NIFFS_IS_FREE(phdr) && _NIFFS_IS_CLEA(phdr)) {
@@ -184,22 +877,59 @@ static int niffs_find_free_page_v(niffs *fs, niffs_page_ix pix, niffs_page_hdr *
   return NIFFS_VIS_CONT;
 }
 
-TESTATIC int niffs_find_free_page(niffs *fs, niffs_page_ix *pix, u32_t excl_sector) {
+// Finds a free page from given cursor, preferably not in avoid_sector, and
+// moves cursor to found page.
+static int niffs_find_free_page_from(niffs *fs, niffs_page_ix *pix, niffs_page_ix *cursor,
+    u32_t excl_sector, u32_t avoid_sector) {
   if (pix == 0) check(ERR_NIFFS_NULL_PTR);
 
   niffs_find_free_page_arg arg = {
       .pix = pix,
-      .excl_sector = excl_sector
+      .excl_sector = excl_sector,
+      .avoid_sector = avoid_sector
   };
-  int res = niffs_traverse(fs, fs->last_free_pix, fs->last_free_pix, niffs_find_free_page_v, &arg);
+  int res = NIFFS_VIS_CONT;
+#if NIFFS_FREE_MAP
+  res = niffs_free_map_find(fs, pix, *cursor, excl_sector, avoid_sector);
+#endif
+  if (res == NIFFS_VIS_CONT) {
+    res = niffs_traverse(fs, *cursor, *cursor, niffs_find_free_page_v, &arg);
+  }
   if (res == NIFFS_VIS_END) {
     res = ERR_NIFFS_NO_FREE_PAGE;
-  } else {
-    fs->last_free_pix = *pix;
+  }
+  if (res == ERR_NIFFS_NO_FREE_PAGE && avoid_sector != NIFFS_EXCL_SECT_NONE) {
+    // nothing elsewhere, take it from avoided sector
+    return niffs_find_free_page_from(fs, pix, cursor, excl_sector, NIFFS_EXCL_SECT_NONE);
+  }
+  if (res == NIFFS_OK) {
+    *cursor = *pix;
   }
   return res;
 }
 
+TESTATIC int niffs_find_free_page(niffs *fs, niffs_page_ix *pix, u32_t excl_sector) {
+#if NIFFS_COLD_HEAD
+  // keep clear of sector being filled by the cold head
+  return niffs_find_free_page_from(fs, pix, &fs->last_free_pix, excl_sector, fs->cold_sector);
+#else
+  return niffs_find_free_page_from(fs, pix, &fs->last_free_pix, excl_sector, NIFFS_EXCL_SECT_NONE);
+#endif
+}
+
+#if NIFFS_COLD_HEAD
+// Finds a free page for data not expected to change, preferably not in the
+// sector being filled by user writes.
+static int niffs_find_free_page_cold(niffs *fs, niffs_page_ix *pix, u32_t excl_sector) {
+  int res = niffs_find_free_page_from(fs, pix, &fs->last_cold_pix, excl_sector,
+      _NIFFS_PIX_2_SECTOR(fs, fs->last_free_pix));
+  if (res == NIFFS_OK) {
+    fs->cold_sector = _NIFFS_PIX_2_SECTOR(fs, *pix);
+  }
+  return res;
+}
+#endif
+
 typedef struct {
   niffs_page_ix pix;
   u8_t mov_found;
@@ -239,7 +969,12 @@ TESTATIC int niffs_find_page(niffs *fs, niffs_page_ix *pix, niffs_obj_id oid, ni
     .spix = spix,
     .mov_found = 0
   };
-  int res = niffs_traverse(fs, start_pix, start_pix, niffs_find_page_v, &arg);
+  int res;
+#if NIFFS_SPAN_INDEX
+  res = niffs_span_index_find(fs, pix, oid, spix);
+  if (res != NIFFS_VIS_CONT) return res;
+#endif
+  res = niffs_traverse(fs, start_pix, start_pix, niffs_find_page_v, &arg);
   if (res == NIFFS_VIS_END) {
     if (arg.mov_found) {
       NIFFS_DBG("  find: pix %04x warn found MOVI when looking for obj id:%04x spix:%i\n", arg.pix_mov, oid, spix);
@@ -254,7 +989,8 @@ TESTATIC int niffs_find_page(niffs *fs, niffs_page_ix *pix, niffs_obj_id oid, ni
   return res;
 }
 
-TESTATIC int niffs_erase_sector(niffs *fs, u32_t sector_ix) {
+// Returns erase count of given sector once erased, and updates max_era.
+static niffs_erase_cnt niffs_erase_sector_era(niffs *fs, u32_t sector_ix) {
   niffs_sector_hdr shdr;
   niffs_sector_hdr *target_shdr = (niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(fs, sector_ix);
   if (target_shdr->abra == _NIFFS_SECT_MAGIC(fs)) {
@@ -277,13 +1013,27 @@ TESTATIC int niffs_erase_sector(niffs *fs, u32_t sector_ix) {
     // no magic, presume invalid erase count
     shdr.era_cnt = fs->max_era;
   }
+  return shdr.era_cnt;
+}
+
+// Writes sector header of given erased sector.
+static int niffs_erase_sector_hdr(niffs *fs, u32_t sector_ix, niffs_erase_cnt era_cnt) {
+  niffs_sector_hdr shdr;
+  shdr.era_cnt = era_cnt;
   shdr.abra = _NIFFS_SECT_MAGIC(fs);
-  NIFFS_DBG("erase : sector %i era_cnt:%i\n", sector_ix, shdr.era_cnt);
+  int res = niffs_hal_write(fs, (u8_t *)_NIFFS_SECTOR_2_ADDR(fs, sector_ix), (u8_t *)&shdr, sizeof(niffs_sector_hdr));
+  check(res);
+  niffs_index_sector_erased(fs, sector_ix);
+  return res;
+}
+
+TESTATIC int niffs_erase_sector(niffs *fs, u32_t sector_ix) {
+  niffs_erase_cnt era_cnt = niffs_erase_sector_era(fs, sector_ix);
+  NIFFS_DBG("erase : sector %i era_cnt:%i\n", sector_ix, era_cnt);
 
-  int res = fs->hal_er(_NIFFS_SECTOR_2_ADDR(fs, sector_ix), fs->sector_size);
+  int res = niffs_hal_erase(fs, _NIFFS_SECTOR_2_ADDR(fs, sector_ix), fs->sector_size);
   if (res == NIFFS_OK) {
-    res = fs->hal_wr((u8_t *)_NIFFS_SECTOR_2_ADDR(fs, sector_ix), (u8_t *)&shdr, sizeof(niffs_sector_hdr));
-    check(res);
+    res = niffs_erase_sector_hdr(fs, sector_ix, era_cnt);
   }
   return res;
 }
@@ -310,7 +1060,7 @@ TESTATIC int niffs_move_page(niffs *fs, niffs_page_ix src_pix, niffs_page_ix dst
   // mark src as moving
   if (!_NIFFS_IS_MOVI(src_phdr)) {
     niffs_flag moving_flag = _NIFFS_FLAG_MOVING;
-    res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, src_pix) + offsetof(niffs_page_hdr, flag), (u8_t *)&moving_flag, sizeof(niffs_flag));
+    res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, src_pix) + offsetof(niffs_page_hdr, flag), (u8_t *)&moving_flag, sizeof(niffs_flag));
     check(res);
   }
 
@@ -325,25 +1075,26 @@ TESTATIC int niffs_move_page(niffs *fs, niffs_page_ix src_pix, niffs_page_ix dst
     flag = force_flag;
   }
   if (flag != _NIFFS_FLAG_CLEAN) {
-    res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, dst_pix) + offsetof(niffs_page_hdr, flag), (u8_t *)&flag, sizeof(niffs_flag));
+    res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, dst_pix) + offsetof(niffs_page_hdr, flag), (u8_t *)&flag, sizeof(niffs_flag));
     check(res);
   }
 
   fs->free_pages--;
   if (data == 0 && (!src_clear || src_phdr->id.spix == 0)) {
     // .. page data ..
-    res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, dst_pix) + sizeof(niffs_page_hdr), (u8_t *)src_phdr  + sizeof(niffs_page_hdr), fs->page_size - sizeof(niffs_page_hdr));
+    res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, dst_pix) + sizeof(niffs_page_hdr), (u8_t *)src_phdr  + sizeof(niffs_page_hdr), fs->page_size - sizeof(niffs_page_hdr));
     check(res);
   } else if (data) {
     // .. else, user data ..
-    res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, dst_pix) + sizeof(niffs_page_hdr), data, len);
+    res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, dst_pix) + sizeof(niffs_page_hdr), data, len);
     check(res);
   }
   // .. and id
-  res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, dst_pix) + offsetof(niffs_page_hdr, id),
+  res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, dst_pix) + offsetof(niffs_page_hdr, id),
       (u8_t *)src_phdr  + offsetof(niffs_page_hdr, id), sizeof(niffs_page_hdr_id));
   check(res);
 
+  niffs_index_page_written(fs, dst_pix);
   niffs_inform_page_movement(fs, src_pix, dst_pix);
 
   // delete src
@@ -370,19 +1121,21 @@ TESTATIC int niffs_write_page(niffs *fs, niffs_page_ix pix, niffs_page_hdr *phdr
 
   if (!_NIFFS_IS_CLEA(phdr)) {
     // first, write flag
-    res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + offsetof(niffs_page_hdr, flag), (u8_t *)&phdr->flag, sizeof(niffs_flag));
+    res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + offsetof(niffs_page_hdr, flag), (u8_t *)&phdr->flag, sizeof(niffs_flag));
     check(res);
   }
   // .. data ..
   if (data) {
-    res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + sizeof(niffs_page_hdr), data, len);
+    res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + sizeof(niffs_page_hdr), data, len);
     check(res);
   }
 
   // .. then id
-  res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + offsetof(niffs_page_hdr, id), (u8_t *)&phdr->id, sizeof(niffs_page_hdr_id));
+  res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + offsetof(niffs_page_hdr, id), (u8_t *)&phdr->id, sizeof(niffs_page_hdr_id));
   check(res);
 
+  niffs_index_page_written(fs, pix);
+
   return res;
 }
 
@@ -405,11 +1158,7 @@ static int niffs_linear_find_space_v(niffs *fs, niffs_page_ix pix, niffs_page_hd
         // check linear files only
         // figure out how many sectors this linear file occupy
         niffs_linear_file_hdr *lfhdr = (niffs_linear_file_hdr *)phdr;
-        u32_t file_len = lfhdr->ohdr.len == NIFFS_UNDEF_LEN ? 0 : lfhdr->ohdr.len;
-        u32_t resv_sects = lfhdr->resv_sectors;
-        u32_t file_sects = (file_len + fs->sector_size - 1) / fs->sector_size;
-        u32_t sects = NIFFS_MAX(resv_sects, file_sects);
-        sects = NIFFS_MAX(1, sects);
+        u32_t sects = niffs_linear_file_sectors(fs, lfhdr);
         if (sects > fs->lin_sectors) {
           // length oob, do not let this file contaminate the free sector map
           // delete this file silently
@@ -434,6 +1183,20 @@ static int niffs_linear_find_space_v(niffs *fs, niffs_page_ix pix, niffs_page_hd
 
 int niffs_linear_map(niffs *fs) {
   niffs_memset(fs->buf, 0x00, fs->buf_len);
+#if NIFFS_LINEAR_EXTENTS
+  if (fs->lin_extents && !fs->lin_extents_ovf) {
+    u32_t ix;
+    for (ix = 0; ix < fs->lin_extents_cnt; ix++) {
+      u32_t lsix = fs->lin_extents[ix].start_sector - fs->sectors;
+      u32_t end_lsix = lsix + fs->lin_extents[ix].sectors;
+      while (lsix < end_lsix) {
+        fs->buf[lsix/8] |= (1 << (lsix&7));
+        lsix++;
+      }
+    }
+    return NIFFS_OK;
+  }
+#endif
   int res = niffs_traverse(fs, 0, 0, niffs_linear_find_space_v, 0);
   if (res == NIFFS_VIS_END) res = NIFFS_OK;
   check(res);
@@ -517,9 +1280,22 @@ int niffs_linear_avail_size(niffs *fs, int fd_ix, u32_t *available_sectors) {
   check(res);
   niffs_linear_avail_size_arg arg =
     {.start_sector = lfhdr->start_sector, .nearest_sector_after = (u32_t)-1};
-  res = niffs_traverse(fs, 0, 0, niffs_linear_avail_size_v, &arg);
-  if (res != NIFFS_VIS_END) return res;
-  res = NIFFS_OK;
+#if NIFFS_LINEAR_EXTENTS
+  if (fs->lin_extents && !fs->lin_extents_ovf) {
+    u32_t ix;
+    for (ix = 0; ix < fs->lin_extents_cnt; ix++) {
+      u32_t start_sector = fs->lin_extents[ix].start_sector;
+      if (start_sector > arg.start_sector && start_sector < arg.nearest_sector_after) {
+        arg.nearest_sector_after = start_sector;
+      }
+    }
+  } else
+#endif
+  {
+    res = niffs_traverse(fs, 0, 0, niffs_linear_avail_size_v, &arg);
+    if (res != NIFFS_VIS_END) return res;
+    res = NIFFS_OK;
+  }
   if (arg.nearest_sector_after == (u32_t)-1) {
     // no nearest sector so rest is clean we guess
     *available_sectors = fs->lin_sectors + fs->sectors - lfhdr->start_sector;
@@ -569,7 +1345,7 @@ int niffs_create(niffs *fs, const char *name, niffs_file_type type, void *meta)
   hdr.ohdr.phdr.flag = _NIFFS_FLAG_CLEAN;
   hdr.ohdr.phdr.id.obj_id = oid;
   hdr.ohdr.phdr.id.spix = 0;
-  hdr.ohdr.len = NIFFS_UNDEF_LEN;
+  _NIFFS_OHDR_SET_LEN(&hdr.ohdr, NIFFS_UNDEF_LEN);
   hdr.ohdr.type = type;
   niffs_strncpy((char *)hdr.ohdr.name, name, NIFFS_NAME_LEN);
 
@@ -619,6 +1395,178 @@ int niffs_create(niffs *fs, const char *name, niffs_file_type type, void *meta)
   return res;
 }
 
+#if NIFFS_LEN_SLOTS
+u32_t niffs_ohdr_len(const niffs_object_hdr *ohdr) {
+  u32_t len = ohdr->len;
+  u32_t i;
+  // any programmed bit of the removal marker means removed, even if length
+  // was not or only partially zeroed
+  if (ohdr->removed != NIFFS_UNDEF_LEN) return 0;
+  if (len == 0 || len == NIFFS_UNDEF_LEN) return len;
+  for (i = 0; i < NIFFS_LEN_SLOTS && ohdr->len_slots[i] != NIFFS_UNDEF_LEN; i++) {
+    if (_NIFFS_LEN_SLOT_IS_LEN(ohdr->len_slots[i])) {
+      len = ohdr->len_slots[i];
+    }
+  }
+  return len;
+}
+
+// returns index of first erased length slot, or NIFFS_LEN_SLOTS if all are programmed
+static u32_t niffs_len_slot_free(const niffs_object_hdr *ohdr) {
+  u32_t i;
+  for (i = 0; i < NIFFS_LEN_SLOTS && ohdr->len_slots[i] != NIFFS_UNDEF_LEN; i++);
+  return i;
+}
+
+// checks if last programmed length slot announces a length update not yet committed,
+// also true for a commit that was aborted while being programmed
+static int niffs_len_slot_pending(const niffs_object_hdr *ohdr) {
+  u32_t i = niffs_len_slot_free(ohdr);
+  return i > 0 && ohdr->len_slots[i-1] != _NIFFS_LEN_SLOT_ABORTED && !_NIFFS_LEN_SLOT_IS_LEN(ohdr->len_slots[i-1]);
+}
+
+// programs given length slot of object header in place
+static int niffs_len_slot_write(niffs *fs, niffs_page_ix pix, u32_t slot, u32_t val) {
+  NIFFS_DBG("lslot : pix %04x slot %i val %08x\n", pix, slot, val);
+  return niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + offsetof(niffs_object_hdr, len_slots) + slot * sizeof(u32_t),
+      (u8_t *)&val, sizeof(u32_t));
+}
+#endif // NIFFS_LEN_SLOTS
+
+u32_t niffs_fd_len(niffs *fs, niffs_file_desc *fd) {
+  niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix);
+  u32_t len = _NIFFS_OHDR_FILE_LEN(ohdr);
+#if NIFFS_DEFER_LEN
+  if (fd->pend_len) len = fd->pend_len;
+#endif
+#if NIFFS_WRITE_CACHE
+  len += fd->wc_len;
+#endif
+  return len;
+}
+
+// Returns length of file with given object header, as seen by its open file
+// descriptors if any holds an uncommitted length.
+u32_t niffs_obj_len(niffs *fs, niffs_object_hdr *ohdr) {
+#if _NIFFS_FD_SYNC
+  u32_t i;
+  for (i = 0; i < fs->descs_len; i++) {
+    niffs_file_desc *fd = &fs->descs[i];
+    if (fd->obj_id != ohdr->phdr.id.obj_id) continue;
+#if NIFFS_DEFER_LEN
+    if (fd->pend_len) return niffs_fd_len(fs, fd);
+#endif
+#if NIFFS_WRITE_CACHE
+    if (fd->wc_len) return niffs_fd_len(fs, fd);
+#endif
+  }
+#else
+  (void)fs;
+#endif
+  return _NIFFS_OHDR_FILE_LEN(ohdr);
+}
+
+#if NIFFS_FALLOCATE
+// releases pages reserved by given file descriptor
+static void niffs_resv_release(niffs *fs, niffs_file_desc *fd) {
+  fs->resv_pages -= fd->resv_pages;
+  fd->resv_pages = 0;
+}
+
+// takes pages written since there were free_pages free pages from the
+// reservation of given file descriptor
+static void niffs_resv_take(niffs *fs, niffs_file_desc *fd, u32_t free_pages) {
+  if (fs->free_pages >= free_pages) return;
+  u32_t taken = NIFFS_MIN(free_pages - fs->free_pages, fd->resv_pages);
+  fd->resv_pages -= taken;
+  fs->resv_pages -= taken;
+}
+#endif
+
+#if _NIFFS_FD_SYNC
+// writes cached data and commits deferred length of given file descriptor
+int niffs_fd_sync(niffs *fs, int fd_ix) {
+  int res = NIFFS_OK;
+  niffs_file_desc *fd;
+  res = niffs_get_filedesc(fs, fd_ix, &fd);
+  check(res);
+#if NIFFS_WRITE_CACHE
+  res = niffs_wcache_flush(fs, fd_ix);
+  check(res);
+#endif
+#if NIFFS_DEFER_LEN
+  if (fd->pend_len) {
+    u32_t len = fd->pend_len;
+    // on failure, the moving object header is tidied when checking or opening
+    fd->pend_len = 0;
+#if NIFFS_LEN_SLOTS
+    niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix);
+    if (niffs_len_slot_pending(ohdr) && niffs_len_slot_free(ohdr) < NIFFS_LEN_SLOTS) {
+      // update was announced in a length slot, commit in the next
+      NIFFS_DBG("sync  : commit oid:%04x len:%i, obj hdr pix %04x slot\n", fd->obj_id, len, fd->obj_pix);
+      res = niffs_len_slot_write(fs, fd->obj_pix, niffs_len_slot_free(ohdr), len);
+      check(res);
+      return res;
+    }
+#endif
+#if NIFFS_FALLOCATE
+    u32_t free_pages = fs->free_pages;
+    if (fd->resv_pages == 0) {
+      res = niffs_ensure_free_pages(fs, 1);
+    }
+#else
+    res = niffs_ensure_free_pages(fs, 1);
+#endif
+    check(res);
+    niffs_page_ix new_pix;
+    res = niffs_find_free_page(fs, &new_pix, NIFFS_EXCL_SECT_NONE);
+    check(res);
+    NIFFS_DBG("sync  : commit oid:%04x len:%i, obj hdr pix %04x->%04x\n", fd->obj_id, len, fd->obj_pix, new_pix);
+
+    // copy from old hdr
+    _NIFFS_RD(fs, fs->buf, _NIFFS_PIX_2_ADDR(fs, fd->obj_pix), fs->page_size);
+    _NIFFS_OHDR_SET_LEN((niffs_object_hdr *)fs->buf, len);
+
+    // move header page, rewrite length data
+    res = niffs_move_page(fs, fd->obj_pix, new_pix, fs->buf + sizeof(niffs_page_hdr), fs->page_size - sizeof(niffs_page_hdr), _NIFFS_FLAG_WRITTEN);
+#if NIFFS_FALLOCATE
+    niffs_resv_take(fs, fd, free_pages);
+#endif
+    check(res);
+  }
+#endif
+  return res;
+}
+
+// syncs all file descriptors of given object but the excluded one
+static int niffs_obj_sync(niffs *fs, niffs_obj_id oid, int excl_fd_ix) {
+  int res = NIFFS_OK;
+  u32_t i;
+  for (i = 0; i < fs->descs_len; i++) {
+    if ((int)i != excl_fd_ix && fs->descs[i].obj_id == oid) {
+      res = niffs_fd_sync(fs, i);
+      check(res);
+    }
+  }
+  return res;
+}
+
+// syncs all file descriptors of given file name
+static int niffs_name_sync(niffs *fs, const char *name) {
+  int res = NIFFS_OK;
+  u32_t i;
+  for (i = 0; i < fs->descs_len; i++) {
+    if (fs->descs[i].obj_id == 0) continue;
+    niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fs->descs[i].obj_pix);
+    if (strcmp(name, (char *)ohdr->name) == 0) {
+      res = niffs_fd_sync(fs, i);
+      check(res);
+    }
+  }
+  return res;
+}
+#endif // _NIFFS_FD_SYNC
+
 typedef struct {
   const char *name;
   niffs_page_ix pix;
@@ -635,7 +1583,7 @@ static int niffs_open_v(niffs *fs, niffs_page_ix pix, niffs_page_hdr *phdr, void
       // object header page
       niffs_object_hdr *ohdr = (niffs_object_hdr *)phdr;
       niffs_open_arg *arg = (niffs_open_arg *)v_arg;
-      if (strcmp(arg->name, (char *)ohdr->name) == 0 && ohdr->len != 0) {
+      if (strcmp(arg->name, (char *)ohdr->name) == 0 && _NIFFS_OHDR_LEN(ohdr) != 0) {
         // found matching name
         if (arg->oid_mov) {
           // had a previous moving page - delete this
@@ -659,6 +1607,25 @@ static int niffs_open_v(niffs *fs, niffs_page_ix pix, niffs_page_hdr *phdr, void
   return NIFFS_VIS_CONT;
 }
 
+// finds object header by name, returns NIFFS_OK or NIFFS_VIS_END like niffs_traverse
+static int niffs_find_obj_hdr(niffs *fs, niffs_open_arg *arg) {
+  int res = NIFFS_VIS_CONT;
+#if _NIFFS_FD_SYNC
+  // the object header is left moving while length is deferred, and cached
+  // data should be visible, so sync open descriptors of this file first
+  res = niffs_name_sync(fs, arg->name);
+  check(res);
+  res = NIFFS_VIS_CONT;
+#endif
+#if NIFFS_NAME_INDEX
+  res = niffs_name_index_visit(fs, arg->name, niffs_open_v, arg);
+#endif
+  if (res == NIFFS_VIS_CONT) {
+    res = niffs_traverse(fs, 0, 0, niffs_open_v, arg);
+  }
+  return res;
+}
+
 int niffs_open(niffs *fs, const char *name, niffs_fd_flags flags) {
   int fd_ix;
   int res = NIFFS_OK;
@@ -671,7 +1638,7 @@ int niffs_open(niffs *fs, const char *name, niffs_fd_flags flags) {
   niffs_open_arg arg;
   niffs_memset(&arg, 0, sizeof(arg));
   arg.name = name;
-  res = niffs_traverse(fs, 0, 0, niffs_open_v, &arg);
+  res = niffs_find_obj_hdr(fs, &arg);
   if (res == NIFFS_VIS_END) {
     if (arg.oid_mov != 0) {
       NIFFS_DBG("open  : pix %04x found only movi page\n", arg.pix_mov);
@@ -687,6 +1654,14 @@ int niffs_open(niffs *fs, const char *name, niffs_fd_flags flags) {
   } else if (res != NIFFS_OK) {
     return res;
   }
+#if NIFFS_LEN_SLOTS
+  else if (niffs_len_slot_pending((niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, arg.pix))) {
+    NIFFS_DBG("open  : pix %04x found uncommitted length slot\n", arg.pix);
+    // tidy up pages appended beyond committed length
+    res = niffs_chk_tidy_movi_objhdr_page(fs, arg.pix, 0);
+    check(res);
+  }
+#endif
   NIFFS_DBG("open  : \"%s\" found @ pix %04x\n", name, arg.pix);
 
   niffs_memset(fd, 0, sizeof(niffs_file_desc));
@@ -709,6 +1684,14 @@ int niffs_close(niffs *fs, int fd_ix) {
 
   niffs_file_desc *fd = &fs->descs[fd_ix];
 
+#if _NIFFS_FD_SYNC
+  // close even if sync fails
+  res = niffs_fd_sync(fs, fd_ix);
+#endif
+#if NIFFS_FALLOCATE
+  niffs_resv_release(fs, fd);
+#endif
+
   niffs_memset(fd, 0, sizeof(niffs_file_desc));
 
   return res;
@@ -718,13 +1701,17 @@ int niffs_read_ptr(niffs *fs, int fd_ix, u8_t **data, u32_t *avail) {
   niffs_file_desc *fd;
   int res = niffs_get_filedesc(fs, fd_ix, &fd);
   check(res);
+#if _NIFFS_FD_SYNC
+  res = niffs_obj_sync(fs, fd->obj_id, -1);
+  check(res);
+#endif
 
   if ((fd->flags & NIFFS_O_RDONLY) == 0) {
     check(ERR_NIFFS_NOT_READABLE);
   }
 
   niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix);
-  u32_t flen = ohdr->len == NIFFS_UNDEF_LEN ? 0 : ohdr->len;
+  u32_t flen = _NIFFS_OHDR_FILE_LEN(ohdr);
   if (fd->offs >= flen) {
     *data = 0;
     *avail = 0;
@@ -777,14 +1764,98 @@ int niffs_read_ptr(niffs *fs, int fd_ix, u8_t **data, u32_t *avail) {
   return avail_data;
 }
 
+int niffs_read_segments(niffs *fs, int fd_ix, u32_t offs, u32_t len, niffs_iovec *segs, u32_t max_segs) {
+  niffs_file_desc *fd;
+  int res = niffs_get_filedesc(fs, fd_ix, &fd);
+  check(res);
+#if _NIFFS_FD_SYNC
+  res = niffs_obj_sync(fs, fd->obj_id, -1);
+  check(res);
+#endif
+
+  if ((fd->flags & NIFFS_O_RDONLY) == 0) {
+    check(ERR_NIFFS_NOT_READABLE);
+  }
+
+  niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix);
+  if (_NIFFS_IS_DELE(&ohdr->phdr)) res = ERR_NIFFS_PAGE_DELETED;
+  else if (_NIFFS_IS_FREE(&ohdr->phdr)) res = ERR_NIFFS_PAGE_FREE;
+  else if (ohdr->phdr.id.obj_id != fd->obj_id) res = ERR_NIFFS_INCOHERENT_ID;
+  check(res);
+
+  u32_t flen = _NIFFS_OHDR_FILE_LEN(ohdr);
+  if (offs >= flen) {
+    return 0;
+  }
+  if (len > flen - offs) {
+    len = flen - offs;
+  }
+
+  u32_t nsegs = 0;
+  if (fd->type == _NIFFS_FTYPE_LINFILE) {
+#if !NIFFS_LINEAR_AREA
+    check(ERR_NIFFS_BAD_CONF);
+#else
+    // linear files, all in one
+    if (len > 0 && max_segs > 0) {
+      niffs_linear_file_hdr *lfhdr = (niffs_linear_file_hdr *)ohdr;
+      segs[0].base = _NIFFS_SECTOR_2_ADDR(fs, lfhdr->start_sector) + offs;
+      segs[0].len = len;
+      nsegs = 1;
+    }
+    return nsegs;
+#endif
+  }
+
+  // regular page chopped files, pages of a file are often written in
+  // sequence so try next page before looking up
+  niffs_page_ix pix = fd->cur_pix;
+  while (len > 0 && nsegs < max_segs) {
+    niffs_span_ix spix = _NIFFS_OFFS_2_SPIX(fs, offs);
+    niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+    if (phdr->id.obj_id != fd->obj_id || phdr->id.spix != spix ||
+        !_NIFFS_IS_FLAG_VALID(phdr) || _NIFFS_IS_MOVI(phdr)) {
+      res = niffs_find_page(fs, &pix, fd->obj_id, spix, pix);
+      check(res);
+      phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+    }
+
+    if (_NIFFS_IS_DELE(phdr)) res = ERR_NIFFS_PAGE_DELETED;
+    else if (_NIFFS_IS_FREE(phdr)) res =  ERR_NIFFS_PAGE_FREE;
+    else if (phdr->id.obj_id != fd->obj_id) res = ERR_NIFFS_INCOHERENT_ID;
+    check(res);
+
+    u32_t pdata_offs = _NIFFS_OFFS_2_PDATA_OFFS(fs, offs);
+    u32_t slen = _NIFFS_SPIX_2_PDATA_LEN(fs, spix) - pdata_offs;
+    if (slen > len) {
+      slen = len;
+    }
+    segs[nsegs].base = (u8_t *)phdr + pdata_offs +
+        (spix == 0 ? sizeof(niffs_object_hdr) : sizeof(niffs_page_hdr));
+    segs[nsegs].len = slen;
+    nsegs++;
+    offs += slen;
+    len -= slen;
+    if ((u32_t)pix + 1 < fs->sectors * fs->pages_per_sector) {
+      pix++;
+    }
+  }
+
+  return nsegs;
+}
+
 int niffs_seek(niffs *fs, int fd_ix, s32_t offset, u8_t whence) {
   int res = NIFFS_OK;
   niffs_file_desc *fd;
 
   res = niffs_get_filedesc(fs, fd_ix, &fd);
   check(res);
+#if _NIFFS_FD_SYNC
+  res = niffs_obj_sync(fs, fd->obj_id, -1);
+  check(res);
+#endif
   niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix);
-  u32_t flen = ohdr->len == NIFFS_UNDEF_LEN ? 0 : ohdr->len;
+  u32_t flen = _NIFFS_OHDR_FILE_LEN(ohdr);
   s32_t coffs;
   switch (whence) {
   default:
@@ -820,7 +1891,87 @@ int niffs_seek(niffs *fs, int fd_ix, s32_t offset, u8_t whence) {
   return res;
 }
 
-int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
+// Sets back file descriptor offset and page after a positional write. The
+// page is only kept if it is still the live page at the offset, else the
+// page is looked up on next access.
+void niffs_fd_restore_pos(niffs *fs, niffs_file_desc *fd, u32_t offs, niffs_page_ix pix) {
+  fd->offs = offs;
+  if (fd->type == _NIFFS_FTYPE_LINFILE) {
+    return;
+  }
+  niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+  if (_NIFFS_IS_FLAG_VALID(phdr) && !_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr) &&
+      phdr->id.obj_id == fd->obj_id && phdr->id.spix == _NIFFS_OFFS_2_SPIX(fs, offs)) {
+    fd->cur_pix = pix;
+  } else {
+    fd->cur_pix = fd->obj_pix;
+  }
+}
+
+/* source of appended data, a buffer or an io vector */
+typedef struct {
+  // buffer, used if no io vector
+  const u8_t *buf;
+  // current io vector entry, 0 if buffer
+  const niffs_iovec *iov;
+  // offset in buffer or current entry, may exceed entry length until next read
+  u32_t offs;
+} niffs_src;
+
+// returns address of next source byte, and number of bytes until end of
+// buffer or current io vector entry
+static const u8_t *niffs_src_contig(niffs_src *src, u32_t *len) {
+  if (src->iov == 0) {
+    *len = (u32_t)-1;
+    return src->buf + src->offs;
+  }
+  while (src->offs >= src->iov->len) {
+    src->offs -= src->iov->len;
+    src->iov++;
+  }
+  *len = src->iov->len - src->offs;
+  return src->iov->base + src->offs;
+}
+
+// copies len source bytes to dst
+static void niffs_src_copy(niffs_src *src, u8_t *dst, u32_t len) {
+  while (len > 0) {
+    u32_t clen;
+    const u8_t *p = niffs_src_contig(src, &clen);
+    clen = NIFFS_MIN(len, clen);
+    niffs_memcpy(dst, p, clen);
+    src->offs += clen;
+    dst += clen;
+    len -= clen;
+  }
+}
+
+// returns address of len source bytes, bytes spread over several io vector
+// entries are gathered in work buffer
+static const u8_t *niffs_src_get(niffs *fs, niffs_src *src, u32_t len) {
+  u32_t clen;
+  const u8_t *p = niffs_src_contig(src, &clen);
+  if (clen >= len) {
+    src->offs += len;
+    return p;
+  }
+  NIFFS_ASSERT(len <= fs->buf_len);
+  niffs_src_copy(src, fs->buf, len);
+  return fs->buf;
+}
+
+#if NIFFS_INPLACE_APPEND
+// checks if given flash range can be programmed without moving its page
+static int niffs_is_programmable(niffs *fs, const u8_t *addr, u32_t len) {
+  if ((u32_t)(addr - fs->phys_addr) % NIFFS_WORD_ALIGN) return 0;
+  while (len--) {
+    if (*addr++ != 0xff) return 0;
+  }
+  return 1;
+}
+#endif
+
+static int niffs_append_data(niffs *fs, int fd_ix, niffs_src *src, u32_t len) {
   int res = NIFFS_OK;
   niffs_file_desc *fd;
   res = niffs_get_filedesc(fs, fd_ix, &fd);
@@ -832,6 +1983,11 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
 
   if (len == 0) return NIFFS_OK;
 
+#if _NIFFS_FD_SYNC
+  res = niffs_obj_sync(fs, fd->obj_id, fd_ix);
+  check(res);
+#endif
+
   u8_t *orig_ohdr_addr = (u8_t *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix);
   niffs_object_hdr *orig_ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix);
   niffs_page_ix orig_obj_pix = fd->obj_pix;
@@ -841,7 +1997,13 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
   if (orig_ohdr->phdr.id.obj_id != fd->obj_id) check(ERR_NIFFS_INCOHERENT_ID);
 
   // CHECK SPACE
-  u32_t file_offs = orig_ohdr->len == NIFFS_UNDEF_LEN ? 0 : orig_ohdr->len;
+  u32_t file_offs = _NIFFS_OHDR_FILE_LEN(orig_ohdr);
+#if NIFFS_DEFER_LEN
+  if (fd->pend_len) file_offs = fd->pend_len;
+  // defer length update unless object header page itself is rewritten
+  u8_t defer = fd->type == _NIFFS_FTYPE_FILE && (fd->flags & NIFFS_O_DIRECT) == 0 &&
+      file_offs >= _NIFFS_SPIX_2_PDATA_LEN(fs, 0);
+#endif
 #if NIFFS_LINEAR_AREA
   if (fd->type == _NIFFS_FTYPE_LINFILE) {
     // check space in linear area
@@ -880,7 +2042,16 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
       u32_t needed_pages = _NIFFS_OFFS_2_SPIX(fs, len + file_offs) - _NIFFS_OFFS_2_SPIX(fs, file_offs) +
             (_NIFFS_OFFS_2_PDATA_OFFS(fs, len + file_offs) == 0 ? -1 : 0) +
             (file_offs == 0 ? 0 : 1);
+#if NIFFS_FALLOCATE
+      // no gc if covered by reservation, including a rewritten partially
+      // filled data page
+      if (needed_pages + (_NIFFS_OFFS_2_PDATA_OFFS(fs, file_offs) ? 1 : 0) > fd->resv_pages) {
+        niffs_resv_release(fs, fd);
+        res = niffs_ensure_free_pages(fs, needed_pages);
+      }
+#else
       res = niffs_ensure_free_pages(fs, needed_pages);
+#endif
       check(res);
     }
   }
@@ -896,11 +2067,30 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
 
   u32_t data_offs = 0;
   u32_t written = 0;
+#if NIFFS_LEN_SLOTS
+  // length is updated in a slot of the object header, instead of moving it
+  u8_t slot_upd = 0;
+#endif
   if (file_offs > 0 && _NIFFS_IS_WRIT(&orig_ohdr->phdr)) {
-    // changing existing file - write flag, mark obj header as MOVI
-    niffs_flag flag = _NIFFS_FLAG_MOVING;
-    res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix) + offsetof(niffs_object_hdr, phdr) + offsetof(niffs_page_hdr, flag), (u8_t *)&flag, sizeof(niffs_flag));
-    check(res);
+#if NIFFS_LEN_SLOTS
+    if (niffs_len_slot_pending(orig_ohdr) && niffs_len_slot_free(orig_ohdr) < NIFFS_LEN_SLOTS) {
+      // already announced by a previous deferred append
+      slot_upd = 1;
+    } else if (fd->type == _NIFFS_FTYPE_FILE && file_offs >= _NIFFS_SPIX_2_PDATA_LEN(fs, 0) &&
+        niffs_len_slot_free(orig_ohdr) + 2 <= NIFFS_LEN_SLOTS) {
+      // announce update in one slot, commit new length in next
+      res = niffs_len_slot_write(fs, fd->obj_pix, niffs_len_slot_free(orig_ohdr), _NIFFS_LEN_SLOT_PENDING);
+      check(res);
+      slot_upd = 1;
+    }
+    if (!slot_upd)
+#endif
+    {
+      // changing existing file - write flag, mark obj header as MOVI
+      niffs_flag flag = _NIFFS_FLAG_MOVING;
+      res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix) + offsetof(niffs_object_hdr, phdr) + offsetof(niffs_page_hdr, flag), (u8_t *)&flag, sizeof(niffs_flag));
+      check(res);
+    }
   }
 
   // WRITE DATA
@@ -917,7 +2107,7 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
         if (niffs_linear_check_erased(fs, lsix)) {
           // not empty, must erase
           NIFFS_DBG("append: linear: erase dirty sector %i\n", lsix);
-          res = fs->hal_er(_NIFFS_SECTOR_2_ADDR(fs, lsix), fs->sector_size);
+          res = niffs_hal_erase(fs, _NIFFS_SECTOR_2_ADDR(fs, lsix), fs->sector_size);
           check(res);
         }
         avail = fs->sector_size;
@@ -925,12 +2115,18 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
         avail = fs->sector_size - ((file_offs - data_offs) % fs->sector_size);
       }
       avail = NIFFS_MIN(avail, len - written);
+      u32_t contig;
+      (void)niffs_src_contig(src, &contig);
+      if (contig < avail) {
+        // gathered in work buffer
+        avail = NIFFS_MIN(avail, fs->buf_len);
+      }
       NIFFS_DBG("append: linear: sector %i, obj hdr oid:%04x len:%i\n",
           lfhdr->start_sector + (file_offs + data_offs) / fs->sector_size, fd->obj_id, avail);
-      res = fs->hal_wr((u8_t *)_NIFFS_SECTOR_2_ADDR(fs, lfhdr->start_sector) + file_offs + data_offs, src, avail);
+      res = niffs_hal_write(fs, (u8_t *)_NIFFS_SECTOR_2_ADDR(fs, lfhdr->start_sector) + file_offs + data_offs,
+          niffs_src_get(fs, src, avail), avail);
       check(res);
 
-      src += avail;
       data_offs += avail;
       written += avail;
       fd->offs += avail;
@@ -949,7 +2145,8 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
         avail = NIFFS_MIN(len, _NIFFS_SPIX_2_PDATA_LEN(fs, 0));
         NIFFS_DBG("append: pix %04x obj hdr oid:%04x spix:0 len:%i\n", fd->obj_pix, fd->obj_id, avail);
         // .. data ..
-        res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix) + sizeof(niffs_object_hdr), src, avail);
+        res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix) + sizeof(niffs_object_hdr),
+            niffs_src_get(fs, src, avail), avail);
         check(res);
 
         dst_ohdr_addr = (u8_t *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix); // original obj hdr
@@ -970,7 +2167,7 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
         new_phdr.flag = _NIFFS_FLAG_WRITTEN;
         NIFFS_DBG("append: pix %04x full page oid:%04x spix:%i len:%i\n", new_pix, fd->obj_id, new_phdr.id.spix, avail);
 
-        res = niffs_write_page(fs, new_pix, &new_phdr, src, avail);
+        res = niffs_write_page(fs, new_pix, &new_phdr, niffs_src_get(fs, src, avail), avail);
         check(res);
         fs->free_pages--;
         fd->cur_pix = new_pix;
@@ -988,10 +2185,27 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
           check(res);
         }
 
-        // find new page
         avail = NIFFS_MIN(len - written,
             _NIFFS_SPIX_2_PDATA_LEN(fs, _NIFFS_OFFS_2_SPIX(fs, file_offs + data_offs)) -
             _NIFFS_OFFS_2_PDATA_OFFS(fs, file_offs + data_offs));
+
+#if NIFFS_INPLACE_APPEND
+        u8_t *tail = (u8_t *)_NIFFS_PIX_2_ADDR(fs, src_pix) + sizeof(niffs_page_hdr) +
+            _NIFFS_OFFS_2_PDATA_OFFS(fs, file_offs + data_offs);
+        if (_NIFFS_OFFS_2_SPIX(fs, file_offs + data_offs) > 0 && niffs_is_programmable(fs, tail, avail)) {
+          // program erased remainder of page directly
+          NIFFS_DBG("append: pix %04x in place oid:%04x spix:%i len:%i\n", src_pix, fd->obj_id, (u32_t)_NIFFS_OFFS_2_SPIX(fs, file_offs + data_offs), avail);
+          res = niffs_hal_write(fs, tail, niffs_src_get(fs, src, avail), avail);
+          check(res);
+          fd->cur_pix = src_pix;
+          data_offs += avail;
+          written += avail;
+          fd->offs += avail;
+          continue;
+        }
+#endif
+
+        // find new page
         niffs_page_ix new_pix;
         res = niffs_find_free_page(fs, &new_pix, NIFFS_EXCL_SECT_NONE);
         check(res);
@@ -1004,11 +2218,11 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
           // copy header and current data
           _NIFFS_RD(fs, fs->buf, (u8_t *)_NIFFS_PIX_2_ADDR(fs, src_pix), sizeof(niffs_object_hdr) + file_offs);
           // copy from new data
-          niffs_memcpy(&fs->buf[sizeof(niffs_object_hdr) + file_offs], src, avail);
+          niffs_src_copy(src, &fs->buf[sizeof(niffs_object_hdr) + file_offs], avail);
 
           // reset new object header to be written
           niffs_object_hdr *new_ohdr_data = (niffs_object_hdr *)(fs->buf);
-          new_ohdr_data->len = NIFFS_UNDEF_LEN;
+          _NIFFS_OHDR_SET_LEN(new_ohdr_data, NIFFS_UNDEF_LEN);
           new_ohdr_data->phdr.flag = _NIFFS_FLAG_CLEAN;
           dst_ohdr_addr = (u8_t *)_NIFFS_PIX_2_ADDR(fs, new_pix);
           dst_ohdr_pix = new_pix;
@@ -1025,20 +2239,19 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
                 (_NIFFS_OFFS_2_SPIX(fs, file_offs + data_offs) == 0 ? sizeof(niffs_object_hdr) : sizeof(niffs_page_hdr)),
               _NIFFS_OFFS_2_PDATA_OFFS(fs, file_offs + data_offs));
           // copy from new data
-          niffs_memcpy(&fs->buf[ _NIFFS_OFFS_2_PDATA_OFFS(fs, file_offs + data_offs)],
-              src, avail);
+          niffs_src_copy(src, &fs->buf[ _NIFFS_OFFS_2_PDATA_OFFS(fs, file_offs + data_offs)], avail);
           NIFFS_DBG("append: pix %04x modify page oid:%04x spix:%i len:%i\n", src_pix, fd->obj_id, (u32_t)_NIFFS_OFFS_2_SPIX(fs, file_offs + data_offs), avail);
           NIFFS_DBG("append: new pix %04x\n", new_pix);
 
-          // move page, rewrite data
-          res = niffs_move_page(fs, src_pix, new_pix, fs->buf, _NIFFS_SPIX_2_PDATA_LEN(fs, 1), _NIFFS_FLAG_WRITTEN);
+          // move page, rewrite data, leave remainder erased
+          res = niffs_move_page(fs, src_pix, new_pix, fs->buf,
+              _NIFFS_OFFS_2_PDATA_OFFS(fs, file_offs + data_offs) + avail, _NIFFS_FLAG_WRITTEN);
           check(res);
         }
 
         fd->cur_pix = new_pix;
       }
 
-      src += avail;
       data_offs += avail;
       written += avail;
       fd->offs += avail;
@@ -1054,6 +2267,23 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
     // once the file is opened again or on a check
     return res;
   }
+#if NIFFS_DEFER_LEN
+  if (defer) {
+    // object header is left moving, length is committed on sync
+    NIFFS_DBG("append: defer header update oid:%04x len:%i\n", fd->obj_id, len + file_offs);
+    fd->pend_len = len + file_offs;
+    return res;
+  }
+#endif
+#if NIFFS_LEN_SLOTS
+  if (slot_upd) {
+    // commit new length in next slot
+    NIFFS_DBG("append: header update in slot, pix %04x\n", fd->obj_pix);
+    res = niffs_len_slot_write(fs, fd->obj_pix, niffs_len_slot_free(orig_ohdr), len + file_offs);
+    check(res);
+    return res;
+  }
+#endif
   // move original object header if necessary
   if (dst_ohdr_addr == 0) {
     // find free page
@@ -1067,7 +2297,7 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
     // copy from old hdr
     _NIFFS_RD(fs, fs->buf, orig_ohdr_addr, fs->page_size);
 
-    ((niffs_object_hdr *)fs->buf)->len = len + file_offs;
+    _NIFFS_OHDR_SET_LEN((niffs_object_hdr *)fs->buf, len + file_offs);
 
     // move header page, rewrite length data
     res = niffs_move_page(fs, fd->obj_pix, new_pix, fs->buf + sizeof(niffs_page_hdr), fs->page_size - sizeof(niffs_page_hdr), _NIFFS_FLAG_WRITTEN);
@@ -1077,12 +2307,13 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
     // .. write length..
     NIFFS_DBG("append: header update for object hdr (including data), pix %04x\n", dst_ohdr_pix);
     u32_t length = len + file_offs;
-    res = fs->hal_wr((u8_t *)dst_ohdr_addr + offsetof(niffs_object_hdr, len), (u8_t *)&length, sizeof(u32_t));
+    res = niffs_hal_write(fs, (u8_t *)dst_ohdr_addr + offsetof(niffs_object_hdr, len), (u8_t *)&length, sizeof(u32_t));
     check(res);
     // .. write flag..
     niffs_flag flag = _NIFFS_FLAG_WRITTEN;
-    res = fs->hal_wr((u8_t *)dst_ohdr_addr + offsetof(niffs_object_hdr, phdr) + offsetof(niffs_page_hdr, flag), (u8_t *)&flag, sizeof(niffs_flag));
+    res = niffs_hal_write(fs, (u8_t *)dst_ohdr_addr + offsetof(niffs_object_hdr, phdr) + offsetof(niffs_page_hdr, flag), (u8_t *)&flag, sizeof(niffs_flag));
     check(res);
+    niffs_index_ohdr_updated(fs, dst_ohdr_pix);
     // check if object header moved
     if (dst_ohdr_addr != orig_ohdr_addr) {
       NIFFS_DBG("append: header update inform, moved from pix %04x\n", orig_obj_pix);
@@ -1092,10 +2323,146 @@ int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
       check(res);
     }
   }
-
+
+  return res;
+}
+
+static int niffs_append_src(niffs *fs, int fd_ix, niffs_src *src, u32_t len) {
+#if NIFFS_FALLOCATE
+  u32_t free_pages = fs->free_pages;
+  int res = niffs_append_data(fs, fd_ix, src, len);
+  niffs_file_desc *fd;
+  if (niffs_get_filedesc(fs, fd_ix, &fd) == NIFFS_OK) {
+    niffs_resv_take(fs, fd, free_pages);
+  }
+  return res;
+#else
+  return niffs_append_data(fs, fd_ix, src, len);
+#endif
+}
+
+int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len) {
+  niffs_src s = {.buf = src, .iov = 0, .offs = 0};
+  return niffs_append_src(fs, fd_ix, &s, len);
+}
+
+// appends len bytes from given byte offset in io vector
+int niffs_appendv(niffs *fs, int fd_ix, const niffs_iovec *iov, u32_t offs, u32_t len) {
+  niffs_src s = {.buf = 0, .iov = iov, .offs = offs};
+  return niffs_append_src(fs, fd_ix, &s, len);
+}
+
+#if NIFFS_FALLOCATE
+int niffs_fallocate(niffs *fs, int fd_ix, u32_t len) {
+  niffs_file_desc *fd;
+  int res = niffs_get_filedesc(fs, fd_ix, &fd);
+  check(res);
+
+  if ((fd->flags & NIFFS_O_WRONLY) == 0) {
+    check(ERR_NIFFS_NOT_WRITABLE);
+  }
+  if (fd->type != _NIFFS_FTYPE_FILE) {
+    check(ERR_NIFFS_LINEAR_FILE);
+  }
+
+  niffs_resv_release(fs, fd);
+  if (len == 0) return NIFFS_OK;
+
+  // cached data is yet to be appended
+  u32_t end = niffs_fd_len(fs, fd) + len;
+  u32_t offs = end - len;
+#if NIFFS_WRITE_CACHE
+  offs -= fd->wc_len;
+#endif
+  // spanned data pages including a rewritten partially filled one, and two
+  // object header updates
+  u32_t pages = _NIFFS_OFFS_2_SPIX(fs, end - 1) - _NIFFS_OFFS_2_SPIX(fs, offs) + 1 + 2;
+  res = niffs_ensure_free_pages(fs, pages);
+  check(res);
+  NIFFS_DBG("alloc : oid:%04x reserve %i pages for %i bytes\n", fd->obj_id, pages, len);
+  fd->resv_pages = pages;
+  fs->resv_pages += pages;
+  return res;
+}
+#endif
+
+#if NIFFS_WRITE_CACHE
+int niffs_wcache_flush(niffs *fs, int fd_ix) {
+  int res = NIFFS_OK;
+  niffs_file_desc *fd;
+  res = niffs_get_filedesc(fs, fd_ix, &fd);
+  check(res);
+  if (fd->wc_len == 0) return NIFFS_OK;
+
+  u32_t len = fd->wc_len;
+  NIFFS_DBG("wcache: flush fd%i oid:%04x len:%i\n", fd_ix, fd->obj_id, len);
+  // cached data is dropped on failure, offset is advanced again by append
+  fd->wc_len = 0;
+  fd->offs -= len;
+  res = niffs_append(fs, fd_ix, _NIFFS_WCACHE(fs, fd_ix), len);
+  check(res);
+  return res;
+}
+
+static int niffs_wcache_append_src(niffs *fs, int fd_ix, niffs_src *src, u32_t len) {
+  int res = NIFFS_OK;
+  niffs_file_desc *fd;
+  res = niffs_get_filedesc(fs, fd_ix, &fd);
+  check(res);
+
+  if (fs->wcache == 0 || (fd->flags & NIFFS_O_DIRECT) || fd->type != _NIFFS_FTYPE_FILE) {
+    return niffs_append_src(fs, fd_ix, src, len);
+  }
+  if ((fd->flags & NIFFS_O_WRONLY) == 0) {
+    check(ERR_NIFFS_NOT_WRITABLE);
+  }
+
+  while (len > 0) {
+    niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix);
+    if (ohdr->phdr.id.obj_id != fd->obj_id) check(ERR_NIFFS_INCOHERENT_ID);
+    u32_t end = niffs_fd_len(fs, fd);
+    // bytes left until end of page
+    u32_t space = _NIFFS_SPIX_2_PDATA_LEN(fs, _NIFFS_OFFS_2_SPIX(fs, end)) - _NIFFS_OFFS_2_PDATA_OFFS(fs, end);
+    if (fd->wc_len == 0 && len >= space) {
+      // nothing cached, write all pages filled by this write directly
+      u32_t direct_len = len - _NIFFS_OFFS_2_PDATA_OFFS(fs, end + len);
+      res = niffs_append_src(fs, fd_ix, src, direct_len);
+      check(res);
+      len -= direct_len;
+    } else {
+      u32_t clen = NIFFS_MIN(len, space);
+      niffs_src_copy(src, _NIFFS_WCACHE(fs, fd_ix) + fd->wc_len, clen);
+      fd->wc_len += clen;
+      fd->offs += clen;
+      len -= clen;
+      if (clen == space) {
+        // page filled
+        res = niffs_wcache_flush(fs, fd_ix);
+        check(res);
+      }
+    }
+  }
   return res;
 }
 
+// appends len bytes from given byte offset in io vector through write-back cache
+int niffs_wcache_appendv(niffs *fs, int fd_ix, const niffs_iovec *iov, u32_t offs, u32_t len) {
+  niffs_src s = {.buf = 0, .iov = iov, .offs = offs};
+  return niffs_wcache_append_src(fs, fd_ix, &s, len);
+}
+#endif // NIFFS_WRITE_CACHE
+
+#if NIFFS_INPLACE_MODIFY
+// checks if given flash range can be overwritten by given data by only clearing bits
+static int niffs_is_clearable(const u8_t *addr, const u8_t *src, u32_t len) {
+  while (len--) {
+    if ((*addr++ & *src) != *src) return 0;
+    src++;
+  }
+  return 1;
+}
+#endif
+
 int niffs_modify(niffs *fs, int fd_ix, u32_t offset, const u8_t *src, u32_t len) {
   int res = NIFFS_OK;
   niffs_file_desc *fd;
@@ -1110,10 +2477,14 @@ int niffs_modify(niffs *fs, int fd_ix, u32_t offset, const u8_t *src, u32_t len)
   }
 
   if (len == 0) return NIFFS_OK;
+#if _NIFFS_FD_SYNC
+  res = niffs_obj_sync(fs, fd->obj_id, -1);
+  check(res);
+#endif
   niffs_object_hdr *orig_ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix);
   niffs_page_ix orig_obj_pix = fd->obj_pix;
   if (orig_ohdr->phdr.id.obj_id != fd->obj_id) check(ERR_NIFFS_INCOHERENT_ID);
-  u32_t file_offs = orig_ohdr->len == NIFFS_UNDEF_LEN ? 0 : orig_ohdr->len;
+  u32_t file_offs = _NIFFS_OHDR_FILE_LEN(orig_ohdr);
   if (offset + len > file_offs) {
     check(ERR_NIFFS_MODIFY_BEYOND_FILE);
   }
@@ -1163,6 +2534,22 @@ int niffs_modify(niffs *fs, int fd_ix, u32_t offset, const u8_t *src, u32_t len)
 
     niffs_page_ix new_pix;
 
+#if NIFFS_INPLACE_MODIFY
+    u8_t *dst = (u8_t *)_NIFFS_PIX_2_ADDR(fs, orig_pix) +
+        (spix == 0 ? sizeof(niffs_object_hdr) : sizeof(niffs_page_hdr)) + pdata_offs;
+    if (niffs_is_clearable(dst, src, avail)) {
+      // only clearing bits, program page in place from an aligned address
+      u32_t pre = (u32_t)(dst - fs->phys_addr) % NIFFS_WORD_ALIGN;
+      NIFFS_DBG("modify: pix %04x in place oid:%04x spix:%i offs:%i len:%i\n", orig_pix, fd->obj_id, spix, pdata_offs, avail);
+      _NIFFS_RD(fs, fs->buf, dst - pre, pre);
+      niffs_memcpy(&fs->buf[pre], src, avail);
+      NIFFS_HAL_REPROGRAM(fs, 1);
+      res = niffs_hal_write(fs, dst - pre, fs->buf, pre + avail);
+      NIFFS_HAL_REPROGRAM(fs, 0);
+      check(res);
+      new_pix = orig_pix;
+    } else
+#endif
     if (spix == 0 || avail < pdata_len) {
       // in midst of a page
       u8_t *orig_data_addr = _NIFFS_PIX_2_ADDR(fs, orig_pix);
@@ -1197,7 +2584,7 @@ int niffs_modify(niffs *fs, int fd_ix, u32_t offset, const u8_t *src, u32_t len)
 
     written += avail;
     src += avail;
-    fd->offs += written;
+    fd->offs = offset + written;
     fd->cur_pix = new_pix;
   }
 
@@ -1236,10 +2623,24 @@ int niffs_truncate(niffs *fs, int fd_ix, u32_t new_len) {
   if (fd->type == _NIFFS_FTYPE_LINFILE && new_len != 0) {
     check(ERR_NIFFS_LINEAR_FILE); // only append and full delete is allowed for linears
   }
+#if _NIFFS_FD_SYNC
+  if (new_len == 0) {
+    // file is removed including any uncommitted pages, drop uncommitted data
+#if NIFFS_WRITE_CACHE
+    fd->wc_len = 0;
+#endif
+#if NIFFS_DEFER_LEN
+    fd->pend_len = 0;
+#endif
+  } else {
+    res = niffs_obj_sync(fs, fd->obj_id, -1);
+    check(res);
+  }
+#endif
 
   niffs_page_ix orig_ohdr_pix = fd->obj_pix;
   niffs_object_hdr *orig_ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix);
-  u32_t flen = orig_ohdr->len == NIFFS_UNDEF_LEN ? 0 : orig_ohdr->len;
+  u32_t flen = _NIFFS_OHDR_FILE_LEN(orig_ohdr);
   if (orig_ohdr->phdr.id.obj_id != fd->obj_id) res = ERR_NIFFS_INCOHERENT_ID;
   else if (new_len > flen) res = ERR_NIFFS_TRUNCATE_BEYOND_FILE;
   check(res);
@@ -1269,7 +2670,7 @@ int niffs_truncate(niffs *fs, int fd_ix, u32_t new_len) {
   if (new_len) {
     // changing existing file - write flag, mark obj header as MOVI
     niffs_flag flag = _NIFFS_FLAG_MOVING;
-    res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix) + offsetof(niffs_object_hdr, phdr) + offsetof(niffs_page_hdr, flag), (u8_t *)&flag, sizeof(niffs_flag));
+    res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix) + offsetof(niffs_object_hdr, phdr) + offsetof(niffs_page_hdr, flag), (u8_t *)&flag, sizeof(niffs_flag));
     check(res);
 
     // rewrite new object header, new length
@@ -1280,7 +2681,7 @@ int niffs_truncate(niffs *fs, int fd_ix, u32_t new_len) {
     // copy from old hdr
     _NIFFS_RD(fs, fs->buf, _NIFFS_PIX_2_ADDR(fs, fd->obj_pix), fs->page_size);
 
-    ((niffs_object_hdr *)fs->buf)->len = new_len;
+    _NIFFS_OHDR_SET_LEN((niffs_object_hdr *)fs->buf, new_len);
 
     // move header page, rewrite length data
     res = niffs_move_page(fs, fd->obj_pix, new_pix, fs->buf + sizeof(niffs_page_hdr), fs->page_size - sizeof(niffs_page_hdr), _NIFFS_FLAG_WRITTEN);
@@ -1289,12 +2690,19 @@ int niffs_truncate(niffs *fs, int fd_ix, u32_t new_len) {
     // removing, zero length
     if (fd->type ==_NIFFS_FTYPE_LINFILE) {
       // linear files: just erase header, sectors are lazily erased when overwritten
+      niffs_obj_id oid = fd->obj_id;
       res = niffs_delete_page(fs, fd->obj_pix);
       check(res);
+      niffs_index_file_removed(fs, oid);
       return res;
     } else {
       u32_t length = 0;
-      res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix) + offsetof(niffs_object_hdr, len), (u8_t *)&length, sizeof(u32_t));
+#if NIFFS_LEN_SLOTS
+      // mark removed first, a partially zeroed length would be hidden by the slots
+      res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix) + offsetof(niffs_object_hdr, removed), (u8_t *)&length, sizeof(u32_t));
+      check(res);
+#endif
+      res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, fd->obj_pix) + offsetof(niffs_object_hdr, len), (u8_t *)&length, sizeof(u32_t));
       check(res);
     }
   }
@@ -1317,8 +2725,10 @@ int niffs_truncate(niffs *fs, int fd_ix, u32_t new_len) {
 
   if (res == NIFFS_OK && new_len == 0) {
     // remove header
+    niffs_obj_id oid = fd->obj_id;
     res = niffs_delete_page(fs, fd->obj_pix);
     check(res);
+    niffs_index_file_removed(fs, oid);
   }
 
   return res;
@@ -1345,7 +2755,7 @@ int niffs_rename(niffs *fs, const char *old_name, const char *new_name) {
   // find src file
   niffs_memset(&arg, 0, sizeof(arg));
   arg.name = old_name;
-  res = niffs_traverse(fs, 0, 0, niffs_open_v, &arg);
+  res = niffs_find_obj_hdr(fs, &arg);
   if (res == NIFFS_VIS_END) {
     if (arg.oid_mov != 0) {
       src_pix = arg.pix_mov;
@@ -1361,7 +2771,7 @@ int niffs_rename(niffs *fs, const char *old_name, const char *new_name) {
   // find dst file
   niffs_memset(&arg, 0, sizeof(arg));
   arg.name = new_name;
-  res = niffs_traverse(fs, 0, 0, niffs_open_v, &arg);
+  res = niffs_find_obj_hdr(fs, &arg);
   if (res == NIFFS_VIS_END) {
     if (arg.oid_mov == 0) {
       res = NIFFS_OK;
@@ -1391,6 +2801,21 @@ int niffs_rename(niffs *fs, const char *old_name, const char *new_name) {
 static int niffs_ensure_free_pages(niffs *fs, u32_t pages) {
   int res = NIFFS_OK;
   int run = 1;
+  // sector headers and pages are read from here on
+  NIFFS_ERASE_WAIT(fs);
+#if NIFFS_FALLOCATE
+  // reserved pages are not for the taking
+  pages += fs->resv_pages;
+#endif
+#if NIFFS_GC_STEP
+  if (fs->gc_active &&
+      (fs->free_pages < fs->pages_per_sector + pages)) {
+    // short of headroom, finish collection in progress before anything else
+    res = niffs_gc_step(fs, (u32_t)-1, 1);
+    if (res > 0) res = NIFFS_OK;
+    check(res);
+  }
+#endif
 
   while (fs->free_pages < fs->pages_per_sector) {
     NIFFS_DBG("ensure: run#%i warn fs crammed, free pages:%i, need at least:%i\n", run, fs->free_pages, fs->pages_per_sector);
@@ -1410,6 +2835,15 @@ static int niffs_ensure_free_pages(niffs *fs, u32_t pages) {
     check(ERR_NIFFS_FULL);
   }
 
+#if NIFFS_GC_PLAN
+  if (pages > fs->free_pages) {
+    // needs more than one sector, collect them in one go
+    NIFFS_DBG("ensure: plan need %i free, have %i-%i\n", pages, fs->free_pages, fs->pages_per_sector);
+    res = niffs_gc_plan(fs, pages + fs->pages_per_sector - fs->free_pages);
+    check(res);
+  }
+#endif
+
   // try cleaning away needed pages
 //#define NIFFS_GC_DBG
   if (pages > fs->free_pages || fs->free_pages - pages < fs->pages_per_sector) {
@@ -1438,6 +2872,11 @@ static int niffs_ensure_free_pages(niffs *fs, u32_t pages) {
     }
   }
 
+#if NIFFS_STATIC_WEAR
+  res = niffs_static_wear(fs);
+  check(res);
+#endif
+
   return res;
 }
 
@@ -1449,6 +2888,50 @@ typedef struct {
   u32_t busy_pages;
 } niffs_gc_sector_cand;
 
+static void niffs_gc_count_sector_pages(niffs *fs, u32_t sector, u32_t *p_free, u32_t *p_dele, u32_t *p_busy) {
+  *p_free = 0;
+  *p_dele = 0;
+  *p_busy = 0;
+  niffs_page_ix ipix;
+  for (ipix = 0; ipix < fs->pages_per_sector; ipix++) {
+    niffs_page_ix pix = _NIFFS_PIX_AT_SECTOR(fs, sector) + ipix;
+    niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+    if (_NIFFS_IS_FREE(phdr) && _NIFFS_IS_CLEA(phdr)) {
+      (*p_free)++;
+    } else if (_NIFFS_IS_DELE(phdr) || !_NIFFS_IS_FLAG_VALID(phdr)) {
+      (*p_dele)++;
+    } else {
+      (*p_busy)++;
+    }
+  }
+}
+
+// scores given sector for garbage collection, higher is better
+static s32_t niffs_gc_score(niffs *fs, u32_t sector, u32_t era_cnt_diff, u32_t p_free, u32_t p_dele, u32_t p_busy) {
+  s32_t score;
+#if NIFFS_GC_POLICY
+  if (fs->gc_policy) {
+    niffs_gc_sector s = {
+        .sector = sector,
+        .age = era_cnt_diff,
+        .pages = fs->pages_per_sector,
+        .free_pages = p_free,
+        .dele_pages = p_dele,
+        .busy_pages = p_busy
+    };
+    score = fs->gc_policy(&s);
+  } else
+#endif
+  {
+    (void)sector;
+    score = NIFFS_GC_SCORE(era_cnt_diff,
+        (100*p_free)/fs->pages_per_sector,
+        (100*p_dele)/fs->pages_per_sector,
+        (100*p_busy)/fs->pages_per_sector);
+  }
+  return score;
+}
+
 static int niffs_gc_find_candidate_sector(niffs *fs, niffs_gc_sector_cand *cand, u8_t allow_full_sector) {
   u32_t sector;
   u8_t found = 0;
@@ -1456,27 +2939,35 @@ static int niffs_gc_find_candidate_sector(niffs *fs, niffs_gc_sector_cand *cand,
   // find candidate sector
   s32_t cand_score = 0x80000000;
   for (sector = 0; sector < fs->sectors; sector++) {
-    niffs_sector_hdr *shdr = (niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(fs, sector);
-    if (shdr->abra != _NIFFS_SECT_MAGIC(fs)) {
+    niffs_erase_cnt shdr_era_cnt;
+    u32_t p_free;
+    u32_t p_dele;
+    u32_t p_busy;
+
+#if NIFFS_GC_STEP
+    if (fs->gc_active && sector == fs->gc_sector) {
+      // already being collected in steps
       continue;
     }
-    niffs_erase_cnt shdr_era_cnt = shdr->era_cnt;
-
-    u32_t p_free = 0;
-    u32_t p_dele = 0;
-    u32_t p_busy = 0;
+#endif
 
-    niffs_page_ix ipix;
-    for (ipix = 0; ipix < fs->pages_per_sector; ipix++) {
-      niffs_page_ix pix = _NIFFS_PIX_AT_SECTOR(fs, sector) + ipix;
-      niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
-      if (_NIFFS_IS_FREE(phdr) && _NIFFS_IS_CLEA(phdr)) {
-        p_free++;
-      } else if (_NIFFS_IS_DELE(phdr) || !_NIFFS_IS_FLAG_VALID(phdr)) {
-        p_dele++;
-      } else {
-        p_busy++;
+#if NIFFS_SECTOR_INFO
+    if (fs->sector_info) {
+      // all sectors have magic once mounted or checked
+      niffs_sector_info *si = &fs->sector_info[sector];
+      shdr_era_cnt = si->era_cnt;
+      p_free = si->free_pages;
+      p_dele = si->dele_pages;
+      p_busy = si->busy_pages;
+    } else
+#endif
+    {
+      niffs_sector_hdr *shdr = (niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(fs, sector);
+      if (shdr->abra != _NIFFS_SECT_MAGIC(fs)) {
+        continue;
       }
+      shdr_era_cnt = shdr->era_cnt;
+      niffs_gc_count_sector_pages(fs, sector, &p_free, &p_dele, &p_busy);
     }
 
     niffs_erase_cnt era_cnt_diff_typed = fs->max_era - shdr_era_cnt;
@@ -1489,8 +2980,9 @@ static int niffs_gc_find_candidate_sector(niffs *fs, niffs_gc_sector_cand *cand,
       NIFFS_DBG("skipped, totally free\n");
       continue;
     }
-    // never select sectors that have no room for movement
-    if (p_busy > fs->free_pages) {
+    // never select sectors that have no room for movement, own free pages
+    // cannot be moved to
+    if (p_busy + p_free > fs->free_pages) {
       NIFFS_DBG("no room for movement\n");
       continue;
     }
@@ -1509,12 +3001,9 @@ static int niffs_gc_find_candidate_sector(niffs *fs, niffs_gc_sector_cand *cand,
     //     but having too low an erase count - this will free
     //     zero pages, but will move long-lived files hogging a
     //     full sector which ruins the wear leveling
-    s32_t score = NIFFS_GC_SCORE(era_cnt_diff,
-        (100*p_free)/fs->pages_per_sector,
-        (100*p_dele)/fs->pages_per_sector,
-        (100*p_busy)/fs->pages_per_sector);
+    s32_t score = niffs_gc_score(fs, sector, era_cnt_diff, p_free, p_dele, p_busy);
     NIFFS_DBG("score %i\n", score);
-    if (score > cand_score && p_busy <= fs->free_pages) {
+    if (score > cand_score) {
       cand_score = score;
       cand->sector = sector;
       cand->era_cnt = shdr_era_cnt;
@@ -1525,61 +3014,653 @@ static int niffs_gc_find_candidate_sector(niffs *fs, niffs_gc_sector_cand *cand,
     }
   }
 
-  if (found) {
-    NIFFS_DBG("gc    : found candidate sector %i era_cnt:%i (free:%i dele:%i busy:%i)\n", cand->sector, cand->era_cnt, cand->free_pages, cand->dele_pages, cand->busy_pages);
-  } else {
-    NIFFS_DBG("gc    : found no candidate sector\n");
+  if (found) {
+    NIFFS_DBG("gc    : found candidate sector %i era_cnt:%i (free:%i dele:%i busy:%i)\n", cand->sector, cand->era_cnt, cand->free_pages, cand->dele_pages, cand->busy_pages);
+  } else {
+    NIFFS_DBG("gc    : found no candidate sector\n");
+  }
+
+  int res = found ? NIFFS_OK : ERR_NIFFS_NO_GC_CANDIDATE;
+  check(res);
+  return res;
+}
+
+#if NIFFS_GC_POLICY
+
+s32_t NIFFS_gc_policy_greedy(const niffs_gc_sector *s) {
+  return (s32_t)(s->dele_pages * (s->pages + 1) + (s->pages - s->busy_pages));
+}
+
+// Benefit is reclaimed pages times age, cost is reading the sector and
+// writing its busy pages, as in log-structured file system cleaning.
+s32_t NIFFS_gc_policy_cost_benefit(const niffs_gc_sector *s) {
+  // clamp age to keep score within range
+  u32_t age = NIFFS_MIN(s->age, 1023);
+  return (s32_t)((s->dele_pages * (age + 1) * 64) / (s->pages + s->busy_pages));
+}
+
+s32_t NIFFS_gc_policy_wear(const niffs_gc_sector *s) {
+  u32_t age = NIFFS_MIN(s->age, 0xffff);
+  return (s32_t)(age * (s->pages + 1) + s->dele_pages);
+}
+
+#endif // NIFFS_GC_POLICY
+
+// Moves busy pages out of given sector, starting at page index *ipix, until
+// all are moved or max_moves pages are moved. Returns NIFFS_VIS_CONT if
+// there are busy pages left.
+static int niffs_gc_move_pages(niffs *fs, u32_t sector, niffs_page_ix *ipix, u32_t max_moves) {
+  int res = NIFFS_OK;
+  for (; *ipix < fs->pages_per_sector; (*ipix)++) {
+    niffs_page_ix pix = _NIFFS_PIX_AT_SECTOR(fs, sector) + *ipix;
+    niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+    if (_NIFFS_IS_FLAG_VALID(phdr) && !_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr)) {
+      if (max_moves == 0) {
+        return NIFFS_VIS_CONT;
+      }
+      max_moves--;
+      niffs_page_ix new_pix;
+      // find dst page & move src
+#if NIFFS_COLD_HEAD
+      // pages surviving gc are likely to survive the next one too
+      res = niffs_find_free_page_cold(fs, &new_pix, sector);
+#else
+      res = niffs_find_free_page(fs, &new_pix, sector);
+#endif
+      check(res);
+      res = niffs_move_page(fs, pix, new_pix, 0, 0, NIFFS_FLAG_MOVE_KEEP);
+      check(res);
+      NIFFS_STAT_GC_MOVE(fs);
+    }
+  }
+  return res;
+}
+
+// Updates cursors and stats after given sector is erased by garbage
+// collection, freeing given number of pages.
+static void niffs_gc_erased(niffs *fs, u32_t sector, u32_t pages) {
+  // move free cursor if necessary
+  if (_NIFFS_PIX_2_SECTOR(fs, fs->last_free_pix) == sector) {
+    u32_t new_free_s = sector+1;
+    if (new_free_s >= fs->sectors) {
+      new_free_s = 0;
+    }
+    fs->last_free_pix = _NIFFS_PIX_AT_SECTOR(fs, new_free_s);
+  }
+#if NIFFS_COLD_HEAD
+  if (fs->cold_sector == sector) {
+    fs->cold_sector = NIFFS_EXCL_SECT_NONE;
+  }
+#endif
+
+#if NIFFS_DEAD_ERASE
+  niffs_dead_sector_remove(fs, sector);
+#endif
+#if NIFFS_STATIC_WEAR
+  fs->wear_erases++;
+#endif
+
+  // update stats
+  fs->dele_pages -= pages;
+  fs->free_pages += pages;
+}
+
+// Erases given sector having all busy pages moved, and updates stats.
+static int niffs_gc_erase(niffs *fs, u32_t sector) {
+  u32_t p_free;
+  u32_t p_dele;
+  u32_t p_busy;
+  // busy pages left are unmovable, e.g. aborted writes, and were never
+  // counted as free, so count them as deleted
+  niffs_gc_count_sector_pages(fs, sector, &p_free, &p_dele, &p_busy);
+
+  // erase sector
+  int res = niffs_erase_sector(fs, sector);
+  check(res);
+
+  niffs_gc_erased(fs, sector, p_dele + p_busy);
+  return res;
+}
+
+#if NIFFS_ASYNC_ERASE
+// As niffs_gc_erase, but if there is a split erase HAL, only starts erasing
+// given sector, finished by niffs_gc_erase_poll.
+static int niffs_gc_erase_start(niffs *fs, u32_t sector) {
+  if (fs->hal_er_start == 0) {
+    return niffs_gc_erase(fs, sector);
+  }
+  u32_t p_free;
+  u32_t p_dele;
+  u32_t p_busy;
+  niffs_gc_count_sector_pages(fs, sector, &p_free, &p_dele, &p_busy);
+
+  niffs_erase_cnt era_cnt = niffs_erase_sector_era(fs, sector);
+  NIFFS_DBG("erase : start sector %i era_cnt:%i\n", sector, era_cnt);
+  int res = fs->hal_er_start(_NIFFS_SECTOR_2_ADDR(fs, sector), fs->sector_size);
+#if NIFFS_CHECKPOINT
+  if (res) fs->ckpt_unclean = 1;
+#endif
+  check(res);
+  fs->er_sector = sector;
+  fs->er_era_cnt = era_cnt;
+  fs->er_pages = p_dele + p_busy;
+  return res;
+}
+
+// Polls sector being erased by niffs_gc_erase_start, and finishes it once
+// erased. Returns 1 if still erasing, never if wait is set.
+static int niffs_gc_erase_poll(niffs *fs, u8_t wait) {
+  int res;
+  u32_t sector = fs->er_sector;
+  do {
+    res = fs->hal_er_poll(_NIFFS_SECTOR_2_ADDR(fs, sector));
+  } while (res == 1 && wait);
+  if (res == 1) {
+    return res;
+  }
+  fs->er_sector = NIFFS_EXCL_SECT_NONE;
+  if (res == NIFFS_OK) {
+    NIFFS_DBG("erase : done sector %i era_cnt:%i\n", sector, fs->er_era_cnt);
+    res = niffs_erase_sector_hdr(fs, sector, fs->er_era_cnt);
+  }
+#if NIFFS_CHECKPOINT
+  if (res) fs->ckpt_unclean = 1;
+#endif
+  check(res);
+  niffs_gc_erased(fs, sector, fs->er_pages);
+  return res;
+}
+#endif
+
+#if NIFFS_DEAD_ERASE || NIFFS_STATIC_WEAR || NIFFS_WEAR_INFO
+static u32_t niffs_era_cnt_diff(niffs *fs, u32_t sector) {
+  niffs_erase_cnt era_cnt;
+#if NIFFS_SECTOR_INFO
+  if (fs->sector_info) {
+    era_cnt = fs->sector_info[sector].era_cnt;
+  } else
+#endif
+  {
+    era_cnt = ((niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(fs, sector))->era_cnt;
+  }
+  niffs_erase_cnt era_cnt_diff = fs->max_era - era_cnt;
+  return (u32_t)era_cnt_diff;
+}
+#endif
+
+#if NIFFS_DEAD_ERASE
+// Returns the least erased queued sector having all pages deleted, or
+// NIFFS_EXCL_SECT_NONE if some other sector lags behind in erases, in which
+// case it is left to scoring so static data gets moved.
+static u32_t niffs_gc_dead_sector(niffs *fs) {
+  u32_t i;
+  if (fs->dead_cnt == 0) return NIFFS_EXCL_SECT_NONE;
+  u32_t sector = fs->dead_sectors[0];
+  u32_t dead_diff = niffs_era_cnt_diff(fs, sector);
+  for (i = 1; i < fs->dead_cnt; i++) {
+    u32_t diff = niffs_era_cnt_diff(fs, fs->dead_sectors[i]);
+    if (diff > dead_diff) {
+      sector = fs->dead_sectors[i];
+      dead_diff = diff;
+    }
+  }
+  for (i = 0; i < fs->sectors; i++) {
+    if (niffs_era_cnt_diff(fs, i) > dead_diff + 1) {
+      return NIFFS_EXCL_SECT_NONE;
+    }
+  }
+  return sector;
+}
+
+// Erases the sector given by niffs_gc_dead_sector. Returns NIFFS_VIS_CONT if
+// not erased. If start is set, the erase might only be started, see
+// niffs_gc_erase_start.
+static int niffs_gc_erase_dead(niffs *fs, u8_t start) {
+  u32_t sector = niffs_gc_dead_sector(fs);
+  if (sector == NIFFS_EXCL_SECT_NONE) {
+    return NIFFS_VIS_CONT;
+  }
+#if NIFFS_GC_STEP
+  if (fs->gc_active && sector == fs->gc_sector) {
+    // nothing left to move for the step
+    niffs_gc_abandon(fs);
+  }
+#endif
+  NIFFS_DBG("gc    : erase dead sector %i\n", sector);
+  int res;
+#if NIFFS_ASYNC_ERASE
+  if (start) {
+    res = niffs_gc_erase_start(fs, sector);
+  } else
+#endif
+  {
+    (void)start;
+    res = niffs_gc_erase(fs, sector);
+  }
+  check(res);
+  return res;
+}
+#endif
+
+#if NIFFS_STATIC_WEAR
+// Moves the pages of the least erased sector holding data into the most
+// erased totally free sector, and erases the former, should the least erased
+// lag too far behind. Only checks once every NIFFS_STATIC_WEAR_PERIOD
+// garbage collection erases. Never lowers the number of free pages.
+static int niffs_static_wear(niffs *fs) {
+  if (fs->wear_erases < NIFFS_STATIC_WEAR_PERIOD) {
+    return NIFFS_OK;
+  }
+  fs->wear_erases = 0;
+
+  u32_t cold = NIFFS_EXCL_SECT_NONE;
+  u32_t cold_diff = 0;
+  u32_t worn = NIFFS_EXCL_SECT_NONE;
+  u32_t worn_diff = 0;
+  u32_t sector;
+  for (sector = 0; sector < fs->sectors; sector++) {
+    u32_t p_free;
+    u32_t p_dele;
+    u32_t p_busy;
+#if NIFFS_GC_STEP
+    if (fs->gc_active && sector == fs->gc_sector) continue;
+#endif
+#if NIFFS_SECTOR_INFO
+    if (fs->sector_info) {
+      p_free = fs->sector_info[sector].free_pages;
+      p_busy = fs->sector_info[sector].busy_pages;
+    } else
+#endif
+    {
+      niffs_gc_count_sector_pages(fs, sector, &p_free, &p_dele, &p_busy);
+    }
+    u32_t diff = niffs_era_cnt_diff(fs, sector);
+    if (p_free == fs->pages_per_sector) {
+      if (worn == NIFFS_EXCL_SECT_NONE || diff < worn_diff) {
+        worn = sector;
+        worn_diff = diff;
+      }
+    } else if (p_busy > 0) {
+      if (cold == NIFFS_EXCL_SECT_NONE || diff > cold_diff) {
+        cold = sector;
+        cold_diff = diff;
+      }
+    }
+  }
+  // nothing lagging, or no free sector worn enough to gain by the move
+  if (cold == NIFFS_EXCL_SECT_NONE || cold_diff <= NIFFS_STATIC_WEAR ||
+      worn == NIFFS_EXCL_SECT_NONE || cold_diff <= worn_diff + 1) {
+    return NIFFS_OK;
+  }
+
+  u32_t p_free;
+  u32_t p_dele;
+  u32_t p_busy;
+  // sector info might have drifted by aborted operations
+  niffs_gc_count_sector_pages(fs, worn, &p_free, &p_dele, &p_busy);
+  if (p_free != fs->pages_per_sector) {
+    return NIFFS_OK;
+  }
+
+  NIFFS_DBG("gc    : static wear sector %i era_d:%i -> sector %i era_d:%i\n", cold, cold_diff, worn, worn_diff);
+  int res = NIFFS_OK;
+  niffs_page_ix dst_pix = _NIFFS_PIX_AT_SECTOR(fs, worn);
+  niffs_page_ix ipix;
+  for (ipix = 0; ipix < fs->pages_per_sector; ipix++) {
+    niffs_page_ix pix = _NIFFS_PIX_AT_SECTOR(fs, cold) + ipix;
+    niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+    if (_NIFFS_IS_FLAG_VALID(phdr) && !_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr)) {
+      res = niffs_move_page(fs, pix, dst_pix++, 0, 0, NIFFS_FLAG_MOVE_KEEP);
+      check(res);
+      NIFFS_STAT_GC_MOVE(fs);
+    }
+  }
+  res = niffs_gc_erase(fs, cold);
+  check(res);
+  fs->wear_erases = 0;
+  return res;
+}
+#endif
+
+int niffs_gc(niffs *fs, u32_t *freed_pages, u8_t allow_full_sector) {
+  niffs_gc_sector_cand cand;
+  int res;
+#if NIFFS_DEAD_ERASE
+  if (fs->dead_cnt) {
+    res = niffs_gc_erase_dead(fs, 0);
+    if (res != NIFFS_VIS_CONT) {
+      check(res);
+      *freed_pages = fs->pages_per_sector;
+      return res;
+    }
+  }
+#endif
+  res = niffs_gc_find_candidate_sector(fs, &cand, allow_full_sector);
+  check(res);
+
+#if NIFFS_SECTOR_INFO
+  if (fs->sector_info) {
+    // stats must be exact, recount candidate should sector info have drifted
+    // by aborted operations
+    niffs_gc_count_sector_pages(fs, cand.sector, &cand.free_pages, &cand.dele_pages, &cand.busy_pages);
+  }
+#endif
+
+  // move all busy pages within sector
+  niffs_page_ix ipix = 0;
+  res = niffs_gc_move_pages(fs, cand.sector, &ipix, (u32_t)-1);
+  check(res);
+
+  res = niffs_gc_erase(fs, cand.sector);
+  check(res);
+  *freed_pages = cand.dele_pages;
+
+  NIFFS_DBG("gc    : freed %i pages (%i dele, %i busy)\n", *freed_pages, cand.dele_pages, cand.busy_pages);
+
+  return res;
+}
+
+#if NIFFS_GC_PLAN
+
+typedef struct {
+  u32_t sector;
+  s32_t score;
+  u32_t dele_pages;
+  u32_t busy_pages;
+} niffs_gc_plan_entry;
+
+// checks if sector a scores higher than b, or as high with fewer moves
+static int niffs_gc_plan_better(const niffs_gc_plan_entry *a, const niffs_gc_plan_entry *b) {
+  return a->score > b->score ||
+      (a->score == b->score && a->busy_pages < b->busy_pages);
+}
+
+// Garbage collects the best scoring sectors until reclaiming at least gain
+// pages, found by one scan. Sectors are scored like single garbage collection
+// candidates. Only sectors without free pages are planned, so no page is
+// moved into a sector yet to be collected. Collects the sectors having
+// fewest busy pages first, so the moves of the others have room. Gains less
+// if the plan cannot hold enough sectors, leaving the rest to niffs_gc.
+static int niffs_gc_plan(niffs *fs, u32_t gain) {
+  niffs_gc_plan_entry plan[NIFFS_GC_PLAN];
+  u32_t len = 0;
+  u32_t sector;
+  u32_t i;
+
+  // keep the best scoring sectors
+  for (sector = 0; sector < fs->sectors; sector++) {
+    niffs_gc_plan_entry e;
+    niffs_erase_cnt era_cnt;
+    u32_t p_free;
+#if NIFFS_GC_STEP
+    if (fs->gc_active && sector == fs->gc_sector) continue;
+#endif
+#if NIFFS_SECTOR_INFO
+    if (fs->sector_info) {
+      era_cnt = fs->sector_info[sector].era_cnt;
+      p_free = fs->sector_info[sector].free_pages;
+      e.dele_pages = fs->sector_info[sector].dele_pages;
+      e.busy_pages = fs->sector_info[sector].busy_pages;
+    } else
+#endif
+    {
+      era_cnt = ((niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(fs, sector))->era_cnt;
+      niffs_gc_count_sector_pages(fs, sector, &p_free, &e.dele_pages, &e.busy_pages);
+    }
+    if (p_free > 0 || e.dele_pages == 0) continue;
+    niffs_erase_cnt era_cnt_diff = fs->max_era - era_cnt;
+    e.sector = sector;
+    e.score = niffs_gc_score(fs, sector, (u32_t)era_cnt_diff, 0, e.dele_pages, e.busy_pages);
+    if (len < NIFFS_GC_PLAN) {
+      i = len++;
+    } else if (niffs_gc_plan_better(&e, &plan[len-1])) {
+      i = len-1;
+    } else {
+      continue;
+    }
+    while (i > 0 && niffs_gc_plan_better(&e, &plan[i-1])) {
+      plan[i] = plan[i-1];
+      i--;
+    }
+    plan[i] = e;
+  }
+
+  // best scoring sectors giving the gain
+  u32_t take = 0;
+  u32_t sum = 0;
+  while (take < len && sum < gain) {
+    sum += plan[take++].dele_pages;
   }
 
-  int res = found ? NIFFS_OK : ERR_NIFFS_NO_GC_CANDIDATE;
-  check(res);
+  // fewest moves first
+  for (i = 1; i < take; i++) {
+    niffs_gc_plan_entry e = plan[i];
+    u32_t j = i;
+    while (j > 0 && plan[j-1].busy_pages > e.busy_pages) {
+      plan[j] = plan[j-1];
+      j--;
+    }
+    plan[j] = e;
+  }
+
+  int res = NIFFS_OK;
+  for (i = 0; i < take; i++) {
+    u32_t p_free;
+    u32_t p_dele;
+    u32_t p_busy;
+    // sector info might have drifted by aborted operations
+    niffs_gc_count_sector_pages(fs, plan[i].sector, &p_free, &p_dele, &p_busy);
+    if (p_free > 0 || p_busy > fs->free_pages) {
+      continue;
+    }
+    NIFFS_DBG("gc    : plan %i/%i sector %i (dele:%i busy:%i)\n", i+1, take, plan[i].sector, p_dele, p_busy);
+    niffs_page_ix ipix = 0;
+    res = niffs_gc_move_pages(fs, plan[i].sector, &ipix, (u32_t)-1);
+    check(res);
+    res = niffs_gc_erase(fs, plan[i].sector);
+    check(res);
+  }
   return res;
 }
 
-int niffs_gc(niffs *fs, u32_t *freed_pages, u8_t allow_full_sector) {
+#endif // NIFFS_GC_PLAN
+
+#if NIFFS_GC_STEP
+
+static int niffs_gc_below_watermark(niffs *fs) {
+  u32_t free_pages = fs->free_pages;
+#if NIFFS_FALLOCATE
+  // reserved pages are not for the taking
+  free_pages = free_pages > fs->resv_pages ? free_pages - fs->resv_pages : 0;
+#endif
+  return free_pages < fs->gc_watermark;
+}
+
+// Finds a sector to start collecting in steps. Only when below watermark, and
+// only a sector having deleted pages whose moves leave the spare sector be,
+// others are left to foreground collection.
+static int niffs_gc_step_candidate(niffs *fs, niffs_gc_sector_cand *cand) {
+  if (!niffs_gc_below_watermark(fs) || fs->dele_pages == 0) {
+    return ERR_NIFFS_NO_GC_CANDIDATE;
+  }
+  int res = niffs_gc_find_candidate_sector(fs, cand, 0);
+  if (res != NIFFS_OK) return res;
+#if NIFFS_SECTOR_INFO
+  if (fs->sector_info) {
+    niffs_gc_count_sector_pages(fs, cand->sector, &cand->free_pages, &cand->dele_pages, &cand->busy_pages);
+  }
+#endif
+  if (cand->dele_pages == 0 ||
+      fs->free_pages < cand->free_pages + cand->busy_pages + fs->pages_per_sector) {
+    return ERR_NIFFS_NO_GC_CANDIDATE;
+  }
+  return NIFFS_OK;
+}
+
+int niffs_gc_pending(niffs *fs) {
+#if NIFFS_ASYNC_ERASE
+  if (fs->er_sector != NIFFS_EXCL_SECT_NONE) return 1;
+#endif
+#if NIFFS_DEAD_ERASE
+  if (niffs_gc_dead_sector(fs) != NIFFS_EXCL_SECT_NONE) return 1;
+#endif
+  if (fs->gc_active) return 1;
   niffs_gc_sector_cand cand;
-  int res = niffs_gc_find_candidate_sector(fs, &cand, allow_full_sector);
-  check(res);
+  return niffs_gc_step_candidate(fs, &cand) == NIFFS_OK;
+}
 
-  // move all busy pages within sector
-  niffs_page_ix ipix;
-  for (ipix = 0; ipix < fs->pages_per_sector; ipix++) {
-    niffs_page_ix pix = _NIFFS_PIX_AT_SECTOR(fs, cand.sector) + ipix;
-    niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
-    if (_NIFFS_IS_FLAG_VALID(phdr) && !_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr)) {
-      niffs_page_ix new_pix;
-      // find dst page & move src
-      res = niffs_find_free_page(fs, &new_pix, cand.sector);
+// Gives back free pages of the sector being collected, which is then left as is.
+void niffs_gc_abandon(niffs *fs) {
+  if (fs->gc_active) {
+    fs->free_pages += fs->gc_free_pages;
+    fs->gc_active = 0;
+  }
+}
+
+int niffs_gc_step(niffs *fs, u32_t max_moves, u8_t allow_erase) {
+  int res;
+#if NIFFS_ASYNC_ERASE
+  if (fs->er_sector != NIFFS_EXCL_SECT_NONE) {
+    // nothing else until erase in flight is done
+    res = niffs_gc_erase_poll(fs, 0);
+    if (res == 1) {
+      return 1;
+    }
+    check(res);
+#if NIFFS_STATIC_WEAR
+    res = niffs_static_wear(fs);
+    check(res);
+#endif
+    return niffs_gc_pending(fs);
+  }
+#endif
+#if NIFFS_DEAD_ERASE
+  if (fs->dead_cnt && allow_erase && !fs->gc_active) {
+    // cheapest reclaim there is, regardless of watermark
+    res = niffs_gc_erase_dead(fs, 1);
+    if (res != NIFFS_VIS_CONT) {
       check(res);
-      res = niffs_move_page(fs, pix, new_pix, 0, 0, NIFFS_FLAG_MOVE_KEEP);
+#if NIFFS_ASYNC_ERASE
+      if (fs->er_sector != NIFFS_EXCL_SECT_NONE) {
+        return 1;
+      }
+#endif
+#if NIFFS_STATIC_WEAR
+      res = niffs_static_wear(fs);
       check(res);
+#endif
+      return niffs_gc_pending(fs);
+    }
+  }
+#endif
+  if (!fs->gc_active) {
+    niffs_gc_sector_cand cand;
+    res = niffs_gc_step_candidate(fs, &cand);
+    if (res == ERR_NIFFS_NO_GC_CANDIDATE) {
+#if NIFFS_DEAD_ERASE
+      // a dead sector might still wait for an allowed erase
+      return niffs_gc_dead_sector(fs) != NIFFS_EXCL_SECT_NONE;
+#else
+      return 0;
+#endif
     }
+    check(res);
+    NIFFS_DBG("gc    : step start sector %i (free:%i dele:%i busy:%i)\n", cand.sector, cand.free_pages, cand.dele_pages, cand.busy_pages);
+    fs->gc_sector = cand.sector;
+    fs->gc_ipix = 0;
+    fs->gc_free_pages = cand.free_pages;
+    fs->free_pages -= cand.free_pages;
+    fs->gc_active = 1;
   }
 
-  // erase sector
-  res = niffs_erase_sector(fs, cand.sector);
+  res = niffs_gc_move_pages(fs, fs->gc_sector, &fs->gc_ipix, max_moves);
+  if (res == NIFFS_VIS_CONT) {
+    return 1;
+  }
   check(res);
+  if (!allow_erase) {
+    return 1;
+  }
 
-  // move free cursor if necessary
-  if (_NIFFS_PIX_2_SECTOR(fs, fs->last_free_pix) == cand.sector) {
-    u32_t new_free_s = cand.sector+1;
-    if (new_free_s >= fs->sectors) {
-      new_free_s = 0;
-    }
-    fs->last_free_pix = _NIFFS_PIX_AT_SECTOR(fs, new_free_s);
+  NIFFS_DBG("gc    : step erase sector %i\n", fs->gc_sector);
+  niffs_gc_abandon(fs);
+#if NIFFS_ASYNC_ERASE
+  res = niffs_gc_erase_start(fs, fs->gc_sector);
+  check(res);
+  if (fs->er_sector != NIFFS_EXCL_SECT_NONE) {
+    return 1;
   }
+#else
+  res = niffs_gc_erase(fs, fs->gc_sector);
+  check(res);
+#endif
+#if NIFFS_STATIC_WEAR
+  res = niffs_static_wear(fs);
+  check(res);
+#endif
+  return niffs_gc_pending(fs);
+}
 
-  // update stats
-  fs->dele_pages -= cand.dele_pages;
-  fs->dele_pages -= cand.busy_pages; // this is added by moving all busy pages in erased sector
-  fs->free_pages += (cand.dele_pages + cand.busy_pages);
-  *freed_pages = cand.dele_pages;
+#endif // NIFFS_GC_STEP
 
-  NIFFS_DBG("gc    : freed %i pages (%i dele, %i busy)\n", *freed_pages, cand.dele_pages, cand.busy_pages);
+#if NIFFS_WEAR_INFO
 
-  return res;
+static void niffs_sector_wear_get(niffs *fs, u32_t sector, niffs_sector_wear *sw) {
+#if NIFFS_SECTOR_INFO
+  if (fs->sector_info) {
+    niffs_sector_info *si = &fs->sector_info[sector];
+    sw->era_cnt = si->era_cnt;
+    sw->free_pages = si->free_pages;
+    sw->dele_pages = si->dele_pages;
+    sw->busy_pages = si->busy_pages;
+    return;
+  }
+#endif
+  u32_t p_free;
+  u32_t p_dele;
+  u32_t p_busy;
+  niffs_gc_count_sector_pages(fs, sector, &p_free, &p_dele, &p_busy);
+  sw->era_cnt = ((niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(fs, sector))->era_cnt;
+  sw->free_pages = p_free;
+  sw->dele_pages = p_dele;
+  sw->busy_pages = p_busy;
+}
+
+int niffs_get_wear_info(niffs *fs, niffs_wear_info *w, niffs_sector_wear *sectors, u32_t sectors_len) {
+  u32_t sector;
+  u32_t max_diff = 0;
+  u32_t sum_diff = 0;
+  NIFFS_ERASE_WAIT(fs);
+  niffs_memset(w, 0, sizeof(niffs_wear_info));
+
+  // first pass, erase counts as differences to most erased sector
+  for (sector = 0; sector < fs->sectors; sector++) {
+    niffs_sector_wear sw;
+    niffs_sector_wear_get(fs, sector, &sw);
+    niffs_erase_cnt diff = fs->max_era - sw.era_cnt;
+    max_diff = NIFFS_MAX((u32_t)diff, max_diff);
+    sum_diff += diff;
+    w->free_pages += sw.free_pages;
+    w->dele_pages += sw.dele_pages;
+    w->busy_pages += sw.busy_pages;
+    if (sectors && sector < sectors_len) {
+      sectors[sector] = sw;
+    }
+  }
+  w->era_max = fs->max_era;
+  w->era_min = fs->max_era - max_diff;
+  w->era_mean = fs->max_era - (sum_diff + fs->sectors - 1) / fs->sectors;
+  w->hist_width = max_diff / NIFFS_WEAR_INFO + 1;
+
+  // second pass, histogram
+  for (sector = 0; sector < fs->sectors; sector++) {
+    w->hist[(max_diff - niffs_era_cnt_diff(fs, sector)) / w->hist_width]++;
+  }
+  return NIFFS_OK;
 }
 
+#endif // NIFFS_WEAR_INFO
+
 /////////////////////////////////// CHECK ////////////////////////////////////
 
 static int niffs_map_obj_hdr_ids_v(niffs *fs, niffs_page_ix pix, niffs_page_hdr *phdr, void *v_arg) {
@@ -1589,7 +3670,7 @@ static int niffs_map_obj_hdr_ids_v(niffs *fs, niffs_page_ix pix, niffs_page_hdr
     if (phdr->id.spix == 0) {
       // object header page
       niffs_object_hdr *ohdr = (niffs_object_hdr *)phdr;
-      if (ohdr->len != NIFFS_UNDEF_LEN && ohdr->len > 0 && ohdr->type != _NIFFS_FTYPE_LINFILE) {
+      if (_NIFFS_OHDR_LEN(ohdr) != NIFFS_UNDEF_LEN && _NIFFS_OHDR_LEN(ohdr) > 0 && ohdr->type != _NIFFS_FTYPE_LINFILE) {
         // Only mark those having a defined length > 0, this way we will remove all unfinished appends
         // to clean file and unfinished deletions.
         // Linear files are not examined, as corresponding data does not reside amongst pages
@@ -1613,7 +3694,7 @@ static int niffs_chk_delete_orphan_bad_dirty_v(niffs *fs, niffs_page_ix pix, nif
     // found a page bad flag status
     NIFFS_DBG("check : pix %04x bad flag status fl/id:%04x/%04x delete hard\n", pix, phdr->flag, phdr->id.raw);
     niffs_page_id_raw delete_raw_id = _NIFFS_PAGE_DELE_ID;
-    res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + offsetof(niffs_page_hdr, id), (u8_t *)&delete_raw_id, sizeof(niffs_page_id_raw));
+    res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + offsetof(niffs_page_hdr, id), (u8_t *)&delete_raw_id, sizeof(niffs_page_id_raw));
     check(res);
   } else if (!_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr)) {
     niffs_obj_id oid = phdr->id.obj_id;
@@ -1624,16 +3705,16 @@ static int niffs_chk_delete_orphan_bad_dirty_v(niffs *fs, niffs_page_ix pix, nif
       NIFFS_DBG("check : pix %04x orphan by id oid:%04x delete\n", pix, oid+1);
       res = niffs_delete_page(fs, pix);
       check(res);
-    } else if (phdr->id.spix == 0 && ohdr->len == 0) {
+    } else if (phdr->id.spix == 0 && _NIFFS_OHDR_LEN(ohdr) == 0) {
       // found an object header page with size 0
       NIFFS_DBG("check : pix %04x unfinished remove oid:%04x delete\n", pix, oid+1);
       res = niffs_delete_page(fs, pix);
       check(res);
     } else if (phdr->id.spix == 0 && ohdr->type != _NIFFS_FTYPE_LINFILE &&
         (((sizeof(niffs_span_ix) < 4 &&
-            ohdr->len != NIFFS_UNDEF_LEN &&
-            ohdr->len > (1 << (8*sizeof(niffs_span_ix))) * fs->page_size)) ||
-        ohdr->len > fs->sector_size * (fs->sectors-1))) {
+            _NIFFS_OHDR_LEN(ohdr) != NIFFS_UNDEF_LEN &&
+            _NIFFS_OHDR_LEN(ohdr) > (1 << (8*sizeof(niffs_span_ix))) * fs->page_size)) ||
+        _NIFFS_OHDR_LEN(ohdr) > fs->sector_size * (fs->sectors-1))) {
       // found an object header page with crazy size
       NIFFS_DBG("check : pix %04x bad length oid:%04x delete\n", pix, oid+1);
       res = niffs_delete_page(fs, pix);
@@ -1646,7 +3727,7 @@ static int niffs_chk_delete_orphan_bad_dirty_v(niffs *fs, niffs_page_ix pix, nif
       if (addr[ix] != 0xff) {
         NIFFS_DBG("check : pix %04x free but contains data, delete hard\n", pix);
         niffs_page_id_raw delete_raw_id = _NIFFS_PAGE_DELE_ID;
-        res = fs->hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + offsetof(niffs_page_hdr, id), (u8_t *)&delete_raw_id, sizeof(niffs_page_id_raw));
+        res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + offsetof(niffs_page_hdr, id), (u8_t *)&delete_raw_id, sizeof(niffs_page_id_raw));
         check(res);
         break;
       }
@@ -1742,13 +3823,17 @@ typedef struct {
 static int niffs_chk_movi_objhdr_pages_v(niffs *fs, niffs_page_ix pix, niffs_page_hdr *phdr, void *v_arg) {
   niffs_chk_movi_objhdr_arg *arg = (niffs_chk_movi_objhdr_arg *)v_arg;
 
-  if (!_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr) && _NIFFS_IS_MOVI(phdr)) {
+  if (!_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr) && (_NIFFS_IS_MOVI(phdr)
+#if NIFFS_LEN_SLOTS
+      || (phdr->id.spix == 0 && _NIFFS_IS_WRIT(phdr) && niffs_len_slot_pending((niffs_object_hdr *)phdr))
+#endif
+      )) {
     if (phdr->id.spix == 0) {
       niffs_object_hdr *ohdr = (niffs_object_hdr *)phdr;
       niffs_page_ix *log = (niffs_page_ix *)fs->buf;
       log[arg->ix] = pix;
       (void)ohdr;
-      NIFFS_DBG("  chck: pix %04x register MOVI obj hdr oid:%04x max_spix:%i\n", pix, phdr->id.obj_id, (int)_NIFFS_OFFS_2_SPIX(fs, ohdr->len));
+      NIFFS_DBG("  chck: pix %04x register MOVI obj hdr oid:%04x max_spix:%i\n", pix, phdr->id.obj_id, (int)_NIFFS_OFFS_2_SPIX(fs, _NIFFS_OHDR_LEN(ohdr)));
       arg->ix++;
       if (arg->ix >= arg->len) {
         arg->last_pix = pix;
@@ -1779,9 +3864,9 @@ static int niffs_chk_tidy_movi_objhdr_page(niffs *fs, niffs_page_ix pix, niffs_p
   niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
   niffs_chk_movi_objhdr_tidy_arg t_arg = {
       .oid = ohdr->phdr.id.obj_id,
-      .gt_spix = _NIFFS_OFFS_2_SPIX(fs, ohdr->len == NIFFS_UNDEF_LEN ? 0 : ohdr->len)
+      .gt_spix = _NIFFS_OFFS_2_SPIX(fs, _NIFFS_OHDR_FILE_LEN(ohdr))
   };
-  if (_NIFFS_OFFS_2_PDATA_OFFS(fs, ohdr->len == NIFFS_UNDEF_LEN ? 0 : ohdr->len) == 0) {
+  if (_NIFFS_OFFS_2_PDATA_OFFS(fs, _NIFFS_OHDR_FILE_LEN(ohdr)) == 0) {
     t_arg.gt_spix--;
   }
   if (ohdr->type != _NIFFS_FTYPE_LINFILE) {
@@ -1793,6 +3878,17 @@ static int niffs_chk_tidy_movi_objhdr_page(niffs *fs, niffs_page_ix pix, niffs_p
     check(res);
   }
 
+#if NIFFS_LEN_SLOTS
+  if (_NIFFS_IS_WRIT(&ohdr->phdr)) {
+    // uncommitted length slot, object header itself is fine - mark slot aborted
+    NIFFS_DBG("  chck: pix %04x abort length slot\n", pix);
+    if (dst_pix) *dst_pix = pix;
+    res = niffs_len_slot_write(fs, pix, niffs_len_slot_free(ohdr) - 1, _NIFFS_LEN_SLOT_ABORTED);
+    check(res);
+    return res;
+  }
+#endif
+
   // move obj hdr as written
   NIFFS_DBG("  chck: pix %04x move as written\n", pix);
   niffs_page_ix new_pix;
@@ -1822,6 +3918,9 @@ static int niffs_chk_tidy_movi_objhdr_page(niffs *fs, niffs_page_ix pix, niffs_p
           if (sector[wix] != 0xff) last_non_ff = wix;
         }
         u32_t new_len = lflen + (last_non_ff + 1 - (lflen % fs->sector_size));
+        // trailing ff:s of data cannot be told from erased flash, round up as
+        // writes start on NIFFS_WORD_ALIGN and appended lengths keep aligned
+        new_len = ((new_len + NIFFS_WORD_ALIGN - 1) / NIFFS_WORD_ALIGN) * NIFFS_WORD_ALIGN;
         niffs_linear_file_hdr new_lfhdr;
         niffs_memcpy(&new_lfhdr, lfhdr, sizeof(niffs_linear_file_hdr));
         new_lfhdr.ohdr.len = new_len;
@@ -1849,7 +3948,7 @@ static int niffs_find_duplicate_obj_hdr_ids_v(niffs *fs, niffs_page_ix pix, niff
     if (phdr->id.spix == 0) {
       // object header page
       niffs_object_hdr *ohdr = (niffs_object_hdr *)phdr;
-      if (ohdr->len != NIFFS_UNDEF_LEN && ohdr->len > 0) {
+      if (_NIFFS_OHDR_LEN(ohdr) != NIFFS_UNDEF_LEN && _NIFFS_OHDR_LEN(ohdr) > 0) {
         // only mark those having a defined length > 0, this way we will remove all unfinished appends
         // to clean file and unfinished deletions
         niffs_obj_id oid = phdr->id.obj_id;
@@ -1986,6 +4085,9 @@ int niffs_chk(niffs *fs) {
 static int niffs_setup(niffs *fs) {
   fs->free_pages = 0;
   fs->dele_pages = 0;
+#if NIFFS_DEAD_ERASE
+  fs->dead_cnt = 0;
+#endif
   fs->max_era = 0;
   u32_t s;
   u32_t bad_sectors = 0;
@@ -2012,6 +4114,9 @@ static int niffs_setup(niffs *fs) {
     check(ERR_NIFFS_NOT_A_FILESYSTEM);
   }
 
+  niffs_index_reset(fs);
+
+  u32_t ckpt_pages = 0;
   for (s = 0; s < fs->sectors; s++) {
     niffs_sector_hdr *shdr = (niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(fs, s);
     if (shdr->abra != _NIFFS_SECT_MAGIC(fs)) {
@@ -2020,21 +4125,361 @@ static int niffs_setup(niffs *fs) {
       check(res);
     }
 
+    niffs_index_sector_scanned(fs, s);
     niffs_page_ix ipix;
+    u32_t dele_pages = 0;
     for (ipix = 0; ipix < fs->pages_per_sector; ipix++) {
       niffs_page_ix pix = _NIFFS_PIX_AT_SECTOR(fs, s) + ipix;
+      NIFFS_STAT_TRAVERSE(fs, pix);
       niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
       if (_NIFFS_IS_FREE(phdr)) {
         fs->free_pages++;
       }
       else if (_NIFFS_IS_DELE(phdr) || !_NIFFS_IS_FLAG_VALID(phdr)) {
         fs->dele_pages++;
+        dele_pages++;
+      }
+      else if (phdr->id.obj_id == _NIFFS_CKPT_OID(fs)) {
+        ckpt_pages++;
+      }
+      niffs_index_page_scanned(fs, pix, phdr);
+    }
+#if NIFFS_DEAD_ERASE
+    if (dele_pages == fs->pages_per_sector && fs->dead_cnt < NIFFS_DEAD_ERASE) {
+      fs->dead_sectors[fs->dead_cnt++] = s;
+    }
+#else
+    (void)dele_pages;
+#endif
+  }
+
+  if (ckpt_pages) {
+    // checkpoint not restored from or unfinished, outdated once scanned
+    NIFFS_DBG("check : deleting %i checkpoint pages\n", ckpt_pages);
+    niffs_page_ix pix;
+    for (pix = 0; pix < fs->pages_per_sector * fs->sectors; pix++) {
+      NIFFS_STAT_TRAVERSE(fs, pix);
+      niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+      if (!_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr) && phdr->id.obj_id == _NIFFS_CKPT_OID(fs)) {
+        int res = niffs_delete_page(fs, pix);
+        check(res);
+      }
+    }
+  }
+  return NIFFS_OK;
+}
+
+////////////////////////////////// CHECKPOINT //////////////////////////////////
+
+#if NIFFS_CHECKPOINT
+
+#define _NIFFS_CKPT_COUNT       (0)
+#define _NIFFS_CKPT_STORE       (1)
+#define _NIFFS_CKPT_RESTORE     (2)
+
+// checkpoint data bytes per data page
+#define _NIFFS_CKPT_DATA_LEN(_fs) \
+  ((_fs)->page_size - sizeof(niffs_ckpt_data_hdr))
+// maximum number of data pages listed in checkpoint header page
+#define _NIFFS_CKPT_MAX_PAGES(_fs) \
+  (((_fs)->page_size - sizeof(niffs_ckpt_hdr)) / sizeof(niffs_page_ix))
+// data page indices following checkpoint header
+#define _NIFFS_CKPT_PIX(_ckhdr) \
+  ((niffs_page_ix *)((u8_t *)(_ckhdr) + sizeof(niffs_ckpt_hdr)))
+
+// set if there are ram indices to checkpoint, else only page counts are kept
+#define _NIFFS_CKPT_INDICES \
+  (NIFFS_SPAN_INDEX || NIFFS_NAME_INDEX || NIFFS_FREE_MAP || NIFFS_ID_MAP || \
+   NIFFS_SECTOR_INFO || (NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS))
+
+#define _NIFFS_CKPT_XFER(_fs, _s, _ram, _len) do { \
+  int __res = niffs_ckpt_xfer((_fs), (_s), (_ram), (_len)); \
+  if (__res != NIFFS_OK) return __res; \
+} while (0)
+
+typedef struct {
+  // one of _NIFFS_CKPT_COUNT, _NIFFS_CKPT_STORE, _NIFFS_CKPT_RESTORE
+  u8_t mode;
+  // checkpoint header page in flash
+  niffs_ckpt_hdr *ckhdr;
+  // current data page
+  u32_t page;
+  // offset in current data page
+  u32_t offs;
+  // total number of bytes, when counting
+  u32_t len;
+} niffs_ckpt_stream;
+
+// writes data page staged in work buffer
+static int niffs_ckpt_flush(niffs *fs, niffs_ckpt_stream *s) {
+  niffs_page_ix pix = _NIFFS_CKPT_PIX(s->ckhdr)[s->page];
+  niffs_ckpt_data_hdr *dhdr = (niffs_ckpt_data_hdr *)fs->buf;
+  int res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + sizeof(niffs_page_hdr),
+      fs->buf + sizeof(niffs_page_hdr), sizeof(niffs_ckpt_data_hdr) - sizeof(niffs_page_hdr) + s->offs);
+  check(res);
+  res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + offsetof(niffs_page_hdr, id),
+      (u8_t *)&dhdr->phdr.id, sizeof(niffs_page_hdr_id));
+  check(res);
+  s->page++;
+  s->offs = 0;
+  dhdr->phdr.id.spix = s->page + 1;
+  return res;
+}
+
+#if _NIFFS_CKPT_INDICES
+static int niffs_ckpt_raw(niffs *fs, niffs_ckpt_stream *s, u8_t *ram, u32_t len) {
+  int res = NIFFS_OK;
+  while (len > 0) {
+    u32_t avail = NIFFS_MIN(len, _NIFFS_CKPT_DATA_LEN(fs) - s->offs);
+    if (s->mode == _NIFFS_CKPT_STORE) {
+      niffs_memcpy(fs->buf + sizeof(niffs_ckpt_data_hdr) + s->offs, ram, avail);
+    } else {
+      if (s->page >= s->ckhdr->data_pages) return NIFFS_VIS_CONT;
+      niffs_page_ix pix = _NIFFS_CKPT_PIX(s->ckhdr)[s->page];
+      _NIFFS_RD(fs, ram, (u8_t *)_NIFFS_PIX_2_ADDR(fs, pix) + sizeof(niffs_ckpt_data_hdr) + s->offs, avail);
+    }
+    ram += avail;
+    len -= avail;
+    s->offs += avail;
+    if (s->offs == _NIFFS_CKPT_DATA_LEN(fs)) {
+      if (s->mode == _NIFFS_CKPT_STORE) {
+        res = niffs_ckpt_flush(fs, s);
+        check(res);
+      } else {
+        s->page++;
+        s->offs = 0;
       }
     }
   }
+  return res;
+}
+
+// Counts, stores or restores given ram as a checkpoint section. When
+// restoring, returns NIFFS_VIS_CONT if the stored section has another length.
+static int niffs_ckpt_xfer(niffs *fs, niffs_ckpt_stream *s, void *ram, u32_t len) {
+  if (s->mode == _NIFFS_CKPT_COUNT) {
+    s->len += sizeof(u32_t) + len;
+    return NIFFS_OK;
+  }
+  u32_t sect_len = len;
+  int res = niffs_ckpt_raw(fs, s, (u8_t *)&sect_len, sizeof(u32_t));
+  if (res != NIFFS_OK) return res;
+  if (sect_len != len) return NIFFS_VIS_CONT;
+  return niffs_ckpt_raw(fs, s, (u8_t *)ram, len);
+}
+#endif // _NIFFS_CKPT_INDICES
+
+// counts, stores or restores all ram indices
+static int niffs_ckpt_state(niffs *fs, niffs_ckpt_stream *s) {
+#if NIFFS_SPAN_INDEX
+  _NIFFS_CKPT_XFER(fs, s, &fs->span_index_cnt, sizeof(fs->span_index_cnt));
+  _NIFFS_CKPT_XFER(fs, s, &fs->span_index_ovf, sizeof(fs->span_index_ovf));
+  _NIFFS_CKPT_XFER(fs, s, fs->span_index, fs->span_index_len * sizeof(niffs_span_index_entry));
+#endif
+#if NIFFS_NAME_INDEX
+  _NIFFS_CKPT_XFER(fs, s, &fs->name_index_cnt, sizeof(fs->name_index_cnt));
+  _NIFFS_CKPT_XFER(fs, s, &fs->name_index_ovf, sizeof(fs->name_index_ovf));
+  _NIFFS_CKPT_XFER(fs, s, fs->name_index, fs->name_index_len * sizeof(niffs_name_index_entry));
+#endif
+#if NIFFS_FREE_MAP
+  _NIFFS_CKPT_XFER(fs, s, fs->free_map, fs->free_map ? _NIFFS_FREE_MAP_WORDS(fs) * sizeof(u32_t) : 0);
+#endif
+#if NIFFS_ID_MAP
+  _NIFFS_CKPT_XFER(fs, s, &fs->id_cursor, sizeof(fs->id_cursor));
+  _NIFFS_CKPT_XFER(fs, s, fs->id_map, fs->id_map ? _NIFFS_ID_MAP_WORDS(fs) * sizeof(u32_t) : 0);
+#endif
+#if NIFFS_SECTOR_INFO
+  _NIFFS_CKPT_XFER(fs, s, fs->sector_info, fs->sector_info ? fs->sectors * sizeof(niffs_sector_info) : 0);
+#endif
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+  _NIFFS_CKPT_XFER(fs, s, &fs->lin_extents_ovf, sizeof(fs->lin_extents_ovf));
+  _NIFFS_CKPT_XFER(fs, s, &fs->lin_extents_cnt, sizeof(fs->lin_extents_cnt));
+  if (fs->lin_extents_cnt > fs->lin_extents_len) return NIFFS_VIS_CONT;
+  _NIFFS_CKPT_XFER(fs, s, fs->lin_extents, fs->lin_extents_cnt * sizeof(niffs_linear_extent));
+#endif
+  (void)fs;
+  (void)s;
   return NIFFS_OK;
 }
 
+static int niffs_ckpt_store(niffs *fs) {
+  niffs_ckpt_stream s = {.mode = _NIFFS_CKPT_COUNT};
+  int res = niffs_ckpt_state(fs, &s);
+  check(res);
+  u32_t pages = fs->pages_per_sector * fs->sectors;
+  u32_t data_pages = (s.len + _NIFFS_CKPT_DATA_LEN(fs) - 1) / _NIFFS_CKPT_DATA_LEN(fs);
+  if (data_pages > _NIFFS_CKPT_MAX_PAGES(fs) || fs->free_pages < data_pages + 1 + fs->pages_per_sector) {
+    NIFFS_DBG("ckpt  : no room for %i checkpoint pages\n", data_pages + 1);
+    return NIFFS_OK;
+  }
+
+  // header page is put first or last in a sector so it is found without
+  // scanning all pages
+  niffs_page_ix hdr_pix = 0;
+  u8_t found = 0;
+  u32_t i;
+  for (i = 0; !found && i < fs->sectors; i++) {
+    u32_t sector = (_NIFFS_PIX_2_SECTOR(fs, fs->last_free_pix) + i) % fs->sectors;
+    niffs_page_ix cand[2] = {
+        _NIFFS_PIX_AT_SECTOR(fs, sector),
+        _NIFFS_PIX_AT_SECTOR(fs, sector) + fs->pages_per_sector - 1
+    };
+    u32_t c;
+    for (c = 0; !found && c < 2; c++) {
+      niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, cand[c]);
+      if (_NIFFS_IS_FREE(phdr) && _NIFFS_IS_CLEA(phdr)) {
+        hdr_pix = cand[c];
+        found = 1;
+      }
+    }
+  }
+  if (!found) {
+    NIFFS_DBG("ckpt  : no free page for checkpoint header\n");
+    return NIFFS_OK;
+  }
+
+  // find data pages, compose header in work buffer
+  niffs_memset(fs->buf, 0xff, fs->page_size);
+  niffs_ckpt_hdr *ckhdr = (niffs_ckpt_hdr *)fs->buf;
+  niffs_page_ix *data_pix = _NIFFS_CKPT_PIX(ckhdr);
+  u32_t found_pages = 0;
+  for (i = 0; found_pages < data_pages && i < pages; i++) {
+    niffs_page_ix pix = (fs->last_free_pix + i) % pages;
+    niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+    if (pix != hdr_pix && _NIFFS_IS_FREE(phdr) && _NIFFS_IS_CLEA(phdr)) {
+      data_pix[found_pages++] = pix;
+    }
+  }
+  if (found_pages < data_pages) {
+    NIFFS_DBG("ckpt  : no room for %i checkpoint pages\n", data_pages + 1);
+    return NIFFS_OK;
+  }
+
+  // stored state is that of after next mount, having deleted the checkpoint
+  niffs_index_page_dropped(fs, hdr_pix);
+  for (i = 0; i < data_pages; i++) {
+    niffs_index_page_dropped(fs, data_pix[i]);
+  }
+  fs->free_pages -= data_pages + 1;
+  fs->dele_pages += data_pages + 1;
+
+  ckhdr->ohdr.phdr.id.obj_id = _NIFFS_CKPT_OID(fs);
+  ckhdr->ohdr.phdr.id.spix = 0;
+  niffs_memset(ckhdr->ohdr.name, 0, NIFFS_NAME_LEN);
+  ckhdr->ohdr.type = _NIFFS_FTYPE_CKPT;
+  ckhdr->gen = ++fs->ckpt_gen;
+  ckhdr->free_pages = fs->free_pages;
+  ckhdr->dele_pages = fs->dele_pages;
+  ckhdr->max_era = fs->max_era;
+  ckhdr->last_free_pix = fs->last_free_pix;
+  ckhdr->data_pages = data_pages;
+
+  NIFFS_DBG("ckpt  : gen %i, header pix %04x, %i data pages, %i bytes\n", ckhdr->gen, hdr_pix, data_pages, s.len);
+
+  // write header page as clean, marked as written when all data is written
+  res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, hdr_pix) + sizeof(niffs_page_hdr),
+      fs->buf + sizeof(niffs_page_hdr),
+      sizeof(niffs_ckpt_hdr) - sizeof(niffs_page_hdr) + data_pages * sizeof(niffs_page_ix));
+  check(res);
+  res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, hdr_pix) + offsetof(niffs_page_hdr, id),
+      (u8_t *)&ckhdr->ohdr.phdr.id, sizeof(niffs_page_hdr_id));
+  check(res);
+
+  // stage data pages in work buffer
+  u32_t gen = ckhdr->gen;
+  niffs_memset(fs->buf, 0xff, fs->page_size);
+  niffs_ckpt_data_hdr *dhdr = (niffs_ckpt_data_hdr *)fs->buf;
+  dhdr->phdr.id.obj_id = _NIFFS_CKPT_OID(fs);
+  dhdr->phdr.id.spix = 1;
+  dhdr->gen = gen;
+
+  s.mode = _NIFFS_CKPT_STORE;
+  s.ckhdr = (niffs_ckpt_hdr *)_NIFFS_PIX_2_ADDR(fs, hdr_pix);
+  res = niffs_ckpt_state(fs, &s);
+  check(res);
+  if (s.offs > 0) {
+    res = niffs_ckpt_flush(fs, &s);
+    check(res);
+  }
+  NIFFS_ASSERT(s.page == data_pages);
+
+  niffs_flag flag = _NIFFS_FLAG_WRITTEN;
+  res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, hdr_pix) + offsetof(niffs_page_hdr, flag),
+      (u8_t *)&flag, sizeof(niffs_flag));
+  check(res);
+
+  return res;
+}
+
+// Restores state from checkpoint and deletes it. Returns NIFFS_VIS_CONT if
+// there is no valid checkpoint and the filesystem must be scanned.
+static int niffs_ckpt_restore(niffs *fs) {
+  niffs_ckpt_hdr *ckhdr = 0;
+  u32_t pages = fs->pages_per_sector * fs->sectors;
+  u32_t sector;
+  for (sector = 0; sector < fs->sectors; sector++) {
+    niffs_sector_hdr *shdr = (niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(fs, sector);
+    if (shdr->abra != _NIFFS_SECT_MAGIC(fs)) {
+      return NIFFS_VIS_CONT;
+    }
+    niffs_page_ix cand[2] = {
+        _NIFFS_PIX_AT_SECTOR(fs, sector),
+        _NIFFS_PIX_AT_SECTOR(fs, sector) + fs->pages_per_sector - 1
+    };
+    u32_t c;
+    for (c = 0; c < 2; c++) {
+      NIFFS_STAT_TRAVERSE(fs, cand[c]);
+      niffs_ckpt_hdr *cand_hdr = (niffs_ckpt_hdr *)_NIFFS_PIX_2_ADDR(fs, cand[c]);
+      if (_NIFFS_IS_WRIT(&cand_hdr->ohdr.phdr) &&
+          cand_hdr->ohdr.phdr.id.obj_id == _NIFFS_CKPT_OID(fs) && cand_hdr->ohdr.phdr.id.spix == 0 &&
+          cand_hdr->ohdr.type == _NIFFS_FTYPE_CKPT) {
+        ckhdr = cand_hdr;
+      }
+    }
+  }
+  if (ckhdr == 0) return NIFFS_VIS_CONT;
+  if (ckhdr->data_pages > _NIFFS_CKPT_MAX_PAGES(fs) || ckhdr->last_free_pix >= pages) {
+    return NIFFS_VIS_CONT;
+  }
+  u32_t i;
+  for (i = 0; i < ckhdr->data_pages; i++) {
+    niffs_page_ix pix = _NIFFS_CKPT_PIX(ckhdr)[i];
+    if (pix >= pages) return NIFFS_VIS_CONT;
+    NIFFS_STAT_TRAVERSE(fs, pix);
+    niffs_ckpt_data_hdr *dhdr = (niffs_ckpt_data_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+    if (!_NIFFS_IS_CLEA(&dhdr->phdr) || dhdr->phdr.id.obj_id != _NIFFS_CKPT_OID(fs) ||
+        dhdr->phdr.id.spix != i + 1 || dhdr->gen != ckhdr->gen) {
+      return NIFFS_VIS_CONT;
+    }
+  }
+
+  niffs_ckpt_stream s = {.mode = _NIFFS_CKPT_RESTORE, .ckhdr = ckhdr};
+  int res = niffs_ckpt_state(fs, &s);
+  if (res != NIFFS_OK) return res;
+  fs->free_pages = ckhdr->free_pages;
+  fs->dele_pages = ckhdr->dele_pages;
+  fs->max_era = ckhdr->max_era;
+  fs->last_free_pix = ckhdr->last_free_pix;
+  fs->ckpt_gen = ckhdr->gen;
+
+  NIFFS_DBG("ckpt  : restored gen %i, %i data pages\n", ckhdr->gen, ckhdr->data_pages);
+
+  // delete checkpoint, header first, pages are already counted as deleted
+  niffs_page_id_raw delete_raw_id = _NIFFS_PAGE_DELE_ID;
+  res = niffs_hal_write(fs, (u8_t *)&ckhdr->ohdr.phdr + offsetof(niffs_page_hdr, id),
+      (u8_t *)&delete_raw_id, sizeof(niffs_page_id_raw));
+  check(res);
+  for (i = 0; i < ckhdr->data_pages; i++) {
+    res = niffs_hal_write(fs, (u8_t *)_NIFFS_PIX_2_ADDR(fs, _NIFFS_CKPT_PIX(ckhdr)[i]) + offsetof(niffs_page_hdr, id),
+        (u8_t *)&delete_raw_id, sizeof(niffs_page_id_raw));
+    check(res);
+  }
+
+  return res;
+}
+
+#endif // NIFFS_CHECKPOINT
+
 ///////////////////////////////////// API ////////////////////////////////////
 
 int NIFFS_init(niffs *fs, u8_t *phys_addr, u32_t sectors, u32_t sector_size, u32_t page_size,
@@ -2047,11 +4492,64 @@ int NIFFS_init(niffs *fs, u8_t *phys_addr, u32_t sectors, u32_t sector_size, u32
   fs->buf_len = buf_len;
   fs->hal_er = erase_f;
   fs->hal_wr = write_f;
+#if NIFFS_ASYNC_ERASE
+  fs->hal_er_start = 0;
+  fs->hal_er_poll = 0;
+  fs->er_sector = NIFFS_EXCL_SECT_NONE;
+#endif
   fs->descs = descs;
   fs->descs_len = file_desc_len;
   fs->last_free_pix = 0;
   fs->mounted = 0;
   fs->max_era = 0;
+#if NIFFS_SPAN_INDEX
+  fs->span_index = 0;
+  fs->span_index_len = 0;
+#endif
+#if NIFFS_NAME_INDEX
+  fs->name_index = 0;
+  fs->name_index_len = 0;
+#endif
+#if NIFFS_FREE_MAP
+  fs->free_map = 0;
+#endif
+#if NIFFS_ID_MAP
+  fs->id_map = 0;
+#endif
+#if NIFFS_SECTOR_INFO
+  fs->sector_info = 0;
+#endif
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+  fs->lin_extents = 0;
+  fs->lin_extents_len = 0;
+#endif
+#if NIFFS_CHECKPOINT
+  fs->ckpt_gen = 0;
+  fs->ckpt_unclean = 0;
+#endif
+#if NIFFS_WRITE_CACHE
+  fs->wcache = 0;
+  fs->wcache_len = 0;
+#endif
+#if NIFFS_FALLOCATE
+  fs->resv_pages = 0;
+#endif
+#if NIFFS_GC_STEP
+  fs->gc_active = 0;
+#endif
+#if NIFFS_COLD_HEAD
+  fs->last_cold_pix = 0;
+  fs->cold_sector = NIFFS_EXCL_SECT_NONE;
+#endif
+#if NIFFS_GC_POLICY
+  fs->gc_policy = 0;
+#endif
+#if NIFFS_DEAD_ERASE
+  fs->dead_cnt = 0;
+#endif
+#if NIFFS_STATIC_WEAR
+  fs->wear_erases = 0;
+#endif
 
   u32_t pages_per_sector = sector_size / page_size;
   niffs_memset(descs, 0, file_desc_len * sizeof(niffs_file_desc));
@@ -2101,6 +4599,9 @@ int NIFFS_init(niffs *fs, u8_t *phys_addr, u32_t sectors, u32_t sector_size, u32
   }
 
   fs->pages_per_sector = pages_per_sector;
+#if NIFFS_GC_STEP
+  fs->gc_watermark = 2 * pages_per_sector;
+#endif
 
 #if NIFFS_LINEAR_AREA
   if (lin_sectors > buf_len*8) {
@@ -2142,7 +4643,7 @@ int NIFFS_format(niffs *fs) {
 #if NIFFS_LINEAR_AREA
   for (s = fs->sectors; res == NIFFS_OK && s < fs->sectors+fs->lin_sectors; s++) {
     NIFFS_DBG("erase : sector %i linear\n", s);
-    res = fs->hal_er(_NIFFS_SECTOR_2_ADDR(fs, s), fs->sector_size);
+    res = niffs_hal_erase(fs, _NIFFS_SECTOR_2_ADDR(fs, s), fs->sector_size);
     check(res);
   }
 #endif
@@ -2151,24 +4652,77 @@ int NIFFS_format(niffs *fs) {
 
 int NIFFS_mount(niffs *fs) {
   if (fs->mounted) check(ERR_NIFFS_MOUNTED);
+#if NIFFS_DEAD_ERASE
+  fs->dead_cnt = 0;
+#endif
+#if NIFFS_STATIC_WEAR
+  fs->wear_erases = 0;
+#endif
+#if NIFFS_CHECKPOINT
+  fs->ckpt_unclean = 0;
+  int res = niffs_ckpt_restore(fs);
+  if (res == NIFFS_VIS_CONT) {
+    res = niffs_setup(fs);
+  }
+#else
   int res = niffs_setup(fs);
+#endif
   check(res);
+#if NIFFS_GC_STEP
+  fs->gc_active = 0;
+#endif
+#if NIFFS_COLD_HEAD
+  fs->last_cold_pix = fs->last_free_pix;
+  fs->cold_sector = NIFFS_EXCL_SECT_NONE;
+#endif
   fs->mounted = 1;
   return NIFFS_OK;
 }
 
 int NIFFS_unmount(niffs *fs) {
   if (!fs->mounted) check(ERR_NIFFS_NOT_MOUNTED);
+  int res = NIFFS_OK;
   u32_t i;
   for (i = 0; i < fs->descs_len; i++) {
+#if _NIFFS_FD_SYNC
+    int cres = niffs_close(fs, i);
+    if (res == NIFFS_OK) res = cres;
+#endif
     fs->descs[i].obj_id = 0;
+#if NIFFS_FALLOCATE
+    fs->descs[i].resv_pages = 0;
+#endif
+  }
+#if NIFFS_FALLOCATE
+  fs->resv_pages = 0;
+#endif
+#if NIFFS_ASYNC_ERASE
+  if (fs->er_sector != NIFFS_EXCL_SECT_NONE) {
+    int eres = niffs_gc_erase_poll(fs, 1);
+    if (res == NIFFS_OK) res = eres;
+  }
+#endif
+#if NIFFS_GC_STEP
+  niffs_gc_abandon(fs);
+#endif
+#if NIFFS_CHECKPOINT
+  if (!fs->ckpt_unclean) {
+    int cres = niffs_ckpt_store(fs);
+    if (res == NIFFS_OK) res = cres;
   }
+#endif
   fs->mounted = 0;
-  return NIFFS_OK;
+  check(res);
+  return res;
 }
 
 #ifdef NIFFS_DUMP
 void NIFFS_dump(niffs *fs) {
+#if NIFFS_ASYNC_ERASE
+  if (fs->er_sector != NIFFS_EXCL_SECT_NONE) {
+    (void)niffs_gc_erase_poll(fs, 1);
+  }
+#endif
   NIFFS_DUMP_OUT("NIFFS\n");
   NIFFS_DUMP_OUT("sector size : %i\n", fs->sector_size);
   NIFFS_DUMP_OUT("sectors     : %i\n", fs->sectors);
@@ -2177,6 +4731,16 @@ void NIFFS_dump(niffs *fs) {
   NIFFS_DUMP_OUT("phys addr   : %p\n", fs->phys_addr);
   NIFFS_DUMP_OUT("free pages  : %i\n", fs->free_pages);
   NIFFS_DUMP_OUT("dele pages  : %i\n", fs->dele_pages);
+#if NIFFS_SPAN_INDEX
+  if (fs->span_index) {
+    NIFFS_DUMP_OUT("span index  : %i/%i%s\n", fs->span_index_cnt, fs->span_index_len, fs->span_index_ovf ? " overflow" : "");
+  }
+#endif
+#if NIFFS_NAME_INDEX
+  if (fs->name_index) {
+    NIFFS_DUMP_OUT("name index  : %i/%i%s\n", fs->name_index_cnt, fs->name_index_len, fs->name_index_ovf ? " overflow" : "");
+  }
+#endif
   u32_t s;
   u32_t tot_free = 0;
   u32_t tot_dele = 0;
@@ -2199,7 +4763,7 @@ void NIFFS_dump(niffs *fs) {
       if (!_NIFFS_IS_FREE(&ohdr->phdr) && !_NIFFS_IS_DELE(&ohdr->phdr)) {
         NIFFS_DUMP_OUT("  obj.id:%04x  sp.ix:%02x  ", ohdr->phdr.id.obj_id, ohdr->phdr.id.spix);
         if (ohdr->phdr.id.spix == 0 && _NIFFS_IS_ID_VALID(&ohdr->phdr)) {
-          NIFFS_DUMP_OUT("len:%08x  type:%02x", ohdr->len, ohdr->type);
+          NIFFS_DUMP_OUT("len:%08x  type:%02x", _NIFFS_OHDR_LEN(ohdr), ohdr->type);
           if (ohdr->type == _NIFFS_FTYPE_LINFILE) {
             niffs_linear_file_hdr *lfhdr = (niffs_linear_file_hdr *)ohdr;
             NIFFS_DUMP_OUT("  start_sec:%d  resv_sec:%d", lfhdr->start_sector, lfhdr->resv_sectors);
@@ -2219,8 +4783,15 @@ void NIFFS_dump(niffs *fs) {
     NIFFS_DUMP_OUT("FATAL! registered deleted pages:%i, but counted %i\n", fs->dele_pages, tot_dele);
 //    NIFFS_ASSERT(0);
   }
-  if (tot_free != fs->free_pages) {
-    NIFFS_DUMP_OUT("FATAL! registered free pages:%i, but counted %i\n", fs->free_pages, tot_free);
+  u32_t reg_free = fs->free_pages;
+#if NIFFS_GC_STEP
+  if (fs->gc_active) {
+    NIFFS_DUMP_OUT("gc step     : sector %i, page %i\n", fs->gc_sector, fs->gc_ipix);
+    reg_free += fs->gc_free_pages;
+  }
+#endif
+  if (tot_free != reg_free) {
+    NIFFS_DUMP_OUT("FATAL! registered free pages:%i, but counted %i\n", reg_free, tot_free);
 //    NIFFS_ASSERT(0);
   }
 }
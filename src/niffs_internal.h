@@ -103,6 +103,10 @@
 #ifndef NIFFS_INTERNAL_H_
 #define NIFFS_INTERNAL_H_
 
+#if NIFFS_ASYNC_ERASE && !NIFFS_GC_STEP
+#error "NIFFS_ASYNC_ERASE needs NIFFS_GC_STEP"
+#endif
+
 #define _NIFFS_PAGE_FREE_ID     ((niffs_page_id_raw)-1)
 #define _NIFFS_PAGE_DELE_ID     ((niffs_page_id_raw)0)
 
@@ -113,9 +117,14 @@
 
 #define _NIFFS_FTYPE_FILE       (0)
 #define _NIFFS_FTYPE_LINFILE    (1)
+#define _NIFFS_FTYPE_CKPT       (2)
+
+// object id of checkpoint pages, never handed out by niffs_find_free_id
+#define _NIFFS_CKPT_OID(_fs)    ((niffs_obj_id)((_fs)->pages_per_sector * (_fs)->sectors - 2))
 
-// change of magic since file type introduction
-#define _NIFFS_SECT_MAGIC(_fs)  (niffs_magic)(0xfee1c001 ^ (_fs)->page_size)
+// change of magic since file type introduction, length slots change the
+// object header layout
+#define _NIFFS_SECT_MAGIC(_fs)  (niffs_magic)(0xfee1c001 ^ (_fs)->page_size ^ (NIFFS_LEN_SLOTS << 1))
 
 #ifndef _NIFFS_ALIGN
 #define _NIFFS_ALIGN __attribute__ (( aligned(NIFFS_WORD_ALIGN) ))
@@ -152,6 +161,22 @@
   _NIFFS_PIX_IN_SECTOR(_fs, _pix) * (_fs)->page_size \
   )
 
+#define _NIFFS_FREE_MAP_WORDS(_fs) \
+  (((_fs)->pages_per_sector * (_fs)->sectors + 31) / 32)
+
+// number of object ids handed out, id n is represented by bit n-1 in maps
+#define _NIFFS_ID_MAP_IDS(_fs) \
+  ((_fs)->pages_per_sector * (_fs)->sectors - 3)
+#define _NIFFS_ID_MAP_WORDS(_fs) \
+  ((_NIFFS_ID_MAP_IDS(_fs) + 31) / 32)
+
+// file descriptors may hold data or length not yet committed to flash
+#define _NIFFS_FD_SYNC          (NIFFS_WRITE_CACHE || NIFFS_DEFER_LEN)
+
+// write-back cache of given file descriptor
+#define _NIFFS_WCACHE(_fs, _fd_ix) \
+  (&(_fs)->wcache[(_fd_ix) * (_fs)->wcache_len])
+
 #define _NIFFS_SPIX_2_PDATA_LEN(_fs, _spix) \
   ((_fs)->page_size - sizeof(niffs_page_hdr) - ((_spix) == 0 ? sizeof(niffs_object_hdr) : 0))
 
@@ -175,6 +200,35 @@
 #define NIFFS_EXCL_SECT_NONE  (u32_t)-1
 #define NIFFS_UNDEF_LEN       (u32_t)-1
 
+// length slot announcing a length update, data beyond committed length is not yet valid
+#define _NIFFS_LEN_SLOT_PENDING   (0xc0000000)
+// length slot of an update that was never committed, zeroed as other bits may be programmed
+#define _NIFFS_LEN_SLOT_ABORTED   (0)
+// checks if programmed length slot holds a committed file length
+#define _NIFFS_LEN_SLOT_IS_LEN(_v) ((_v) != _NIFFS_LEN_SLOT_ABORTED && ((_v) & _NIFFS_LEN_SLOT_PENDING) == 0)
+
+// file length of object header, UNDEF if never written, 0 if removed
+#if NIFFS_LEN_SLOTS
+#define _NIFFS_OHDR_LEN(_ohdr)    niffs_ohdr_len(_ohdr)
+#else
+#define _NIFFS_OHDR_LEN(_ohdr)    ((_ohdr)->len)
+#endif
+// file length of object header, 0 if never written
+#define _NIFFS_OHDR_FILE_LEN(_ohdr) \
+  (_NIFFS_OHDR_LEN(_ohdr) == NIFFS_UNDEF_LEN ? 0 : _NIFFS_OHDR_LEN(_ohdr))
+
+// sets file length of an object header about to be written, with removal
+// marker and all length slots erased
+#if NIFFS_LEN_SLOTS
+#define _NIFFS_OHDR_SET_LEN(_ohdr, _len) do { \
+  (_ohdr)->len = (_len); \
+  (_ohdr)->removed = NIFFS_UNDEF_LEN; \
+  niffs_memset((_ohdr)->len_slots, 0xff, sizeof((_ohdr)->len_slots)); \
+} while (0)
+#else
+#define _NIFFS_OHDR_SET_LEN(_ohdr, _len) do { (_ohdr)->len = (_len); } while (0)
+#endif
+
 #ifndef niffs_memcpy
 #define niffs_memcpy(_d, _s, _l) memcpy((_d), (_s), (_l))
 #endif
@@ -184,6 +238,10 @@
 #ifndef niffs_strncpy
 #define niffs_strncpy(_d, _s, _l) strncpy((_d), (_s), (_l))
 #endif
+#ifndef niffs_ctz
+// count trailing zeroes of a non-zero u32_t
+#define niffs_ctz(_x) __builtin_ctz(_x)
+#endif
 
 typedef struct {
   _NIFFS_ALIGN niffs_erase_cnt era_cnt;
@@ -210,6 +268,10 @@ typedef struct {
 typedef struct {
   niffs_page_hdr phdr;
   _NIFFS_ALIGN u32_t len;
+#if NIFFS_LEN_SLOTS
+  _NIFFS_ALIGN u32_t removed; // erased while file exists, zeroed before len when removing
+  _NIFFS_ALIGN u32_t len_slots[NIFFS_LEN_SLOTS]; // programmed in order, see _NIFFS_LEN_SLOT_IS_LEN
+#endif
   _NIFFS_ALIGN u8_t name[NIFFS_NAME_LEN];
   _NIFFS_ALIGN niffs_file_type type;
 }  _NIFFS_PACKED niffs_object_hdr;
@@ -220,6 +282,23 @@ typedef struct {
   _NIFFS_ALIGN u32_t resv_sectors;
 } _NIFFS_PACKED niffs_linear_file_hdr;
 
+// checkpoint header page, followed by data page indices
+typedef struct {
+  niffs_object_hdr ohdr;
+  _NIFFS_ALIGN u32_t gen;
+  _NIFFS_ALIGN u32_t free_pages;
+  _NIFFS_ALIGN u32_t dele_pages;
+  _NIFFS_ALIGN niffs_erase_cnt max_era;
+  _NIFFS_ALIGN niffs_page_ix last_free_pix;
+  _NIFFS_ALIGN u32_t data_pages;
+} _NIFFS_PACKED niffs_ckpt_hdr;
+
+// checkpoint data page, followed by checkpoint data
+typedef struct {
+  niffs_page_hdr phdr;
+  _NIFFS_ALIGN u32_t gen;
+} _NIFFS_PACKED niffs_ckpt_data_hdr;
+
 // super header containing all header types
 typedef union {
   niffs_page_hdr_id phdr;
@@ -250,13 +329,39 @@ int niffs_create(niffs *fs, const char *name, niffs_file_type type, void *meta);
 int niffs_open(niffs *fs, const char *name, niffs_fd_flags flags);
 int niffs_close(niffs *fs, int fd_ix);
 int niffs_read_ptr(niffs *fs, int fd_ix, u8_t **data, u32_t *avail);
+int niffs_read_segments(niffs *fs, int fd_ix, u32_t offs, u32_t len, niffs_iovec *segs, u32_t max_segs);
 int niffs_seek(niffs *fs, int fd_ix, s32_t offset, u8_t whence);
+void niffs_fd_restore_pos(niffs *fs, niffs_file_desc *fd, u32_t offs, niffs_page_ix pix);
 int niffs_append(niffs *fs, int fd_ix, const u8_t *src, u32_t len);
+int niffs_appendv(niffs *fs, int fd_ix, const niffs_iovec *iov, u32_t offs, u32_t len);
 int niffs_modify(niffs *fs, int fd_ix, u32_t offs, const u8_t *src, u32_t len);
 int niffs_truncate(niffs *fs, int fd_ix, u32_t new_len);
+u32_t niffs_fd_len(niffs *fs, niffs_file_desc *fd);
+u32_t niffs_obj_len(niffs *fs, niffs_object_hdr *ohdr);
+#if NIFFS_LEN_SLOTS
+u32_t niffs_ohdr_len(const niffs_object_hdr *ohdr);
+#endif
+#if _NIFFS_FD_SYNC
+int niffs_fd_sync(niffs *fs, int fd_ix);
+#endif
+#if NIFFS_WRITE_CACHE
+int niffs_wcache_appendv(niffs *fs, int fd_ix, const niffs_iovec *iov, u32_t offs, u32_t len);
+int niffs_wcache_flush(niffs *fs, int fd_ix);
+#endif
+#if NIFFS_FALLOCATE
+int niffs_fallocate(niffs *fs, int fd_ix, u32_t len);
+#endif
 int niffs_rename(niffs *fs, const char *old_name, const char *new_name);
 
 int niffs_gc(niffs *fs, u32_t *freed_pages, u8_t allow_full_pages);
+#if NIFFS_GC_STEP
+int niffs_gc_step(niffs *fs, u32_t max_moves, u8_t allow_erase);
+int niffs_gc_pending(niffs *fs);
+void niffs_gc_abandon(niffs *fs);
+#endif
+#if NIFFS_WEAR_INFO
+int niffs_get_wear_info(niffs *fs, niffs_wear_info *w, niffs_sector_wear *sectors, u32_t sectors_len);
+#endif
 
 int niffs_chk(niffs *fs);
 
@@ -0,0 +1,356 @@
+/*
+ * niffs_bench.c
+ *
+ * Runs fixed workloads on the emulated flash and reports flash operation
+ * counters and wall time per workload, as a table and as csv.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "niffs_test_emul.h"
+
+#define BENCH_FILES       8
+
+typedef struct {
+  const char *name;
+  // prepares the file system, not measured
+  int (*prepare)(void);
+  // the measured workload, returns number of operations or error
+  int (*run)(void);
+  // set if workload garbage collects
+  u8_t gc;
+} bench;
+
+typedef struct {
+  const char *name;
+  int ops;
+  niffs_emul_stats stats;
+  u32_t time_us;
+  // difference between most and least erased sector after workload
+  u32_t era_spread;
+} bench_result;
+
+#if NIFFS_GC_POLICY
+typedef struct {
+  const char *name;
+  niffs_gc_policy_f policy;
+} bench_policy;
+
+static const bench_policy policies[] = {
+    {"score", 0},
+    {"greedy", NIFFS_gc_policy_greedy},
+    {"costben", NIFFS_gc_policy_cost_benefit},
+    {"wear", NIFFS_gc_policy_wear},
+};
+
+#define POLICIES (sizeof(policies) / sizeof(policies[0]))
+
+// policy used by run_bench
+static niffs_gc_policy_f bench_gc_policy = 0;
+#endif
+
+static u8_t data[8192];
+
+static u32_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static int write_file(const char *name, u32_t len) {
+  int fd = NIFFS_open(&fs, name, NIFFS_O_CREAT | NIFFS_O_TRUNC | NIFFS_O_RDWR, 0);
+  if (fd < 0) return fd;
+  int res = NIFFS_write(&fs, fd, data, len);
+  if (res < 0) {
+    (void)NIFFS_close(&fs, fd);
+    return res;
+  }
+  return NIFFS_close(&fs, fd);
+}
+
+static int prepare_empty(void) {
+  int res = NIFFS_format(&fs);
+  if (res != NIFFS_OK) return res;
+  return NIFFS_mount(&fs);
+}
+
+static int prepare_files(void) {
+  int res = prepare_empty();
+  if (res != NIFFS_OK) return res;
+  int i;
+  for (i = 0; i < BENCH_FILES; i++) {
+    char name[NIFFS_NAME_LEN];
+    sprintf(name, "file%i", i);
+    res = write_file(name, 100 + i * 150);
+    if (res != NIFFS_OK) return res;
+  }
+  return NIFFS_OK;
+}
+
+// fills most of the file system with files that are never changed,
+// interleaved with files that are rewritten
+static int prepare_mixed(void) {
+  int res = prepare_empty();
+  if (res != NIFFS_OK) return res;
+  int i;
+  for (i = 0; i < 4 * BENCH_FILES; i++) {
+    char name[NIFFS_NAME_LEN];
+    sprintf(name, i & 1 ? "hot%i" : "cold%i", i / 2);
+    res = write_file(name, 100 + (i % 3) * 100);
+    if (res != NIFFS_OK) return res;
+  }
+  return NIFFS_OK;
+}
+
+// rewrites the hot files in random order
+static int run_mixed(void) {
+  int i;
+  int res;
+  for (i = 0; i < 400; i++) {
+    char name[NIFFS_NAME_LEN];
+    sprintf(name, "hot%i", rand() % (2 * BENCH_FILES));
+    res = write_file(name, 1 + rand() % 300);
+    if (res != NIFFS_OK) return res;
+  }
+  return i;
+}
+
+// creates and removes small files of random size in a few slots
+static int run_churn(void) {
+  u8_t exists[BENCH_FILES] = {0};
+  int i;
+  int res;
+  for (i = 0; i < 400; i++) {
+    int slot = rand() % BENCH_FILES;
+    char name[NIFFS_NAME_LEN];
+    sprintf(name, "churn%i", slot);
+    if (exists[slot]) {
+      res = NIFFS_remove(&fs, name);
+      exists[slot] = 0;
+    } else {
+      res = write_file(name, 1 + rand() % 200);
+      exists[slot] = 1;
+    }
+    if (res != NIFFS_OK) return res;
+  }
+  return i;
+}
+
+// appends small chunks to one large file, then removes it
+static int run_append(void) {
+  int ops = 0;
+  int round;
+  int res;
+  for (round = 0; round < 4; round++) {
+    int fd = NIFFS_open(&fs, "append", NIFFS_O_CREAT | NIFFS_O_APPEND | NIFFS_O_RDWR, 0);
+    if (fd < 0) return fd;
+    u32_t len;
+    for (len = 0; len < 6000; len += 32) {
+      res = NIFFS_write(&fs, fd, &data[len], 32);
+      if (res < 0) return res;
+      ops++;
+    }
+    res = NIFFS_close(&fs, fd);
+    if (res != NIFFS_OK) return res;
+    res = NIFFS_remove(&fs, "append");
+    if (res != NIFFS_OK) return res;
+  }
+  return ops;
+}
+
+static int prepare_modify(void) {
+  int res = prepare_empty();
+  if (res != NIFFS_OK) return res;
+  return write_file("modify", 4000);
+}
+
+// overwrites random ranges within an existing file
+static int run_modify(void) {
+  int fd = NIFFS_open(&fs, "modify", NIFFS_O_RDWR, 0);
+  if (fd < 0) return fd;
+  int i;
+  int res;
+  for (i = 0; i < 200; i++) {
+    u32_t len = 1 + rand() % 64;
+    u32_t offs = rand() % (4000 - len);
+    res = NIFFS_lseek(&fs, fd, offs, NIFFS_SEEK_SET);
+    if (res < 0) return res;
+    res = NIFFS_write(&fs, fd, &data[offs + 1], len);
+    if (res < 0) return res;
+  }
+  res = NIFFS_close(&fs, fd);
+  if (res != NIFFS_OK) return res;
+  return i;
+}
+
+// opens, fstats, closes and stats existing files
+static int run_stat(void) {
+  int i;
+  int res;
+  for (i = 0; i < 1000; i++) {
+    char name[NIFFS_NAME_LEN];
+    niffs_stat s;
+    sprintf(name, "file%i", i % BENCH_FILES);
+    int fd = NIFFS_open(&fs, name, NIFFS_O_RDONLY, 0);
+    if (fd < 0) return fd;
+    res = NIFFS_fstat(&fs, fd, &s);
+    if (res != NIFFS_OK) return res;
+    res = NIFFS_close(&fs, fd);
+    if (res != NIFFS_OK) return res;
+    res = NIFFS_stat(&fs, name, &s);
+    if (res != NIFFS_OK) return res;
+  }
+  return i;
+}
+
+// unmounts and mounts
+static int run_mount(void) {
+  int i;
+  int res;
+  for (i = 0; i < 100; i++) {
+    res = NIFFS_unmount(&fs);
+    if (res != NIFFS_OK) return res;
+    res = NIFFS_mount(&fs);
+    if (res != NIFFS_OK) return res;
+  }
+  return i;
+}
+
+// unmounts, checks and mounts
+static int run_check(void) {
+  int i;
+  int res;
+  for (i = 0; i < 50; i++) {
+    res = NIFFS_unmount(&fs);
+    if (res != NIFFS_OK) return res;
+    res = NIFFS_chk(&fs);
+    if (res != NIFFS_OK) return res;
+    res = NIFFS_mount(&fs);
+    if (res != NIFFS_OK) return res;
+  }
+  return i;
+}
+
+static const bench benches[] = {
+    {"churn", prepare_empty, run_churn, 1},
+    {"mixed", prepare_mixed, run_mixed, 1},
+    {"append", prepare_empty, run_append, 1},
+    {"modify", prepare_modify, run_modify, 1},
+    {"stat", prepare_files, run_stat, 0},
+    {"mount", prepare_files, run_mount, 0},
+    {"check", prepare_files, run_check, 0},
+};
+
+#define BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static u32_t era_spread(void) {
+  niffs_erase_cnt min_era = (niffs_erase_cnt)-1;
+  niffs_erase_cnt max_era = 0;
+  u32_t s;
+  for (s = 0; s < fs.sectors; s++) {
+    niffs_sector_hdr *shdr = (niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(&fs, s);
+    min_era = NIFFS_MIN(min_era, shdr->era_cnt);
+    max_era = NIFFS_MAX(max_era, shdr->era_cnt);
+  }
+  return max_era - min_era;
+}
+
+static int run_bench(const bench *b, bench_result *r) {
+  int res = niffs_emul_init();
+  if (res != NIFFS_OK) return res;
+#if NIFFS_GC_POLICY
+  res = NIFFS_set_gc_policy(&fs, bench_gc_policy);
+  if (res != NIFFS_OK) return res;
+#endif
+  srand(0x20150203);
+  res = b->prepare();
+  if (res != NIFFS_OK) return res;
+  niffs_emul_reset_stats();
+  u32_t t0 = now_us();
+  res = b->run();
+  r->time_us = now_us() - t0;
+  niffs_emul_get_stats(&r->stats);
+  if (res < 0) return res;
+  r->name = b->name;
+  r->ops = res;
+  r->era_spread = era_spread();
+  return NIFFS_unmount(&fs);
+}
+
+int main(int argc, char **args) {
+  int csv_only = argc > 1 && strcmp(args[1], "-c") == 0;
+  bench_result results[BENCHES];
+  u32_t i;
+
+  memrand(data, sizeof(data), 0x20150203);
+
+  for (i = 0; i < BENCHES; i++) {
+    int res = run_bench(&benches[i], &results[i]);
+    if (res != NIFFS_OK) {
+      printf("bench %s failed: %i\n", benches[i].name, res);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (!csv_only) {
+    printf("%-8s %8s %10s %10s %10s %10s %10s %10s\n",
+        "workload", "ops", "wr_calls", "wr_bytes", "er_calls", "gc_moves", "traversed", "time_us");
+    for (i = 0; i < BENCHES; i++) {
+      bench_result *r = &results[i];
+      printf("%-8s %8i %10i %10i %10i %10i %10i %10i\n",
+          r->name, r->ops, r->stats.wr_calls, r->stats.wr_bytes, r->stats.er_calls,
+          r->stats.gc_moves, r->stats.traversed, r->time_us);
+    }
+    printf("\n");
+  }
+  printf("workload,ops,wr_calls,wr_bytes,er_calls,gc_moves,traversed,time_us\n");
+  for (i = 0; i < BENCHES; i++) {
+    bench_result *r = &results[i];
+    printf("%s,%i,%i,%i,%i,%i,%i,%i\n",
+        r->name, r->ops, r->stats.wr_calls, r->stats.wr_bytes, r->stats.er_calls,
+        r->stats.gc_moves, r->stats.traversed, r->time_us);
+  }
+
+#if NIFFS_GC_POLICY
+  // garbage collecting workloads per policy
+  bench_result policy_results[POLICIES][BENCHES];
+  u32_t p;
+  for (p = 0; p < POLICIES; p++) {
+    bench_gc_policy = policies[p].policy;
+    for (i = 0; i < BENCHES; i++) {
+      if (!benches[i].gc) continue;
+      int res = run_bench(&benches[i], &policy_results[p][i]);
+      if (res != NIFFS_OK) {
+        printf("bench %s policy %s failed: %i\n", benches[i].name, policies[p].name, res);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (!csv_only) {
+    printf("\n%-8s %-8s %10s %10s %10s\n",
+        "policy", "workload", "er_calls", "gc_moves", "era_spread");
+    for (p = 0; p < POLICIES; p++) {
+      for (i = 0; i < BENCHES; i++) {
+        if (!benches[i].gc) continue;
+        bench_result *r = &policy_results[p][i];
+        printf("%-8s %-8s %10i %10i %10i\n",
+            policies[p].name, r->name, r->stats.er_calls, r->stats.gc_moves, r->era_spread);
+      }
+    }
+    printf("\n");
+  }
+  printf("policy,workload,er_calls,gc_moves,era_spread\n");
+  for (p = 0; p < POLICIES; p++) {
+    for (i = 0; i < BENCHES; i++) {
+      if (!benches[i].gc) continue;
+      bench_result *r = &policy_results[p][i];
+      printf("%s,%s,%i,%i,%i\n",
+          policies[p].name, r->name, r->stats.er_calls, r->stats.gc_moves, r->era_spread);
+    }
+  }
+#endif
+  exit(EXIT_SUCCESS);
+}
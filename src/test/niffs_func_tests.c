@@ -385,8 +385,14 @@ TEST(func_append_read) {
   TEST_CHECK_EQ(res,  NIFFS_OK);
   TEST_CHECK_EQ(niffs_close(&fs, fd), NIFFS_OK);
   TEST_CHECK_EQ(ix, len+len2+len3);
+#if NIFFS_LEN_SLOTS
+  // length committed in object header slot, header not moved
+  TEST_CHECK_EQ(free_pages_clean - fs.free_pages, 1+1+2);
+  TEST_CHECK_EQ(fs.dele_pages, 1);
+#else
   TEST_CHECK_EQ(free_pages_clean - fs.free_pages, 1+1+3);
   TEST_CHECK_EQ(fs.dele_pages, 2);
+#endif
 
   // append just a little more data
   fd = niffs_open(&fs, "test", NIFFS_O_RDWR);
@@ -450,8 +456,13 @@ TEST(func_append_read) {
   TEST_CHECK_EQ(res,  NIFFS_OK);
   TEST_CHECK_EQ(niffs_close(&fs, fd), NIFFS_OK);
   TEST_CHECK_EQ(ix, len+len2+len3+len4);
+#if NIFFS_LEN_SLOTS
+  TEST_CHECK_EQ(fs.dele_pages, 2);
+  TEST_CHECK_EQ(free_pages_clean - fs.free_pages, 1+1+2+1);
+#else
   TEST_CHECK_EQ(fs.dele_pages, 4);
   TEST_CHECK_EQ(free_pages_clean - fs.free_pages, 1+1+3+2);
+#endif
 
   return TEST_RES_OK;
 } TEST_END
@@ -600,6 +611,7 @@ TEST(func_modify_pagespan) {
 
   res = niffs_modify(&fs, fd, b_ix, dm, e_ix - b_ix);
   TEST_CHECK_EQ(res,  0);
+  TEST_CHECK_EQ(NIFFS_lseek(&fs, fd, 0, NIFFS_SEEK_CUR), (int)e_ix);
 
   u8_t *rptr;
   u32_t rlen;
@@ -1085,6 +1097,46 @@ TEST(func_gc_full) {
   return TEST_RES_OK;
 } TEST_END
 
+TEST(func_gc_no_room) {
+  int res = NIFFS_format(&fs);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+
+  niffs_page_hdr phdr;
+  phdr.flag = _NIFFS_FLAG_WRITTEN;
+  phdr.id.spix = 0;
+
+  // first sector: one deleted page, three busy, rest free
+  // last sector: one free page, rest busy
+  // all others: busy
+  niffs_page_ix pix;
+  for (pix = 0; pix < fs.sectors * fs.pages_per_sector - 1; pix++) {
+    if (pix >= 4 && pix < fs.pages_per_sector) continue;
+    niffs_obj_id id;
+    res = niffs_find_free_id(&fs, &id, 0);
+    TEST_CHECK_EQ(res, NIFFS_OK);
+    phdr.id.obj_id = id;
+    res = niffs_write_phdr(&fs, pix, &phdr);
+    TEST_CHECK_EQ(res, NIFFS_OK);
+  }
+  res = niffs_delete_page(&fs, 0);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+
+  res = NIFFS_unmount(&fs);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+  res = NIFFS_mount(&fs);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+  TEST_CHECK_EQ(fs.free_pages, fs.pages_per_sector - 4 + 1);
+
+  // the three busy pages fit in all free pages, but not in those outside
+  // the first sector, which must not be collected
+  u32_t freed;
+  res = niffs_gc(&fs, &freed, 0);
+  TEST_CHECK_EQ(res, ERR_NIFFS_NO_GC_CANDIDATE);
+  TEST_CHECK_EQ(fs.free_pages, fs.pages_per_sector - 4 + 1);
+
+  return TEST_RES_OK;
+} TEST_END
+
 TEST(func_gc_long_run) {
 #define TEST_CHECK_GC_LONG_RUN_FILES  10
 #define TEST_CHECK_GC_LONG_RUN_RUNS   1000
@@ -1289,7 +1341,14 @@ TEST(func_check_orphans) {
   // delete obj header for orphan file
   TEST_CHECK_EQ(niffs_delete_page(&fs, 0), NIFFS_OK);
 
+  u32_t dele_pre = fs.dele_pages;
   TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+#if NIFFS_CHECKPOINT
+  // checkpoint written on unmount is deleted by check
+  written_pre += fs.dele_pages - dele_pre;
+#else
+  (void)dele_pre;
+#endif
 
   TEST_CHECK_EQ(niffs_chk(&fs), NIFFS_OK);
   TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
@@ -1424,182 +1483,2116 @@ TEST(func_check_aborted_erase) {
   return TEST_RES_OK;
 } TEST_END
 
-#if NIFFS_LINEAR_AREA
+// builds a frame of header, payload, empty entry and crc from given data
+static u32_t func_writev_frame(niffs_iovec *iov, u8_t *data, u32_t offs, u32_t len) {
+  const u32_t sizes[4] = {5, 1 + (offs % 151), 0, 2};
+  u32_t flen = 0;
+  int i;
+  for (i = 0; i < 4; i++) {
+    iov[i].base = &data[offs + flen];
+    iov[i].len = MIN(sizes[i], len - offs - flen);
+    flen += iov[i].len;
+  }
+  return flen;
+}
 
-TEST(func_lin_alloc_virgin) {
-  u32_t start_sect;
-  int res = NIFFS_format(&fs);
+TEST(func_writev_readv) {
+#if NIFFS_WRITE_CACHE
+  TEST_CHECK_EQ(niffs_emul_set_write_cache(), NIFFS_OK);
+#endif
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
   TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  const u32_t len = 3000;
+  u8_t *data = niffs_emul_create_data("vec", len);
+  u8_t *frag_data = niffs_emul_create_data("frag", len);
+  niffs_emul_stats vec_stats, frag_stats;
+  niffs_iovec iov[4];
+  niffs_stat s;
+  u32_t offs;
+  int i;
+  int res;
 
-  res = niffs_linear_find_space(&fs, 1, &start_sect);
-  TEST_CHECK_EQ(res, NIFFS_OK);
-  TEST_CHECK_EQ(start_sect, fs.sectors);
+  // frames written as one vector each or one fragment at a time
+  int fd = NIFFS_open(&fs, "vec", NIFFS_O_CREAT | NIFFS_O_RDWR | NIFFS_O_APPEND | NIFFS_O_DIRECT, 0);
+  TEST_CHECK(fd >= 0);
+  niffs_emul_reset_stats();
+  for (offs = 0; offs < len; ) {
+    u32_t flen = func_writev_frame(iov, data, offs, len);
+    TEST_CHECK_EQ(NIFFS_writev(&fs, fd, iov, 4), flen);
+    offs += flen;
+  }
+  niffs_emul_get_stats(&vec_stats);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
 
-  res = niffs_linear_find_space(&fs, fs.lin_sectors, &start_sect);
+  fd = NIFFS_open(&fs, "frag", NIFFS_O_CREAT | NIFFS_O_RDWR | NIFFS_O_APPEND | NIFFS_O_DIRECT, 0);
+  TEST_CHECK(fd >= 0);
+  niffs_emul_reset_stats();
+  for (offs = 0; offs < len; ) {
+    u32_t flen = func_writev_frame(iov, frag_data, offs, len);
+    for (i = 0; i < 4; i++) {
+      TEST_CHECK_EQ(NIFFS_write(&fs, fd, iov[i].base, iov[i].len), iov[i].len);
+    }
+    offs += flen;
+  }
+  niffs_emul_get_stats(&frag_stats);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+
+  // frames gathered into write cache, read back before close
+  u8_t *cached_data = niffs_emul_create_data("cached", len);
+  fd = NIFFS_open(&fs, "cached", NIFFS_O_CREAT | NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  for (offs = 0; offs < len; ) {
+    u32_t flen = func_writev_frame(iov, cached_data, offs, len);
+    TEST_CHECK_EQ(NIFFS_writev(&fs, fd, iov, 4), flen);
+    offs += flen;
+  }
+  TEST_CHECK_EQ(NIFFS_fstat(&fs, fd, &s), NIFFS_OK);
+  TEST_CHECK_EQ(s.size, len);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "cached"), NIFFS_OK);
+
+  TEST_CHECK(vec_stats.wr_calls < frag_stats.wr_calls);
+  TEST_CHECK(vec_stats.wr_bytes < frag_stats.wr_bytes);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "vec", &s), NIFFS_OK);
+  TEST_CHECK_EQ(s.size, len);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "vec"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "frag"), NIFFS_OK);
+
+  // scatter read over odd sized buffers
+  u8_t *buf = malloc(len);
+  niffs_memset(buf, 0, len);
+  iov[0].base = buf;
+  iov[0].len = 7;
+  iov[1].base = &buf[7];
+  iov[1].len = 0;
+  iov[2].base = &buf[7];
+  iov[2].len = 301;
+  iov[3].base = &buf[308];
+  iov[3].len = len - 308;
+  fd = NIFFS_open(&fs, "vec", NIFFS_O_RDONLY, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_readv(&fs, fd, iov, 4), len);
+  TEST_CHECK_EQ(memcmp(buf, data, len), 0);
+  TEST_CHECK_EQ(NIFFS_readv(&fs, fd, iov, 4), 0);
+  TEST_CHECK_EQ(NIFFS_lseek(&fs, fd, len - 100, NIFFS_SEEK_SET), len - 100);
+  niffs_memset(buf, 0, len);
+  TEST_CHECK_EQ(NIFFS_readv(&fs, fd, iov, 4), 100);
+  TEST_CHECK_EQ(memcmp(buf, &data[len - 100], 100), 0);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  free(buf);
+
+  // vector both modifying and appending
+  for (offs = len - 200; offs < len - 100; offs++) {
+    data[offs] ^= 0x5a;
+  }
+  fd = NIFFS_open(&fs, "vec", NIFFS_O_RDWR, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_lseek(&fs, fd, len - 200, NIFFS_SEEK_SET), len - 200);
+  u8_t *more = niffs_emul_create_data("more", 100);
+  iov[0].base = &data[len - 200];
+  iov[0].len = 170;
+  iov[1].base = &data[len - 30];
+  iov[1].len = 30;
+  iov[2].base = more;
+  iov[2].len = 100;
+  TEST_CHECK_EQ(NIFFS_writev(&fs, fd, iov, 3), 300);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "vec", &s), NIFFS_OK);
+  TEST_CHECK_EQ(s.size, len + 100);
+  u8_t *ref = malloc(len + 100);
+  memcpy(ref, data, len);
+  memcpy(&ref[len], more, 100);
+  res = niffs_emul_verify_file_against_data(&fs, "vec", ref);
+  free(ref);
   TEST_CHECK_EQ(res, NIFFS_OK);
-  TEST_CHECK_EQ(start_sect, fs.sectors);
 
-  res = niffs_linear_find_space(&fs, fs.lin_sectors+1, &start_sect);
-  TEST_CHECK_EQ(res, ERR_NIFFS_LINEAR_NO_SPACE);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "frag"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "cached"), NIFFS_OK);
 
   return TEST_RES_OK;
 } TEST_END
 
-TEST(func_lin_alloc_mknod) {
-  u32_t start_sect;
-  int res = NIFFS_format(&fs);
-  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
-  int fd;
+static int func_read_segments_check(int fd, u8_t *data, u32_t offs, u32_t len) {
+  niffs_iovec segs[32];
+  int nsegs = NIFFS_read_segments(&fs, fd, offs, len, segs, 32);
+  if (nsegs < 0) return nsegs;
+  int i;
+  for (i = 0; i < nsegs; i++) {
+    if (segs[i].len > len || memcmp(segs[i].base, &data[offs], segs[i].len) != 0) {
+      return ERR_NIFFS_TEST_REF_DATA_MISMATCH;
+    }
+    offs += segs[i].len;
+    len -= segs[i].len;
+  }
+  return len == 0 ? nsegs : ERR_NIFFS_TEST_REF_DATA_MISMATCH;
+}
 
-  fd = NIFFS_mknod_linear(&fs, "1_1", 0);
-  TEST_CHECK_GE(fd, NIFFS_OK);
-  NIFFS_close(&fs, fd);
-  res = niffs_linear_find_space(&fs, 1, &start_sect);
-  TEST_CHECK_EQ(res, NIFFS_OK);
-  TEST_CHECK_EQ(start_sect, fs.sectors+1);
+TEST(func_read_segments) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  const u32_t len = 3000;
+  u8_t *data = niffs_emul_create_data("a", len);
+  u8_t *other = niffs_emul_create_data("b", len);
+  niffs_iovec segs[4];
+  u32_t offs;
+
+  // pages of two files interleaved
+  int fd = NIFFS_open(&fs, "a", NIFFS_O_CREAT | NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  int fd_other = NIFFS_open(&fs, "b", NIFFS_O_CREAT | NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd_other >= 0);
+  for (offs = 0; offs < len; offs += 300) {
+    TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[offs], 300), 300);
+    TEST_CHECK_EQ(NIFFS_write(&fs, fd_other, &other[offs], 300), 300);
+  }
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd_other), NIFFS_OK);
 
-  fd = NIFFS_mknod_linear(&fs, "2_1", 0);
-  TEST_CHECK_GE(fd, NIFFS_OK);
-  NIFFS_close(&fs, fd);
-  res = niffs_linear_find_space(&fs, 1, &start_sect);
-  TEST_CHECK_EQ(res, NIFFS_OK);
-  TEST_CHECK_EQ(start_sect, fs.sectors+1+1);
+  fd = NIFFS_open(&fs, "a", NIFFS_O_RDONLY, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_read_segments(&fs, fd, 0, len, 0, 1), ERR_NIFFS_NULL_PTR);
+
+  // one segment per page
+  TEST_CHECK_EQ(func_read_segments_check(fd, data, 0, len),
+      _NIFFS_OFFS_2_SPIX(&fs, len - 1) + 1);
+  TEST_CHECK_EQ(func_read_segments_check(fd, data, 50, 2000),
+      _NIFFS_OFFS_2_SPIX(&fs, 2049) - _NIFFS_OFFS_2_SPIX(&fs, 50) + 1);
+  TEST_CHECK_EQ(func_read_segments_check(fd, data, len - 1, 1), 1);
+  TEST_CHECK_EQ(NIFFS_ftell(&fs, fd), 0);
+
+  // clamped at end of file
+  TEST_CHECK_EQ(NIFFS_read_segments(&fs, fd, len, 10, segs, 4), 0);
+  u32_t tail = _NIFFS_OFFS_2_PDATA_OFFS(&fs, len - 1) + 1;
+  TEST_CHECK_EQ(NIFFS_read_segments(&fs, fd, len - tail, 100, segs, 4), 1);
+  TEST_CHECK_EQ(segs[0].len, tail);
+  TEST_CHECK_EQ(memcmp(segs[0].base, &data[len - tail], tail), 0);
+
+  // partially covered if too few segments
+  TEST_CHECK_EQ(NIFFS_read_segments(&fs, fd, 0, len, segs, 2), 2);
+  TEST_CHECK_EQ(segs[0].len, _NIFFS_SPIX_2_PDATA_LEN(&fs, 0));
+  TEST_CHECK_EQ(segs[1].len, _NIFFS_SPIX_2_PDATA_LEN(&fs, 1));
+  TEST_CHECK_EQ(memcmp(segs[1].base, &data[segs[0].len], segs[1].len), 0);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+
+  fd = NIFFS_open(&fs, "b", NIFFS_O_WRONLY, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_read_segments(&fs, fd, 0, len, segs, 4), ERR_NIFFS_NOT_READABLE);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  fd = NIFFS_open(&fs, "b", NIFFS_O_RDONLY, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK(func_read_segments_check(fd, other, 0, len) > 0);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
 
-  fd = NIFFS_mknod_linear(&fs, "3_8", fs.sector_size*8-1);
-  TEST_CHECK_GE(fd, NIFFS_OK);
-  NIFFS_close(&fs, fd);
-  res = niffs_linear_find_space(&fs, 1, &start_sect);
-  TEST_CHECK_EQ(res, NIFFS_OK);
-  TEST_CHECK_EQ(start_sect, fs.sectors+1+1+8);
+  return TEST_RES_OK;
+} TEST_END
 
-  fd = NIFFS_mknod_linear(&fs, "4_1", fs.sector_size/2);
-  TEST_CHECK_GE(fd, NIFFS_OK);
-  NIFFS_close(&fs, fd);
-  res = niffs_linear_find_space(&fs, 1, &start_sect);
-  TEST_CHECK_EQ(res, NIFFS_OK);
-  TEST_CHECK_EQ(start_sect, fs.sectors+1+1+8+1);
+TEST(func_pread_pwrite) {
+#if NIFFS_WRITE_CACHE
+  TEST_CHECK_EQ(niffs_emul_set_write_cache(), NIFFS_OK);
+#endif
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  const u32_t len = 2000;
+  u8_t *data = niffs_emul_create_data("a", len + 500);
+  u8_t *ref = malloc(len + 500);
+  u8_t *buf = malloc(len + 500);
+  memcpy(ref, data, len);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "a", len), NIFFS_OK);
+
+  int fd = NIFFS_open(&fs, "a", NIFFS_O_RDWR, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_lseek(&fs, fd, 700, NIFFS_SEEK_SET), 700);
+
+  // scattered reads leave the offset alone
+  TEST_CHECK_EQ(NIFFS_pread(&fs, fd, buf, len, 0), len);
+  TEST_CHECK_EQ(memcmp(buf, ref, len), 0);
+  TEST_CHECK_EQ(NIFFS_pread(&fs, fd, buf, 300, 1500), 300);
+  TEST_CHECK_EQ(memcmp(buf, &ref[1500], 300), 0);
+  TEST_CHECK_EQ(NIFFS_pread(&fs, fd, buf, 10, 5), 10);
+  TEST_CHECK_EQ(memcmp(buf, &ref[5], 10), 0);
+  TEST_CHECK_EQ(NIFFS_pread(&fs, fd, buf, 100, len - 40), 40);
+  TEST_CHECK_EQ(NIFFS_pread(&fs, fd, buf, 100, len), 0);
+  TEST_CHECK_EQ(NIFFS_ftell(&fs, fd), 700);
+
+  // modify in the middle and across the end of file
+  memset(&ref[300], 0x5a, 200);
+  TEST_CHECK_EQ(NIFFS_pwrite(&fs, fd, &ref[300], 200, 300), 200);
+  memset(&ref[len - 100], 0xa5, 400);
+  TEST_CHECK_EQ(NIFFS_pwrite(&fs, fd, &ref[len - 100], 400, len - 100), 400);
+  TEST_CHECK_EQ(NIFFS_pread(&fs, fd, buf, 400, len - 100), 400);
+  TEST_CHECK_EQ(memcmp(buf, &ref[len - 100], 400), 0);
+  TEST_CHECK_EQ(NIFFS_pwrite(&fs, fd, ref, 10, len + 301), ERR_NIFFS_MODIFY_BEYOND_FILE);
+  TEST_CHECK_EQ(NIFFS_ftell(&fs, fd), 700);
+
+  // read on from the kept offset
+  TEST_CHECK_EQ(NIFFS_read(&fs, fd, buf, 500), 500);
+  TEST_CHECK_EQ(memcmp(buf, &ref[700], 500), 0);
+  TEST_CHECK_EQ(NIFFS_pread(&fs, fd, buf, len + 300, 0), len + 300);
+  TEST_CHECK_EQ(memcmp(buf, ref, len + 300), 0);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+
+  // appending descriptors ignore the offset
+  fd = NIFFS_open(&fs, "a", NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  memset(&ref[len + 300], 0x33, 100);
+  TEST_CHECK_EQ(NIFFS_pwrite(&fs, fd, &ref[len + 300], 100, 0), 100);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
 
-  fd = NIFFS_mknod_linear(&fs, "5_lots", fs.lin_sectors);
-  TEST_CHECK_GE(fd, ERR_NIFFS_LINEAR_NO_SPACE);
+  TEST_CHECK_EQ(niffs_emul_verify_file_against_data(&fs, "a", ref), NIFFS_OK);
+  free(ref);
+  free(buf);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
 
   return TEST_RES_OK;
 } TEST_END
 
-TEST(func_lin_write) {
+#if NIFFS_SPAN_INDEX
+TEST(func_span_index) {
   int res = NIFFS_format(&fs);
   TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
-  int fd;
+  TEST_CHECK_EQ(NIFFS_set_span_index(&fs, 0, 0), ERR_NIFFS_MOUNTED);
+
+  u32_t len = _NIFFS_SPIX_2_PDATA_LEN(&fs, 0) + _NIFFS_SPIX_2_PDATA_LEN(&fs, 1) * 4 + 10;
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "a", len), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "b", len/2), NIFFS_OK);
+  TEST_CHECK_EQ(fs.span_index_cnt, fs.sectors * fs.pages_per_sector - fs.free_pages - fs.dele_pages);
+  TEST_CHECK_EQ(fs.span_index_ovf, 0);
+
+  // compare index lookups with scanning
+  niffs_stat s;
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "a", &s), NIFFS_OK);
+  niffs_span_ix spix;
+  for (spix = 0; spix <= _NIFFS_OFFS_2_SPIX(&fs, len); spix++) {
+    niffs_page_ix pix_ix, pix_scan;
+    TEST_CHECK_EQ(niffs_find_page(&fs, &pix_ix, s.obj_id, spix, 0), NIFFS_OK);
+    fs.span_index_ovf = 1;
+    TEST_CHECK_EQ(niffs_find_page(&fs, &pix_scan, s.obj_id, spix, 0), NIFFS_OK);
+    fs.span_index_ovf = 0;
+    TEST_CHECK_EQ(pix_ix, pix_scan);
+  }
+  niffs_page_ix pix;
+  TEST_CHECK_EQ(niffs_find_page(&fs, &pix, s.obj_id, spix, 0), ERR_NIFFS_PAGE_NOT_FOUND);
 
-  const u32_t len = fs.sector_size*5;
-  u8_t *data = niffs_emul_create_data("linear", len);
-  TEST_CHECK(data);
+  // rebuilt on mount
+  u32_t cnt = fs.span_index_cnt;
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(fs.span_index_cnt, cnt);
 
-  fd = NIFFS_mknod_linear(&fs, "linear", 0);
-  TEST_CHECK_GE(fd, NIFFS_OK);
-  res = NIFFS_write(&fs, fd, data, len/2);
-  TEST_CHECK_EQ(res, len/2);
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "a"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "b"), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "b"), NIFFS_OK);
+  TEST_CHECK_EQ(fs.span_index_cnt, 0);
 
-  res = NIFFS_write(&fs, fd, &data[len/2], len/2);
-  TEST_CHECK_EQ(res, len/2);
+  // too small index, falls back to scanning
+  niffs_span_index_entry small_index[4];
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_span_index(&fs, small_index, sizeof(small_index)), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "c", len), NIFFS_OK);
+  TEST_CHECK_EQ(fs.span_index_ovf, 1);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "c"), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_span_index(&fs, 0, 0), NIFFS_OK);
 
-  res = NIFFS_close(&fs, fd);
-  TEST_CHECK_EQ(res, NIFFS_OK);
+  return TEST_RES_OK;
+} TEST_END
+#endif
 
-  res = niffs_emul_verify_file(&fs, "linear");
-  TEST_CHECK_EQ(res, NIFFS_OK);
+#if NIFFS_NAME_INDEX
+TEST(func_name_index) {
+  int res = NIFFS_format(&fs);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_name_index(&fs, 0, 0), ERR_NIFFS_MOUNTED);
+
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "first", 100), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "second", 1000), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "third", 10), NIFFS_OK);
+  TEST_CHECK_EQ(fs.name_index_cnt, 3);
+  TEST_CHECK_EQ(fs.name_index_ovf, 0);
+
+  niffs_stat s;
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "second", &s), NIFFS_OK);
+  TEST_CHECK_EQ(s.size, 1000);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "fourth", &s), ERR_NIFFS_FILE_NOT_FOUND);
+  TEST_CHECK_EQ(NIFFS_creat(&fs, "third", 0), ERR_NIFFS_NAME_CONFLICT);
+
+  TEST_CHECK_EQ(NIFFS_rename(&fs, "second", "fourth"), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_rename(&fs, "first", "third"), ERR_NIFFS_NAME_CONFLICT);
+  TEST_CHECK_EQ(fs.name_index_cnt, 3);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "second", &s), ERR_NIFFS_FILE_NOT_FOUND);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "fourth", &s), NIFFS_OK);
+  TEST_CHECK_EQ(s.size, 1000);
+
+  // rebuilt on mount
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(fs.name_index_cnt, 3);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "fourth", &s), NIFFS_OK);
+
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "first"), NIFFS_OK);
+  TEST_CHECK_EQ(fs.name_index_cnt, 2);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "first", &s), ERR_NIFFS_FILE_NOT_FOUND);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "third"), NIFFS_OK);
+
+  // too small index, falls back to scanning
+  niffs_name_index_entry small_index[1];
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_name_index(&fs, small_index, sizeof(small_index)), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(fs.name_index_ovf, 1);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "fourth", &s), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "third"), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_creat(&fs, "third", 0), ERR_NIFFS_NAME_CONFLICT);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_name_index(&fs, 0, 0), NIFFS_OK);
 
   return TEST_RES_OK;
 } TEST_END
+#endif
 
-TEST(func_lin_overwrite) {
+#if NIFFS_FREE_MAP
+static int free_map_matches_flash(niffs *fs) {
+  niffs_page_ix pix;
+  for (pix = 0; pix < fs->sectors * fs->pages_per_sector; pix++) {
+    niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+    u8_t free = _NIFFS_IS_FREE(phdr) && _NIFFS_IS_CLEA(phdr);
+    u8_t mapped = (fs->free_map[pix/32] & (1<<(pix&31))) != 0;
+    if (free != mapped) {
+      printf("pix %04x free:%i mapped:%i\n", pix, free, mapped);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+TEST(func_free_map) {
   int res = NIFFS_format(&fs);
   TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
-  int fd;
+  TEST_CHECK_EQ(NIFFS_set_free_map(&fs, 0, 0), ERR_NIFFS_MOUNTED);
+  TEST_CHECK(free_map_matches_flash(&fs));
 
-  const u32_t len = fs.sector_size*5;
-  u8_t *data = niffs_emul_create_data("linear", len);
-  TEST_CHECK(data);
+  u32_t len = _NIFFS_SPIX_2_PDATA_LEN(&fs, 0) + _NIFFS_SPIX_2_PDATA_LEN(&fs, 1) * 4 + 10;
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "a", len), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "b", len/2), NIFFS_OK);
+  TEST_CHECK(free_map_matches_flash(&fs));
 
-  fd = NIFFS_mknod_linear(&fs, "linear", 0);
-  TEST_CHECK_GE(fd, NIFFS_OK);
-  res = NIFFS_write(&fs, fd, data, len);
-  TEST_CHECK_EQ(res, len);
-  res = NIFFS_close(&fs, fd);
-  TEST_CHECK_EQ(res, NIFFS_OK);
+  // compare map lookups with scanning
+  u32_t s;
+  for (s = 0; s < fs.sectors; s++) {
+    niffs_page_ix pix_map, pix_scan;
+    u32_t *map = fs.free_map;
+    TEST_CHECK_EQ(niffs_find_free_page(&fs, &pix_map, s), NIFFS_OK);
+    fs.free_map = 0;
+    TEST_CHECK_EQ(niffs_find_free_page(&fs, &pix_scan, s), NIFFS_OK);
+    fs.free_map = map;
+    TEST_CHECK_EQ(pix_map, pix_scan);
+    TEST_CHECK(s != _NIFFS_PIX_2_SECTOR(&fs, pix_map));
+  }
 
-  fd = NIFFS_open(&fs, "linear", NIFFS_O_RDONLY, 0);
-  TEST_CHECK_GE(fd, NIFFS_OK);
-  niffs_file_desc *desc;
-  res = niffs_get_filedesc(&fs, fd, &desc);
-  TEST_CHECK_EQ(res, NIFFS_OK);
-  u32_t start_sec1 = ((niffs_linear_file_hdr *)_NIFFS_PIX_2_ADDR(&fs, desc->obj_pix))->start_sector;
+  // kept through gc
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "a"), NIFFS_OK);
+  u32_t freed;
+  TEST_CHECK_EQ(niffs_gc(&fs, &freed, 0), NIFFS_OK);
+  TEST_CHECK(free_map_matches_flash(&fs));
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "b"), NIFFS_OK);
 
-  res = NIFFS_remove(&fs, "linear");
-  TEST_CHECK_EQ(res, NIFFS_OK);
+  // stale bits are cleared when found
+  niffs_page_ix pix;
+  TEST_CHECK_EQ(niffs_find_free_page(&fs, &pix, NIFFS_EXCL_SECT_NONE), NIFFS_OK);
+  niffs_page_id_raw dele_id = _NIFFS_PAGE_DELE_ID;
+  TEST_CHECK_EQ(fs.hal_wr((u8_t *)_NIFFS_PIX_2_ADDR(&fs, pix) + offsetof(niffs_page_hdr, id), (u8_t *)&dele_id, sizeof(dele_id)), NIFFS_OK);
+  niffs_page_ix next_pix;
+  TEST_CHECK_EQ(niffs_find_free_page(&fs, &next_pix, NIFFS_EXCL_SECT_NONE), NIFFS_OK);
+  TEST_CHECK(next_pix != pix);
+  TEST_CHECK(free_map_matches_flash(&fs));
+
+  // rebuilt on mount
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK(free_map_matches_flash(&fs));
 
-  data = niffs_emul_create_data("linear2", len);
-  TEST_CHECK(data);
-  fd = NIFFS_mknod_linear(&fs, "linear2", 0);
-  TEST_CHECK_GE(fd, NIFFS_OK);
-  res = NIFFS_write(&fs, fd, data, len);
-  TEST_CHECK_EQ(res, len);
-  res = NIFFS_close(&fs, fd);
-  TEST_CHECK_EQ(res, NIFFS_OK);
+  u32_t small_map[1];
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_free_map(&fs, small_map, sizeof(small_map)), ERR_NIFFS_BAD_CONF);
 
-  fd = NIFFS_open(&fs, "linear2", NIFFS_O_RDONLY, 0);
-  TEST_CHECK_GE(fd, NIFFS_OK);
-  res = niffs_get_filedesc(&fs, fd, &desc);
-  TEST_CHECK_EQ(res, NIFFS_OK);
-  u32_t start_sec2 = ((niffs_linear_file_hdr *)_NIFFS_PIX_2_ADDR(&fs, desc->obj_pix))->start_sector;
+  return TEST_RES_OK;
+} TEST_END
+#endif
 
-  TEST_CHECK_EQ(start_sec1, start_sec2);
+#if NIFFS_ID_MAP
+static int id_map_matches_flash(niffs *fs) {
+  niffs_obj_id oid;
+  for (oid = 1; oid <= _NIFFS_ID_MAP_IDS(fs); oid++) {
+    u8_t used = 0;
+    niffs_page_ix pix;
+    for (pix = 0; pix < fs->sectors * fs->pages_per_sector; pix++) {
+      niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+      if (!_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr) && phdr->id.obj_id == oid) {
+        used = 1;
+        break;
+      }
+    }
+    u8_t mapped = (fs->id_map[(oid-1)/32] & (1<<((oid-1)&31))) != 0;
+    if (used != mapped) {
+      printf("oid %04x used:%i mapped:%i\n", oid, used, mapped);
+      return 0;
+    }
+  }
+  return 1;
+}
 
-  res = niffs_emul_verify_file(&fs, "linear2");
-  TEST_CHECK_EQ(res, NIFFS_OK);
+TEST(func_id_map) {
+  int res = NIFFS_format(&fs);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_id_map(&fs, 0, 0), ERR_NIFFS_MOUNTED);
+
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "a", 300), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "b", 10), NIFFS_OK);
+  TEST_CHECK(id_map_matches_flash(&fs));
+  niffs_stat s;
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "a", &s), NIFFS_OK);
+  niffs_obj_id oid_a = s.obj_id;
+  TEST_CHECK_EQ(NIFFS_creat(&fs, "b", 0), ERR_NIFFS_NAME_CONFLICT);
+
+  // removed ids are not immediately reused
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "a"), NIFFS_OK);
+  TEST_CHECK(id_map_matches_flash(&fs));
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "c", 10), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "c", &s), NIFFS_OK);
+  TEST_CHECK(s.obj_id != oid_a);
+
+  // but eventually, when wrapping
+  u32_t i;
+  niffs_obj_id oid;
+  for (i = 0; i < _NIFFS_ID_MAP_IDS(&fs); i++) {
+    TEST_CHECK_EQ(niffs_find_free_id(&fs, &oid, 0), NIFFS_OK);
+    if (oid == oid_a) break;
+  }
+  TEST_CHECK_EQ(oid, oid_a);
+
+  // compare map with scanning
+  niffs_obj_id oid_scan;
+  u32_t *map = fs.id_map;
+  fs.id_map = 0;
+  TEST_CHECK_EQ(niffs_find_free_id(&fs, &oid_scan, 0), NIFFS_OK);
+  fs.id_map = map;
+  fs.id_cursor = 0;
+  TEST_CHECK_EQ(niffs_find_free_id(&fs, &oid, 0), NIFFS_OK);
+  TEST_CHECK_EQ(oid, oid_scan);
+
+  // rebuilt on mount
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK(id_map_matches_flash(&fs));
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "b"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "c"), NIFFS_OK);
 
-  res = niffs_emul_verify_file(&fs, "linear");
-  TEST_CHECK_EQ(res, ERR_NIFFS_FILE_NOT_FOUND);
+  u32_t small_map[1];
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_id_map(&fs, small_map, sizeof(small_map)), ERR_NIFFS_BAD_CONF);
 
   return TEST_RES_OK;
 } TEST_END
+#endif
 
-TEST(func_lin_clamp) {
+#if NIFFS_SECTOR_INFO
+static int sector_info_matches_flash(niffs *fs) {
+  u32_t s;
+  for (s = 0; s < fs->sectors; s++) {
+    niffs_sector_hdr *shdr = (niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(fs, s);
+    u32_t p_free = 0, p_dele = 0, p_busy = 0;
+    niffs_page_ix ipix;
+    for (ipix = 0; ipix < fs->pages_per_sector; ipix++) {
+      niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, _NIFFS_PIX_AT_SECTOR(fs, s) + ipix);
+      if (_NIFFS_IS_FREE(phdr) && _NIFFS_IS_CLEA(phdr)) p_free++;
+      else if (_NIFFS_IS_DELE(phdr) || !_NIFFS_IS_FLAG_VALID(phdr)) p_dele++;
+      else p_busy++;
+    }
+    niffs_sector_info *si = &fs->sector_info[s];
+    if (si->era_cnt != shdr->era_cnt || si->free_pages != p_free ||
+        si->dele_pages != p_dele || si->busy_pages != p_busy) {
+      printf("sector %i era:%i/%i free:%i/%i dele:%i/%i busy:%i/%i\n", s,
+          si->era_cnt, shdr->era_cnt, si->free_pages, p_free,
+          si->dele_pages, p_dele, si->busy_pages, p_busy);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+TEST(func_sector_info) {
   int res = NIFFS_format(&fs);
   TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
-  int fd;
+  TEST_CHECK_EQ(NIFFS_set_sector_info(&fs, 0, 0), ERR_NIFFS_MOUNTED);
+  TEST_CHECK(sector_info_matches_flash(&fs));
 
-  u32_t len = fs.sector_size*2;
+  u32_t len = _NIFFS_SPIX_2_PDATA_LEN(&fs, 0) + _NIFFS_SPIX_2_PDATA_LEN(&fs, 1) * 8;
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "a", len), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "b", len), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "c", 10), NIFFS_OK);
+  TEST_CHECK(sector_info_matches_flash(&fs));
 
-  u8_t *data = niffs_emul_create_data("linear1", len);
-  TEST_CHECK(data);
-  fd = NIFFS_mknod_linear(&fs, "linear1", 0);
-  TEST_CHECK_GE(fd, NIFFS_OK);
-  res = NIFFS_write(&fs, fd, data, len);
-  TEST_CHECK_EQ(res, len);
-  res = NIFFS_close(&fs, fd);
-  TEST_CHECK_EQ(res, NIFFS_OK);
+  // modify, truncate and remove
+  int fd = NIFFS_open(&fs, "c", NIFFS_O_RDWR, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, (u8_t *)"xy", 2), 2);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "a"), NIFFS_OK);
+  TEST_CHECK(sector_info_matches_flash(&fs));
 
-  data = niffs_emul_create_data("linear2", len);
-  TEST_CHECK(data);
-  fd = NIFFS_mknod_linear(&fs, "linear2", 0);
-  TEST_CHECK_GE(fd, NIFFS_OK);
-  res = NIFFS_write(&fs, fd, data, len);
-  TEST_CHECK_EQ(res, len);
-  res = NIFFS_close(&fs, fd);
-  TEST_CHECK_EQ(res, NIFFS_OK);
+  // gc
+  u32_t freed;
+  while (fs.dele_pages > 0) {
+    TEST_CHECK_EQ(niffs_gc(&fs, &freed, 0), NIFFS_OK);
+    TEST_CHECK(sector_info_matches_flash(&fs));
+  }
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "b"), NIFFS_OK);
 
-  res = niffs_emul_verify_file(&fs, "linear1");
-  TEST_CHECK_EQ(res, NIFFS_OK);
+  // rebuilt on mount
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK(sector_info_matches_flash(&fs));
 
-  res = niffs_emul_verify_file(&fs, "linear2");
-  TEST_CHECK_EQ(res, NIFFS_OK);
+  niffs_sector_info small_info[1];
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_sector_info(&fs, small_info, sizeof(small_info)), ERR_NIFFS_BAD_CONF);
 
-  res = NIFFS_remove(&fs, "linear1");
-  TEST_CHECK_EQ(res, NIFFS_OK);
+  return TEST_RES_OK;
+} TEST_END
+#endif
 
-  len = fs.sector_size*2 + 1;
+#if NIFFS_CHECKPOINT
+static u32_t checkpoint_pages(niffs *fs) {
+  u32_t cnt = 0;
+  niffs_page_ix pix;
+  for (pix = 0; pix < fs->sectors * fs->pages_per_sector; pix++) {
+    niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(fs, pix);
+    if (!_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr) && phdr->id.obj_id == _NIFFS_CKPT_OID(fs)) {
+      cnt++;
+    }
+  }
+  return cnt;
+}
 
-  data = niffs_emul_create_data("linear1_2", len);
+TEST(func_checkpoint) {
+  int res = NIFFS_format(&fs);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+
+  u32_t len = _NIFFS_SPIX_2_PDATA_LEN(&fs, 0) + _NIFFS_SPIX_2_PDATA_LEN(&fs, 1) * 5;
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "a", len), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "b", 10), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "c", len), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "b"), NIFFS_OK);
+
+  // clean unmount writes checkpoint, mount restores and deletes it
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_GT(checkpoint_pages(&fs), 0);
+  u32_t gen = fs.ckpt_gen;
+  niffs_emul_stats stats;
+  niffs_emul_reset_stats();
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  niffs_emul_get_stats(&stats);
+  TEST_CHECK_LT(stats.traversed, fs.sectors * fs.pages_per_sector);
+  TEST_CHECK_EQ(fs.ckpt_gen, gen);
+  TEST_CHECK_EQ(checkpoint_pages(&fs), 0);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "a"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "c"), NIFFS_OK);
+
+  // restored state equals scanned state
+  u32_t free_pages = fs.free_pages;
+  u32_t dele_pages = fs.dele_pages;
+  niffs_erase_cnt max_era = fs.max_era;
+#if NIFFS_FREE_MAP || NIFFS_ID_MAP
+  u32_t map_words = (fs.sectors * fs.pages_per_sector + 31) / 32;
+#endif
+#if NIFFS_FREE_MAP
+  u32_t free_map[map_words];
+  memcpy(free_map, fs.free_map, sizeof(free_map));
+#endif
+#if NIFFS_ID_MAP
+  u32_t id_map[map_words];
+  memcpy(id_map, fs.id_map, sizeof(id_map));
+#endif
+#if NIFFS_SECTOR_INFO
+  niffs_sector_info sector_info[fs.sectors];
+  memcpy(sector_info, fs.sector_info, sizeof(sector_info));
+#endif
+#if NIFFS_SPAN_INDEX
+  u32_t span_cnt = fs.span_index_cnt;
+#endif
+#if NIFFS_NAME_INDEX
+  u32_t name_cnt = fs.name_index_cnt;
+#endif
+  fs.ckpt_unclean = 1;
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(checkpoint_pages(&fs), 0);
+  niffs_emul_reset_stats();
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  niffs_emul_get_stats(&stats);
+  TEST_CHECK_GE(stats.traversed, fs.sectors * fs.pages_per_sector);
+  TEST_CHECK_EQ(fs.free_pages, free_pages);
+  TEST_CHECK_EQ(fs.dele_pages, dele_pages);
+  TEST_CHECK_EQ(fs.max_era, max_era);
+#if NIFFS_FREE_MAP
+  TEST_CHECK_EQ(memcmp(free_map, fs.free_map, sizeof(free_map)), 0);
+#endif
+#if NIFFS_ID_MAP
+  TEST_CHECK_EQ(memcmp(id_map, fs.id_map, sizeof(id_map)), 0);
+#endif
+#if NIFFS_SECTOR_INFO
+  TEST_CHECK_EQ(memcmp(sector_info, fs.sector_info, sizeof(sector_info)), 0);
+#endif
+#if NIFFS_SPAN_INDEX
+  TEST_CHECK_EQ(fs.span_index_cnt, span_cnt);
+#endif
+#if NIFFS_NAME_INDEX
+  TEST_CHECK_EQ(fs.name_index_cnt, name_cnt);
+#endif
+
+  // failed flash operation, no checkpoint
+  int fd = NIFFS_open(&fs, "a", NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  niffs_emul_set_write_byte_limit(1);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, (u8_t *)"xyz", 3), ERR_NIFFS_TEST_ABORTED_WRITE);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(checkpoint_pages(&fs), 0);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "c"), NIFFS_OK);
+
+  // aborted checkpoint is discarded when scanning, abort before the header
+  // page is marked as written
+  niffs_emul_reset_stats();
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  niffs_emul_get_stats(&stats);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  niffs_emul_set_write_byte_limit(stats.wr_bytes - sizeof(niffs_flag));
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), ERR_NIFFS_TEST_ABORTED_WRITE);
+  TEST_CHECK(!fs.mounted);
+  TEST_CHECK_GT(checkpoint_pages(&fs), 0);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(checkpoint_pages(&fs), 0);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "c"), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_WRITE_CACHE || NIFFS_DEFER_LEN
+// returns size of given file as listed by readdir, or -1 if not listed
+static s32_t readdir_size(const char *name) {
+  niffs_DIR d;
+  struct niffs_dirent e;
+  struct niffs_dirent *pe = &e;
+  s32_t size = -1;
+  NIFFS_opendir(&fs, "/", &d);
+  while ((pe = NIFFS_readdir(&d, pe))) {
+    if (strcmp(name, (char *)pe->name) == 0) size = pe->size;
+  }
+  NIFFS_closedir(&d);
+  return size;
+}
+#endif
+
+#if NIFFS_WRITE_CACHE
+static u32_t flash_len(niffs *fs, int fd) {
+  niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(fs, fs->descs[fd].obj_pix);
+  return _NIFFS_OHDR_FILE_LEN(ohdr);
+}
+
+TEST(func_write_cache) {
+  static u8_t wcache[EMUL_FILE_DESCS * EMUL_PAGE_SIZE];
+  TEST_CHECK_EQ(NIFFS_set_write_cache(&fs, wcache, EMUL_FILE_DESCS * EMUL_PAGE_SIZE / 2), ERR_NIFFS_BAD_CONF);
+  TEST_CHECK_EQ(NIFFS_set_write_cache(&fs, wcache, sizeof(wcache)), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_write_cache(&fs, wcache, sizeof(wcache)), ERR_NIFFS_MOUNTED);
+
+  u8_t *data = niffs_emul_create_data("log", 1000);
+  u8_t *data_direct = niffs_emul_create_data("direct", 1000);
+  niffs_emul_stats direct_stats, cached_stats;
+  niffs_stat s;
+  u32_t i;
+
+  // record style writes, direct
+  int fd = NIFFS_open(&fs, "direct", NIFFS_O_CREAT | NIFFS_O_RDWR | NIFFS_O_APPEND | NIFFS_O_DIRECT, 0);
+  TEST_CHECK(fd >= 0);
+  niffs_emul_reset_stats();
+  for (i = 0; i < 1000; i += 16) {
+    u32_t len = MIN(16, 1000 - i);
+    TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data_direct[i], len), len);
+    TEST_CHECK_EQ(flash_len(&fs, fd), i + len);
+  }
+  niffs_emul_get_stats(&direct_stats);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+
+  // record style writes, cached
+  fd = NIFFS_open(&fs, "log", NIFFS_O_CREAT | NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  niffs_emul_reset_stats();
+  for (i = 0; i < 1000; i += 16) {
+    u32_t len = MIN(16, 1000 - i);
+    TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[i], len), len);
+    TEST_CHECK_LT(flash_len(&fs, fd), i + len + 1);
+    TEST_CHECK_EQ(NIFFS_fstat(&fs, fd, &s), NIFFS_OK);
+    TEST_CHECK_EQ(s.size, i + len);
+    TEST_CHECK_EQ(readdir_size("log"), i + len);
+  }
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  niffs_emul_get_stats(&cached_stats);
+  TEST_CHECK_LT(cached_stats.wr_calls * 4, direct_stats.wr_calls);
+#if NIFFS_LEN_SLOTS
+  // direct appends do not move object header
+  TEST_CHECK_LT(cached_stats.wr_bytes * 2, direct_stats.wr_bytes);
+#else
+  TEST_CHECK_LT(cached_stats.wr_bytes * 4, direct_stats.wr_bytes);
+#endif
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "log"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "direct"), NIFFS_OK);
+
+  // fflush
+  fd = NIFFS_open(&fs, "log", NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, (u8_t *)"abc", 3), 3);
+  data = niffs_emul_extend_data("log", 3, (u8_t *)"abc");
+  TEST_CHECK_EQ(flash_len(&fs, fd), 1000);
+  TEST_CHECK_EQ(NIFFS_fflush(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(flash_len(&fs, fd), 1003);
+
+  // opening same file flushes other descriptors
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, (u8_t *)"def", 3), 3);
+  data = niffs_emul_extend_data("log", 3, (u8_t *)"def");
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "log", &s), NIFFS_OK);
+  TEST_CHECK_EQ(s.size, 1006);
+  TEST_CHECK_EQ(flash_len(&fs, fd), 1006);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+
+  // seek and read flushes
+  u8_t rd[6];
+  fd = NIFFS_open(&fs, "log", NIFFS_O_RDWR, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_lseek(&fs, fd, 0, NIFFS_SEEK_END), 1006);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, (u8_t *)"ghi", 3), 3);
+  data = niffs_emul_extend_data("log", 3, (u8_t *)"ghi");
+  TEST_CHECK_EQ(NIFFS_ftell(&fs, fd), 1009);
+  TEST_CHECK_EQ(NIFFS_lseek(&fs, fd, -6, NIFFS_SEEK_CUR), 1003);
+  TEST_CHECK_EQ(flash_len(&fs, fd), 1009);
+  TEST_CHECK_EQ(NIFFS_read(&fs, fd, rd, 6), 6);
+  TEST_CHECK_EQ(memcmp(rd, "defghi", 6), 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, (u8_t *)"jkl", 3), 3);
+  data = niffs_emul_extend_data("log", 3, (u8_t *)"jkl");
+  TEST_CHECK_EQ(NIFFS_lseek(&fs, fd, 1003, NIFFS_SEEK_SET), 1003);
+  TEST_CHECK_EQ(NIFFS_read(&fs, fd, rd, 6), 6);
+  TEST_CHECK_EQ(memcmp(rd, "defghi", 6), 0);
+  TEST_CHECK_EQ(NIFFS_read(&fs, fd, rd, 6), 3);
+  TEST_CHECK_EQ(memcmp(rd, "jkl", 3), 0);
+
+  // modify after cached append
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, (u8_t *)"mno", 3), 3);
+  data = niffs_emul_extend_data("log", 3, (u8_t *)"mno");
+  TEST_CHECK_EQ(NIFFS_lseek(&fs, fd, 1000, NIFFS_SEEK_SET), 1000);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, (u8_t *)"ABC", 3), 3);
+  niffs_emul_write_data("log", 1000, (u8_t *)"ABC", 3);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "log"), NIFFS_OK);
+
+  // unmount flushes
+  fd = NIFFS_open(&fs, "log", NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, (u8_t *)"pqr", 3), 3);
+  data = niffs_emul_extend_data("log", 3, (u8_t *)"pqr");
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "log"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "direct"), NIFFS_OK);
+
+  // removing drops cached data
+  fd = NIFFS_open(&fs, "log", NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  niffs_emul_reset_stats();
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, (u8_t *)"stu", 3), 3);
+  TEST_CHECK_EQ(NIFFS_fremove(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "log", &s), ERR_NIFFS_FILE_NOT_FOUND);
+  niffs_emul_destroy_data("log");
+
+  // large writes bypass cache for whole pages
+  data = niffs_emul_create_data("big", 3000);
+  fd = NIFFS_open(&fs, "big", NIFFS_O_CREAT | NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, data, 10), 10);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[10], 2990), 2990);
+  TEST_CHECK_LT(fs.descs[fd].wc_len, _NIFFS_SPIX_2_PDATA_LEN(&fs, 1));
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "big"), NIFFS_OK);
+
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_write_cache(&fs, 0, 0), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_DEFER_LEN
+static int check_file_prefix(niffs *fs, const char *name, u8_t *data, u32_t len) {
+  niffs_stat s;
+  u8_t buf[1000];
+  int res = NIFFS_stat(fs, name, &s);
+  if (res != NIFFS_OK) return res;
+  if (s.size != len || len > sizeof(buf)) return ERR_NIFFS_TEST_REF_DATA_MISMATCH;
+  int fd = NIFFS_open(fs, name, NIFFS_O_RDONLY, 0);
+  if (fd < 0) return fd;
+  res = NIFFS_read(fs, fd, buf, len);
+  (void)NIFFS_close(fs, fd);
+  if (res != (int)len) return res < 0 ? res : ERR_NIFFS_TEST_REF_DATA_MISMATCH;
+  return memcmp(buf, data, len) == 0 ? NIFFS_OK : ERR_NIFFS_TEST_REF_DATA_MISMATCH;
+}
+
+TEST(func_defer_len) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  u8_t *data = niffs_emul_create_data("defer", 1000);
+  niffs_stat s;
+  u32_t i;
+
+  // first pages are committed directly
+  int fd = NIFFS_open(&fs, "defer", NIFFS_O_CREAT | NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, data, 300), 300);
+  TEST_CHECK_EQ(fs.descs[fd].pend_len, 0);
+  niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(&fs, fs.descs[fd].obj_pix);
+  TEST_CHECK_EQ(_NIFFS_OHDR_LEN(ohdr), 300);
+
+  // following appends only mark object header once
+  u32_t dele_pages = fs.dele_pages;
+  for (i = 300; i < 500; i += 20) {
+    TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[i], 20), 20);
+    TEST_CHECK_EQ(fs.descs[fd].pend_len, i + 20);
+    TEST_CHECK_EQ(NIFFS_fstat(&fs, fd, &s), NIFFS_OK);
+    TEST_CHECK_EQ(s.size, i + 20);
+    TEST_CHECK_EQ(readdir_size("defer"), i + 20);
+  }
+  ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(&fs, fs.descs[fd].obj_pix);
+  TEST_CHECK_EQ(_NIFFS_OHDR_LEN(ohdr), 300);
+#if NIFFS_LEN_SLOTS
+  // update announced in a length slot instead
+  TEST_CHECK(_NIFFS_IS_WRIT(&ohdr->phdr));
+#else
+  TEST_CHECK(_NIFFS_IS_MOVI(&ohdr->phdr));
+#endif
+  // only rewritten partial data pages are deleted, no object headers
+  u32_t dele_session = fs.dele_pages - dele_pages;
+  TEST_CHECK_LT(dele_session, 10);
+
+  // fflush commits
+  TEST_CHECK_EQ(NIFFS_fflush(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(fs.descs[fd].pend_len, 0);
+  ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(&fs, fs.descs[fd].obj_pix);
+  TEST_CHECK_EQ(_NIFFS_OHDR_LEN(ohdr), 500);
+  TEST_CHECK(_NIFFS_IS_WRIT(&ohdr->phdr));
+#if NIFFS_LEN_SLOTS
+  TEST_CHECK_EQ(fs.dele_pages - dele_pages, dele_session);
+#else
+  TEST_CHECK_EQ(fs.dele_pages - dele_pages, dele_session + 1);
+#endif
+
+  // opening same file commits
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[500], 100), 100);
+  TEST_CHECK_EQ(check_file_prefix(&fs, "defer", data, 600), NIFFS_OK);
+  TEST_CHECK_EQ(fs.descs[fd].pend_len, 0);
+
+  // direct descriptors commit on each append
+  int fd_direct = NIFFS_open(&fs, "defer", NIFFS_O_RDWR | NIFFS_O_APPEND | NIFFS_O_DIRECT, 0);
+  TEST_CHECK(fd_direct >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd_direct, &data[600], 50), 50);
+  TEST_CHECK_EQ(fs.descs[fd_direct].pend_len, 0);
+  ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(&fs, fs.descs[fd_direct].obj_pix);
+  TEST_CHECK_EQ(_NIFFS_OHDR_LEN(ohdr), 650);
+
+  // appending through another descriptor commits first
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[650], 50), 50);
+  TEST_CHECK_EQ(fs.descs[fd].pend_len, 700);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd_direct, &data[700], 50), 50);
+  TEST_CHECK_EQ(fs.descs[fd].pend_len, 0);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd_direct), NIFFS_OK);
+  TEST_CHECK_EQ(check_file_prefix(&fs, "defer", data, 750), NIFFS_OK);
+
+  // lost descriptor, uncommitted data dropped when opening
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[750], 100), 100);
+  TEST_CHECK_EQ(fs.descs[fd].pend_len, 850);
+  niffs_memset(&fs.descs[fd], 0, sizeof(niffs_file_desc));
+  TEST_CHECK_EQ(check_file_prefix(&fs, "defer", data, 750), NIFFS_OK);
+
+  // lost descriptor, uncommitted data dropped by check
+  fd = NIFFS_open(&fs, "defer", NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[750], 100), 100);
+  TEST_CHECK_EQ(fs.descs[fd].pend_len, 850);
+  niffs_memset(&fs.descs[fd], 0, sizeof(niffs_file_desc));
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(check_file_prefix(&fs, "defer", data, 750), NIFFS_OK);
+
+  // aborted commit
+  fd = NIFFS_open(&fs, "defer", NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[750], 100), 100);
+  niffs_emul_set_write_byte_limit(1);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), ERR_NIFFS_TEST_ABORTED_WRITE);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(check_file_prefix(&fs, "defer", data, 750), NIFFS_OK);
+
+  // unmount commits
+  fd = NIFFS_open(&fs, "defer", NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[750], 250), 250);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "defer"), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_INPLACE_APPEND
+TEST(func_inplace_append) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  u8_t *data = niffs_emul_create_data("inplace", 400);
+  u32_t pdata0 = _NIFFS_SPIX_2_PDATA_LEN(&fs, 0);
+#if NIFFS_LEN_SLOTS
+  // length is committed in object header slots, header is not moved
+  u32_t ohdr_moves = 0;
+#else
+  u32_t ohdr_moves = 1;
+#endif
+
+  int fd = NIFFS_open(&fs, "inplace", NIFFS_O_CREAT | NIFFS_O_RDWR | NIFFS_O_APPEND | NIFFS_O_DIRECT, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, data, pdata0 + 10), pdata0 + 10);
+  niffs_page_ix pix = fs.descs[fd].cur_pix;
+
+  // programmed into same page, at most object header is moved
+  u32_t dele_pages = fs.dele_pages;
+  niffs_emul_stats stats;
+  niffs_emul_reset_stats();
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[pdata0 + 10], 20), 20);
+  niffs_emul_get_stats(&stats);
+  TEST_CHECK_EQ(fs.descs[fd].cur_pix, pix);
+  TEST_CHECK_EQ(fs.dele_pages, dele_pages + ohdr_moves);
+  TEST_CHECK_LT(stats.wr_bytes, fs.page_size + 20 + 16);
+
+  // odd length, next write is unaligned and moves page
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[pdata0 + 30], 3), 3);
+  TEST_CHECK_EQ(fs.descs[fd].cur_pix, pix);
+  dele_pages = fs.dele_pages;
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[pdata0 + 33], 3), 3);
+  TEST_CHECK_NEQ(fs.descs[fd].cur_pix, pix);
+  TEST_CHECK_EQ(fs.dele_pages, dele_pages + 1 + ohdr_moves);
+  pix = fs.descs[fd].cur_pix;
+
+  // moved page keeps remainder erased
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[pdata0 + 36], 400 - pdata0 - 36), 400 - pdata0 - 36);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "inplace"), NIFFS_OK);
+
+  // moved page was filled in place
+  niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(&fs, pix);
+  TEST_CHECK(_NIFFS_IS_WRIT(phdr));
+  TEST_CHECK_EQ(phdr->id.spix, 1);
+
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "inplace"), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_LEN_SLOTS
+TEST(func_len_slots) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  u8_t *data = niffs_emul_create_data("slots", 1000);
+  u32_t pdata0 = _NIFFS_SPIX_2_PDATA_LEN(&fs, 0);
+  niffs_stat s;
+  u32_t i;
+
+  // filling first page writes length in object header itself
+  int fd = NIFFS_open(&fs, "slots", NIFFS_O_CREAT | NIFFS_O_RDWR | NIFFS_O_APPEND | NIFFS_O_DIRECT, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, data, pdata0), pdata0);
+  niffs_page_ix pix = fs.descs[fd].obj_pix;
+  niffs_object_hdr *ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(&fs, pix);
+  TEST_CHECK_EQ(ohdr->len, pdata0);
+  TEST_CHECK_EQ(ohdr->len_slots[0], NIFFS_UNDEF_LEN);
+
+  // each following append programs two slots, object header stays
+  u32_t len = pdata0;
+#if NIFFS_INPLACE_APPEND
+  u32_t dele_pages = fs.dele_pages;
+#endif
+  for (i = 0; i < NIFFS_LEN_SLOTS / 2; i++) {
+    TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[len], 8), 8);
+    len += 8;
+    TEST_CHECK_EQ(fs.descs[fd].obj_pix, pix);
+    TEST_CHECK_EQ(ohdr->len_slots[i*2], _NIFFS_LEN_SLOT_PENDING);
+    TEST_CHECK_EQ(ohdr->len_slots[i*2+1], len);
+    TEST_CHECK_EQ(NIFFS_fstat(&fs, fd, &s), NIFFS_OK);
+    TEST_CHECK_EQ(s.size, len);
+  }
+#if NIFFS_INPLACE_APPEND
+  // nor is the partially filled data page rewritten
+  TEST_CHECK_EQ(fs.dele_pages, dele_pages);
+#endif
+
+  // slots used up, object header is moved with slots erased
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[len], 8), 8);
+  len += 8;
+  TEST_CHECK_NEQ(fs.descs[fd].obj_pix, pix);
+  pix = fs.descs[fd].obj_pix;
+  ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(&fs, pix);
+  TEST_CHECK_EQ(ohdr->len, len);
+  TEST_CHECK_EQ(ohdr->len_slots[0], NIFFS_UNDEF_LEN);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "slots"), NIFFS_OK);
+
+  // aborted append, announced update is dropped by check
+  fd = NIFFS_open(&fs, "slots", NIFFS_O_RDWR | NIFFS_O_APPEND | NIFFS_O_DIRECT, 0);
+  TEST_CHECK(fd >= 0);
+  u32_t rem = _NIFFS_SPIX_2_PDATA_LEN(&fs, 1) - _NIFFS_OFFS_2_PDATA_OFFS(&fs, len);
+  niffs_emul_set_write_byte_limit(sizeof(u32_t) + rem + sizeof(niffs_page_hdr) + 20);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[len], 200), ERR_NIFFS_TEST_ABORTED_WRITE);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(ohdr->len_slots[0], _NIFFS_LEN_SLOT_PENDING);
+  TEST_CHECK_EQ(_NIFFS_OHDR_LEN(ohdr), len);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "slots", &s), NIFFS_OK);
+  TEST_CHECK_EQ(s.size, len);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "slots"), NIFFS_OK);
+
+  // append after aborted slot
+  fd = NIFFS_open(&fs, "slots", NIFFS_O_RDWR | NIFFS_O_APPEND | NIFFS_O_DIRECT, 0);
+  TEST_CHECK(fd >= 0);
+  ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(&fs, fs.descs[fd].obj_pix);
+  TEST_CHECK_EQ(ohdr->len_slots[0], _NIFFS_LEN_SLOT_ABORTED);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[len], 200), 200);
+  len += 200;
+  TEST_CHECK_EQ(ohdr->len_slots[2], len);
+
+  // aborted append, announced update is dropped when opening
+  rem = _NIFFS_SPIX_2_PDATA_LEN(&fs, 1) - _NIFFS_OFFS_2_PDATA_OFFS(&fs, len);
+  niffs_emul_set_write_byte_limit(sizeof(u32_t) + rem + sizeof(niffs_page_hdr) + 20);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[len], 200), ERR_NIFFS_TEST_ABORTED_WRITE);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(ohdr->len_slots[3], _NIFFS_LEN_SLOT_PENDING);
+  fd = NIFFS_open(&fs, "slots", NIFFS_O_RDWR | NIFFS_O_APPEND | NIFFS_O_DIRECT, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(ohdr->len_slots[3], _NIFFS_LEN_SLOT_ABORTED);
+  TEST_CHECK_EQ(NIFFS_fstat(&fs, fd, &s), NIFFS_OK);
+  TEST_CHECK_EQ(s.size, len);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[len], 1000 - len), 1000 - len);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "slots"), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "slots", &s), NIFFS_OK);
+  TEST_CHECK_EQ(s.size, 1000);
+
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "slots"), NIFFS_OK);
+
+  // aborted remove, file is gone once first byte of removal marker is zeroed
+  fd = NIFFS_open(&fs, "rm", NIFFS_O_CREAT | NIFFS_O_RDWR | NIFFS_O_APPEND | NIFFS_O_DIRECT, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, data, pdata0), pdata0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, data, 8), 8);
+  ohdr = (niffs_object_hdr *)_NIFFS_PIX_2_ADDR(&fs, fs.descs[fd].obj_pix);
+  TEST_CHECK_EQ(ohdr->len, pdata0);
+  TEST_CHECK_EQ(ohdr->len_slots[1], pdata0 + 8);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  niffs_emul_set_write_byte_limit(1);
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "rm"), ERR_NIFFS_TEST_ABORTED_WRITE);
+  niffs_emul_set_write_byte_limit(0);
+  TEST_CHECK_EQ(ohdr->len, pdata0);
+  TEST_CHECK_EQ(_NIFFS_OHDR_LEN(ohdr), 0);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "rm", &s), ERR_NIFFS_FILE_NOT_FOUND);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "slots"), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_INPLACE_MODIFY
+TEST(func_inplace_modify) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  u32_t len = _NIFFS_SPIX_2_PDATA_LEN(&fs, 0) + 2 * _NIFFS_SPIX_2_PDATA_LEN(&fs, 1);
+  u8_t *data = niffs_emul_create_data("bitmap", len);
+  niffs_memset(data, 0xff, len);
+  int fd = NIFFS_open(&fs, "bitmap", NIFFS_O_CREAT | NIFFS_O_RDWR, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, data, len), len);
+  TEST_CHECK_EQ(NIFFS_fflush(&fs, fd), NIFFS_OK);
+  niffs_page_ix ohdr_pix = fs.descs[fd].obj_pix;
+  u32_t dele_pages = fs.dele_pages;
+  u32_t free_pages = fs.free_pages;
+
+  // clearing bits over page boundaries, in object header page and data pages
+  u32_t offs;
+  for (offs = 3; offs < len; offs += 37) {
+    u32_t mlen = MIN(5, len - offs);
+    u32_t i;
+    for (i = 0; i < mlen; i++) {
+      data[offs + i] &= ~(1 << ((offs + i) & 7));
+    }
+    TEST_CHECK_EQ(NIFFS_lseek(&fs, fd, offs, NIFFS_SEEK_SET), offs);
+    TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[offs], mlen), mlen);
+  }
+  TEST_CHECK_EQ(fs.descs[fd].obj_pix, ohdr_pix);
+  TEST_CHECK_EQ(fs.dele_pages, dele_pages);
+  TEST_CHECK_EQ(fs.free_pages, free_pages);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "bitmap"), NIFFS_OK);
+
+  // setting bits moves page
+  niffs_memset(&data[3], 0xff, 4);
+  TEST_CHECK_EQ(NIFFS_lseek(&fs, fd, 3, NIFFS_SEEK_SET), 3);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[3], 4), 4);
+  TEST_CHECK_NEQ(fs.descs[fd].obj_pix, ohdr_pix);
+  TEST_CHECK_EQ(fs.dele_pages, dele_pages + 1);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "bitmap"), NIFFS_OK);
+
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "bitmap"), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_FALLOCATE
+TEST(func_fallocate) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  const u32_t len = 2000;
+  u8_t *data = niffs_emul_create_data("stream", len);
+  niffs_emul_stats stats;
+  niffs_info info;
+  u8_t *junk = niffs_emul_create_data("junk", fs.sectors * fs.sector_size);
+  int round;
+
+  // small appends only stay within the reservation when cached
+  for (round = NIFFS_WRITE_CACHE ? 0 : 1; round < 2; round++) {
+    // leave little free and lots of deleted pages
+    u32_t junk_len = (fs.free_pages + fs.dele_pages - 3 * fs.pages_per_sector) * _NIFFS_SPIX_2_PDATA_LEN(&fs, 1);
+    int fd = NIFFS_open(&fs, "junk", NIFFS_O_CREAT | NIFFS_O_TRUNC | NIFFS_O_RDWR, 0);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK_EQ(NIFFS_write(&fs, fd, junk, junk_len), junk_len);
+    TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+    TEST_CHECK_EQ(NIFFS_remove(&fs, "junk"), NIFFS_OK);
+
+    // gc is done up front
+    u8_t flags = NIFFS_O_CREAT | NIFFS_O_TRUNC | NIFFS_O_RDWR | NIFFS_O_APPEND;
+    if (round == 1) flags |= NIFFS_O_DIRECT;
+    fd = NIFFS_open(&fs, "stream", flags, 0);
+    TEST_CHECK(fd >= 0);
+    niffs_emul_reset_stats();
+    TEST_CHECK_EQ(NIFFS_fallocate(&fs, fd, len), NIFFS_OK);
+    niffs_emul_get_stats(&stats);
+    TEST_CHECK(stats.er_calls > 0);
+    TEST_CHECK(fs.resv_pages > 0);
+    TEST_CHECK_EQ(fs.descs[fd].resv_pages, fs.resv_pages);
+    TEST_CHECK(fs.free_pages >= fs.pages_per_sector + fs.resv_pages);
+    TEST_CHECK_EQ(NIFFS_info(&fs, &info), NIFFS_OK);
+    TEST_CHECK_EQ(info.resv_bytes, fs.resv_pages * _NIFFS_SPIX_2_PDATA_LEN(&fs, 1));
+
+    // other files leave reservation alone
+    TEST_CHECK_EQ(NIFFS_creat(&fs, "other", 0), NIFFS_OK);
+    TEST_CHECK(fs.free_pages >= fs.pages_per_sector + fs.resv_pages);
+
+    // no gc within reservation, small cached appends or one direct append
+    niffs_emul_reset_stats();
+    if (round == 0) {
+      u32_t offs;
+      for (offs = 0; offs < len; offs += 50) {
+        TEST_CHECK_EQ(NIFFS_write(&fs, fd, &data[offs], 50), 50);
+      }
+      TEST_CHECK_EQ(NIFFS_fflush(&fs, fd), NIFFS_OK);
+    } else {
+      TEST_CHECK_EQ(NIFFS_write(&fs, fd, data, len), len);
+    }
+    niffs_emul_get_stats(&stats);
+    TEST_CHECK_EQ(stats.er_calls, 0);
+    TEST_CHECK(fs.free_pages >= fs.pages_per_sector + fs.resv_pages);
+    TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "stream"), NIFFS_OK);
+
+    // released on close
+    TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+    TEST_CHECK_EQ(fs.resv_pages, 0);
+    TEST_CHECK_EQ(NIFFS_info(&fs, &info), NIFFS_OK);
+    TEST_CHECK_EQ(info.resv_bytes, 0);
+    TEST_CHECK_EQ(NIFFS_remove(&fs, "other"), NIFFS_OK);
+  }
+
+  // too big
+  int fd = NIFFS_open(&fs, "stream", NIFFS_O_RDWR | NIFFS_O_APPEND, 0);
+  TEST_CHECK(fd >= 0);
+  TEST_CHECK_EQ(NIFFS_fallocate(&fs, fd, fs.sectors * fs.sector_size), ERR_NIFFS_FULL);
+  TEST_CHECK_EQ(fs.resv_pages, 0);
+  TEST_CHECK_EQ(NIFFS_fallocate(&fs, fd, len), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_fallocate(&fs, fd, 0), NIFFS_OK);
+  TEST_CHECK_EQ(fs.resv_pages, 0);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "stream"), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_GC_STEP
+static int func_gc_step_free_in_sector(u32_t sector) {
+  u32_t free = 0;
+  niffs_page_ix ipix;
+  for (ipix = 0; ipix < fs.pages_per_sector; ipix++) {
+    niffs_page_hdr *phdr = (niffs_page_hdr *)_NIFFS_PIX_2_ADDR(&fs, _NIFFS_PIX_AT_SECTOR(&fs, sector) + ipix);
+    if (_NIFFS_IS_FREE(phdr) && _NIFFS_IS_CLEA(phdr)) free++;
+  }
+  return free;
+}
+
+TEST(func_gc_step) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  niffs_emul_stats stats;
+  char name[NIFFS_NAME_LEN];
+  int files = 0;
+  int i;
+  int res;
+  const u32_t len = _NIFFS_SPIX_2_PDATA_LEN(&fs, 0);
+
+  // nothing to do on a fresh file system
+  TEST_CHECK_EQ(NIFFS_gc_pending(&fs), 0);
+  TEST_CHECK_EQ(NIFFS_gc_step(&fs, 1, 1), 0);
+
+  // interleave kept and removed one page files until below watermark
+  while (fs.free_pages >= fs.gc_watermark) {
+    sprintf(name, "keep%i", files);
+    TEST_CHECK_EQ(niffs_emul_create_file(&fs, name, len), NIFFS_OK);
+    sprintf(name, "junk%i", files);
+    TEST_CHECK_EQ(niffs_emul_create_file(&fs, name, len), NIFFS_OK);
+    files++;
+  }
+  for (i = 0; i < files; i++) {
+    sprintf(name, "junk%i", i);
+    TEST_CHECK_EQ(NIFFS_remove(&fs, name), NIFFS_OK);
+  }
+  TEST_CHECK_EQ(NIFFS_gc_pending(&fs), 1);
+
+  // move one page at a time, never erase
+  niffs_emul_reset_stats();
+  TEST_CHECK_EQ(NIFFS_gc_step(&fs, 1, 0), 1);
+  TEST_CHECK(fs.gc_active);
+  u32_t sector = fs.gc_sector;
+  u32_t sector_free = func_gc_step_free_in_sector(sector);
+  TEST_CHECK_EQ(sector_free, fs.gc_free_pages);
+
+  // foreground operations leave sector being collected alone
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "fg", 3 * len), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "keep0"), NIFFS_OK);
+  TEST_CHECK_EQ(func_gc_step_free_in_sector(sector), sector_free);
+
+  for (i = 0; i < (int)fs.pages_per_sector; i++) {
+    TEST_CHECK_EQ(NIFFS_gc_step(&fs, 1, 0), 1);
+  }
+  niffs_emul_get_stats(&stats);
+  TEST_CHECK_EQ(stats.er_calls, 0);
+  TEST_CHECK_EQ(fs.gc_sector, sector);
+
+  // erase when allowed
+  TEST_CHECK(NIFFS_gc_step(&fs, 1, 1) >= 0);
+  niffs_emul_get_stats(&stats);
+  TEST_CHECK_EQ(stats.er_calls, 1);
+  TEST_CHECK_EQ(func_gc_step_free_in_sector(sector), fs.pages_per_sector);
+
+  // run until done, step and pending agree
+  for (i = 0; i < 1000 && NIFFS_gc_pending(&fs); i++) {
+    res = NIFFS_gc_step(&fs, 2, 1);
+    TEST_CHECK_EQ(res, NIFFS_gc_pending(&fs));
+  }
+  TEST_CHECK(i < 1000);
+  TEST_CHECK(!fs.gc_active);
+  TEST_CHECK(fs.free_pages >= fs.gc_watermark);
+
+  // abandoned on unmount
+  TEST_CHECK_EQ(NIFFS_set_gc_watermark(&fs, fs.free_pages + 1), NIFFS_OK);
+  for (i = 1; i < files; i += 2) {
+    sprintf(name, "keep%i", i);
+    TEST_CHECK_EQ(NIFFS_remove(&fs, name), NIFFS_OK);
+  }
+  TEST_CHECK_EQ(NIFFS_gc_step(&fs, 1, 0), 1);
+  TEST_CHECK(fs.gc_active);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK(!fs.gc_active);
+
+  // finished by foreground when running short
+  TEST_CHECK_EQ(NIFFS_gc_step(&fs, 1, 0), 1);
+  TEST_CHECK(fs.gc_active);
+  u32_t big_len = (fs.free_pages - fs.pages_per_sector + 1) * _NIFFS_SPIX_2_PDATA_LEN(&fs, 1);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "big", big_len), NIFFS_OK);
+  TEST_CHECK(!fs.gc_active);
+
+  for (i = 2; i < files; i += 2) {
+    sprintf(name, "keep%i", i);
+    TEST_CHECK_EQ(niffs_emul_verify_file(&fs, name), NIFFS_OK);
+  }
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "fg"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "big"), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "big"), NIFFS_OK);
+
+  // below watermark with deleted pages, but moving the busy pages would eat
+  // into the last free sector, so nothing for a step
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  for (i = 0; i < (int)((fs.sectors - 1) * fs.pages_per_sector); i++) {
+    sprintf(name, "t%i", i);
+    TEST_CHECK_EQ(niffs_emul_create_file(&fs, name, 10), NIFFS_OK);
+  }
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "t0"), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_gc_watermark(&fs, 2 * fs.pages_per_sector), NIFFS_OK);
+  TEST_CHECK(fs.dele_pages > 0);
+  TEST_CHECK_EQ(NIFFS_gc_pending(&fs), 0);
+  TEST_CHECK_EQ(NIFFS_gc_step(&fs, 1, 1), 0);
+  TEST_CHECK_EQ(fs.dele_pages, 1);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_COLD_HEAD
+TEST(func_cold_head) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  niffs_stat s;
+  niffs_page_ix pix;
+  char name[16];
+  u32_t i;
+
+  // fill all but one sector with one page files
+  for (i = 0; i < (fs.sectors-1) * fs.pages_per_sector; i++) {
+    sprintf(name, "t%i", i);
+    TEST_CHECK_EQ(niffs_emul_create_file(&fs, name, 10), NIFFS_OK);
+  }
+  TEST_CHECK_EQ(fs.free_pages, fs.pages_per_sector);
+
+  // keep one file in first sector, remove the others there
+  char keep[16] = {0};
+  for (i = 0; i < (fs.sectors-1) * fs.pages_per_sector; i++) {
+    sprintf(name, "t%i", i);
+    TEST_CHECK_EQ(NIFFS_stat(&fs, name, &s), NIFFS_OK);
+    TEST_CHECK_EQ(niffs_find_page(&fs, &pix, s.obj_id, 0, 0), NIFFS_OK);
+    if (_NIFFS_PIX_2_SECTOR(&fs, pix) != 0) continue;
+    if (keep[0] == 0) {
+      strcpy(keep, name);
+    } else {
+      TEST_CHECK_EQ(NIFFS_remove(&fs, name), NIFFS_OK);
+      niffs_emul_destroy_data(name);
+    }
+  }
+  TEST_CHECK(keep[0]);
+
+  // kept file is relocated by gc to the cold head
+  u32_t freed;
+  TEST_CHECK_EQ(niffs_gc(&fs, &freed, 0), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, keep, &s), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_find_page(&fs, &pix, s.obj_id, 0, 0), NIFFS_OK);
+  u32_t cold = _NIFFS_PIX_2_SECTOR(&fs, pix);
+  TEST_CHECK_NEQ(cold, 0);
+  TEST_CHECK_EQ(fs.cold_sector, cold);
+  TEST_CHECK_GT(fs.free_pages, fs.pages_per_sector);
+
+  // user writes keep clear of the sector filled by gc, though it has free pages
+  for (i = 0; i < 3; i++) {
+    sprintf(name, "u%i", i);
+    TEST_CHECK_EQ(niffs_emul_create_file(&fs, name, 10), NIFFS_OK);
+    TEST_CHECK_EQ(NIFFS_stat(&fs, name, &s), NIFFS_OK);
+    TEST_CHECK_EQ(niffs_find_page(&fs, &pix, s.obj_id, 0, 0), NIFFS_OK);
+    TEST_CHECK_NEQ(_NIFFS_PIX_2_SECTOR(&fs, pix), cold);
+  }
+
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, keep), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "u0"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "u2"), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_GC_POLICY
+static u32_t func_gc_policy_calls;
+static u32_t func_gc_policy_sector;
+
+static s32_t func_gc_policy_fixed(const niffs_gc_sector *s) {
+  func_gc_policy_calls++;
+  return s->sector == func_gc_policy_sector ? 1 : 0;
+}
+
+TEST(func_gc_policy) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  const u32_t len = _NIFFS_SPIX_2_PDATA_LEN(&fs, 0);
+  char name[NIFFS_NAME_LEN];
+  u32_t freed;
+  int i;
+
+  // sector 0 gets one deleted page, sector 1 gets all but one deleted pages
+  for (i = 0; i < 2 * (int)fs.pages_per_sector; i++) {
+    sprintf(name, "f%i", i);
+    TEST_CHECK_EQ(niffs_emul_create_file(&fs, name, len), NIFFS_OK);
+  }
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "f0"), NIFFS_OK);
+  for (i = fs.pages_per_sector; i < 2 * (int)fs.pages_per_sector - 1; i++) {
+    sprintf(name, "f%i", i);
+    TEST_CHECK_EQ(NIFFS_remove(&fs, name), NIFFS_OK);
+  }
+  niffs_sector_hdr *shdr0 = (niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(&fs, 0);
+  niffs_sector_hdr *shdr1 = (niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(&fs, 1);
+  niffs_erase_cnt era0 = shdr0->era_cnt;
+  niffs_erase_cnt era1 = shdr1->era_cnt;
+
+  // custom policy is asked for every sector considered
+  func_gc_policy_calls = 0;
+  func_gc_policy_sector = 0;
+  TEST_CHECK_EQ(NIFFS_set_gc_policy(&fs, func_gc_policy_fixed), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_gc(&fs, &freed, 0), NIFFS_OK);
+  TEST_CHECK(func_gc_policy_calls > 0);
+  TEST_CHECK_EQ(freed, 1);
+  TEST_CHECK_EQ(shdr0->era_cnt, (niffs_erase_cnt)(era0 + 1));
+
+  // greedy takes the sector with most deleted pages
+  TEST_CHECK_EQ(NIFFS_set_gc_policy(&fs, NIFFS_gc_policy_greedy), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_gc(&fs, &freed, 0), NIFFS_OK);
+  TEST_CHECK_EQ(freed, fs.pages_per_sector - 1);
+  TEST_CHECK_EQ(shdr1->era_cnt, (niffs_erase_cnt)(era1 + 1));
+
+  // all policies keep the file system sound under churn
+  niffs_gc_policy_f policies[] = {
+      0, NIFFS_gc_policy_greedy, NIFFS_gc_policy_cost_benefit, NIFFS_gc_policy_wear
+  };
+  u32_t p;
+  for (p = 0; p < sizeof(policies)/sizeof(policies[0]); p++) {
+    TEST_CHECK_EQ(NIFFS_set_gc_policy(&fs, policies[p]), NIFFS_OK);
+    for (i = 0; i < 100; i++) {
+      sprintf(name, "churn%i", i % 5);
+      TEST_CHECK_EQ(niffs_emul_create_file(&fs, name, 1 + (i * 37) % 400), NIFFS_OK);
+    }
+    for (i = 1; i < (int)fs.pages_per_sector; i++) {
+      sprintf(name, "f%i", i);
+      TEST_CHECK_EQ(niffs_emul_verify_file(&fs, name), NIFFS_OK);
+    }
+    TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+    TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+    TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  }
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_DEAD_ERASE
+TEST(func_dead_erase) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  niffs_emul_stats stats;
+  u32_t freed;
+
+  // a file filling two sectors exactly, and one more page
+  u32_t len = _NIFFS_SPIX_2_PDATA_LEN(&fs, 0) + (2 * fs.pages_per_sector - 1) * _NIFFS_SPIX_2_PDATA_LEN(&fs, 1);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "dead", len), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "live", 10), NIFFS_OK);
+  TEST_CHECK_EQ(fs.dead_cnt, 0);
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "dead"), NIFFS_OK);
+  TEST_CHECK_EQ(fs.dead_cnt, 2);
+
+  // one erase, no moves, no scanning
+  u32_t free_pages = fs.free_pages;
+  u32_t dele_pages = fs.dele_pages;
+#if NIFFS_GC_POLICY
+  func_gc_policy_calls = 0;
+  TEST_CHECK_EQ(NIFFS_set_gc_policy(&fs, func_gc_policy_fixed), NIFFS_OK);
+#endif
+  niffs_emul_reset_stats();
+  TEST_CHECK_EQ(niffs_gc(&fs, &freed, 0), NIFFS_OK);
+  niffs_emul_get_stats(&stats);
+  TEST_CHECK_EQ(freed, fs.pages_per_sector);
+  TEST_CHECK_EQ(stats.er_calls, 1);
+  TEST_CHECK_EQ(stats.gc_moves, 0);
+  TEST_CHECK_EQ(stats.traversed, 0);
+#if NIFFS_GC_POLICY
+  TEST_CHECK_EQ(func_gc_policy_calls, 0);
+  TEST_CHECK_EQ(NIFFS_set_gc_policy(&fs, 0), NIFFS_OK);
+#endif
+  TEST_CHECK_EQ(fs.dead_cnt, 1);
+  TEST_CHECK_EQ(fs.free_pages, free_pages + fs.pages_per_sector);
+  TEST_CHECK_EQ(fs.dele_pages, dele_pages - fs.pages_per_sector);
+
+#if NIFFS_GC_STEP
+  // background step erases regardless of watermark, only if allowed
+  TEST_CHECK_EQ(NIFFS_gc_pending(&fs), 1);
+  niffs_emul_reset_stats();
+  TEST_CHECK_EQ(NIFFS_gc_step(&fs, 0, 0), 1);
+  TEST_CHECK_EQ(fs.dead_cnt, 1);
+  TEST_CHECK_EQ(NIFFS_gc_step(&fs, 0, 1), 0);
+  niffs_emul_get_stats(&stats);
+  TEST_CHECK_EQ(stats.er_calls, 1);
+  TEST_CHECK_EQ(fs.dead_cnt, 0);
+  TEST_CHECK_EQ(NIFFS_gc_pending(&fs), 0);
+#endif
+
+  // found when mounting by scan
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "dead", len), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "dead"), NIFFS_OK);
+  u32_t dead_cnt = fs.dead_cnt;
+  TEST_CHECK(dead_cnt > 0);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK(fs.dead_cnt >= dead_cnt);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "live"), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+
+#if NIFFS_GC_STEP
+TEST(func_dead_erase_lagging) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  niffs_stat s;
+  niffs_page_ix pix;
+  u32_t i;
+  int res;
+
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "static", 10), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "static", &s), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_find_page(&fs, &pix, s.obj_id, 0, 0), NIFFS_OK);
+  u32_t cold = _NIFFS_PIX_2_SECTOR(&fs, pix);
+  for (i = 0; i < fs.sectors; i++) {
+    if (i != cold) {
+      TEST_CHECK_EQ(niffs_erase_sector(&fs, i), NIFFS_OK);
+      TEST_CHECK_EQ(niffs_erase_sector(&fs, i), NIFFS_OK);
+      TEST_CHECK_EQ(niffs_erase_sector(&fs, i), NIFFS_OK);
+    }
+  }
+
+  // a file filling the rest of the cold sector and the next one
+  u32_t len = _NIFFS_SPIX_2_PDATA_LEN(&fs, 0) + (2 * fs.pages_per_sector - 2) * _NIFFS_SPIX_2_PDATA_LEN(&fs, 1);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "dead", len), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "dead"), NIFFS_OK);
+  TEST_CHECK_EQ(fs.dead_cnt, 1);
+
+  // passed over as the cold sector lags behind, so nothing pending
+  TEST_CHECK_EQ(NIFFS_gc_pending(&fs), 0);
+  TEST_CHECK_EQ(NIFFS_gc_step(&fs, 4, 1), 0);
+  TEST_CHECK_EQ(NIFFS_gc_step(&fs, 4, 0), 0);
+  TEST_CHECK_EQ(fs.dead_cnt, 1);
+
+  // below watermark, steps collect until done
+  TEST_CHECK_EQ(NIFFS_set_gc_watermark(&fs, fs.free_pages + 1), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_gc_pending(&fs), 1);
+  for (i = 0; i < 100 && NIFFS_gc_pending(&fs); i++) {
+    res = NIFFS_gc_step(&fs, 4, 1);
+    TEST_CHECK_EQ(res, NIFFS_gc_pending(&fs));
+  }
+  TEST_CHECK(i < 100);
+
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "static"), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+#endif
+
+#if NIFFS_GC_PLAN
+TEST(func_gc_plan) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  niffs_emul_stats stats;
+  char name[NIFFS_NAME_LEN];
+  int i;
+  const int pairs = 12;
+
+  // each sector one kept page and the rest deleted
+  u32_t junk_len = _NIFFS_SPIX_2_PDATA_LEN(&fs, 0) + (fs.pages_per_sector - 2) * _NIFFS_SPIX_2_PDATA_LEN(&fs, 1);
+  for (i = 0; i < pairs; i++) {
+    sprintf(name, "keep%i", i);
+    TEST_CHECK_EQ(niffs_emul_create_file(&fs, name, 10), NIFFS_OK);
+    sprintf(name, "junk%i", i);
+    TEST_CHECK_EQ(niffs_emul_create_file(&fs, name, junk_len), NIFFS_OK);
+  }
+  for (i = 0; i < pairs; i++) {
+    sprintf(name, "junk%i", i);
+    TEST_CHECK_EQ(NIFFS_remove(&fs, name), NIFFS_OK);
+  }
+#if NIFFS_DEAD_ERASE
+  TEST_CHECK_EQ(fs.dead_cnt, 0);
+#endif
+
+  // needs four sectors collected, in one pass
+  u32_t pages = 6 * fs.pages_per_sector;
+  u32_t gain = pages + fs.pages_per_sector - fs.free_pages;
+  u32_t sectors = (gain + fs.pages_per_sector - 2) / (fs.pages_per_sector - 1);
+  TEST_CHECK(sectors > 1 && sectors <= NIFFS_GC_PLAN);
+#if NIFFS_GC_POLICY
+  // policy ranks the planned sectors, favour the last junk sector
+  niffs_page_ix pix;
+  niffs_stat s;
+  sprintf(name, "keep%i", pairs - 1);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, name, &s), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_find_page(&fs, &pix, s.obj_id, 0, 0), NIFFS_OK);
+  func_gc_policy_sector = _NIFFS_PIX_2_SECTOR(&fs, pix);
+  TEST_CHECK(func_gc_policy_sector >= sectors);
+  niffs_sector_hdr *shdr = (niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(&fs, func_gc_policy_sector);
+  niffs_erase_cnt era = shdr->era_cnt;
+  func_gc_policy_calls = 0;
+  TEST_CHECK_EQ(NIFFS_set_gc_policy(&fs, func_gc_policy_fixed), NIFFS_OK);
+#endif
+  niffs_emul_reset_stats();
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "big", (pages - 1) * _NIFFS_SPIX_2_PDATA_LEN(&fs, 1)), NIFFS_OK);
+  niffs_emul_get_stats(&stats);
+  TEST_CHECK_EQ(stats.er_calls, sectors);
+  TEST_CHECK_EQ(stats.gc_moves, sectors);
+#if NIFFS_GC_POLICY
+  // each sector scored once
+  TEST_CHECK_GT(func_gc_policy_calls, 0);
+  TEST_CHECK_LE(func_gc_policy_calls, fs.sectors);
+  TEST_CHECK_EQ(shdr->era_cnt, (niffs_erase_cnt)(era + 1));
+  TEST_CHECK_EQ(NIFFS_set_gc_policy(&fs, 0), NIFFS_OK);
+#endif
+  TEST_CHECK(fs.free_pages >= fs.pages_per_sector);
+
+  for (i = 0; i < pairs; i++) {
+    sprintf(name, "keep%i", i);
+    TEST_CHECK_EQ(niffs_emul_verify_file(&fs, name), NIFFS_OK);
+  }
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "big"), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_STATIC_WEAR
+TEST(func_static_wear) {
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  niffs_stat s;
+  niffs_page_ix pix;
+  u32_t i;
+
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "static", 10), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_stat(&fs, "static", &s), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_find_page(&fs, &pix, s.obj_id, 0, 0), NIFFS_OK);
+  u32_t cold = _NIFFS_PIX_2_SECTOR(&fs, pix);
+
+  // wear out a free sector way beyond the one holding the static file
+  u32_t worn = fs.sectors - 1;
+  for (i = 0; i < 2 * NIFFS_STATIC_WEAR; i++) {
+    TEST_CHECK_EQ(niffs_erase_sector(&fs, worn), NIFFS_OK);
+  }
+  niffs_erase_cnt cold_era = ((niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(&fs, cold))->era_cnt;
+  u32_t free_pages = fs.free_pages;
+
+  // not checked until enough erases
+  fs.wear_erases = NIFFS_STATIC_WEAR_PERIOD - 1;
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "a", 10), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_find_page(&fs, &pix, s.obj_id, 0, 0), NIFFS_OK);
+  TEST_CHECK_EQ(_NIFFS_PIX_2_SECTOR(&fs, pix), cold);
+
+  // moved into the worn sector, cold sector erased
+  niffs_emul_stats stats;
+  niffs_emul_reset_stats();
+  fs.wear_erases = NIFFS_STATIC_WEAR_PERIOD;
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "b", 10), NIFFS_OK);
+  niffs_emul_get_stats(&stats);
+  TEST_CHECK_EQ(niffs_find_page(&fs, &pix, s.obj_id, 0, 0), NIFFS_OK);
+  TEST_CHECK_EQ(_NIFFS_PIX_2_SECTOR(&fs, pix), worn);
+  TEST_CHECK_EQ(((niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(&fs, cold))->era_cnt, cold_era + 1);
+  TEST_CHECK_EQ(stats.er_calls, 1);
+  TEST_CHECK_EQ(fs.wear_erases, 0);
+  // only the pages of the new files are used up
+  TEST_CHECK_EQ(fs.free_pages, free_pages - 2);
+
+  // balanced, not moved back
+  fs.wear_erases = NIFFS_STATIC_WEAR_PERIOD;
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "c", 10), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_find_page(&fs, &pix, s.obj_id, 0, 0), NIFFS_OK);
+  TEST_CHECK_EQ(_NIFFS_PIX_2_SECTOR(&fs, pix), worn);
+
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "static"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "a"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "b"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "c"), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_WEAR_INFO
+TEST(func_wear_info) {
+  niffs_wear_info w;
+  niffs_wear_info w_scan;
+  niffs_sector_wear sw[EMUL_SECTORS];
+  niffs_sector_wear sw_scan[EMUL_SECTORS];
+  u32_t i;
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_wear_info(&fs, &w, 0, 0), ERR_NIFFS_NOT_MOUNTED);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_wear_info(&fs, 0, 0, 0), ERR_NIFFS_NULL_PTR);
+
+  // all even
+  TEST_CHECK_EQ(NIFFS_wear_info(&fs, &w, 0, 0), NIFFS_OK);
+  TEST_CHECK_EQ(w.era_min, w.era_max);
+  TEST_CHECK_EQ(w.era_mean, w.era_max);
+  TEST_CHECK_EQ(w.hist_width, 1);
+  TEST_CHECK_EQ(w.hist[0], fs.sectors);
+  TEST_CHECK_EQ(w.free_pages, fs.sectors * fs.pages_per_sector);
+
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "a", 1000), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "b", 10), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "b"), NIFFS_OK);
+  // one sector 16 erases ahead, one 7
+  u32_t worn = fs.sectors - 1;
+  u32_t half = fs.sectors - 2;
+  for (i = 0; i < 16; i++) {
+    TEST_CHECK_EQ(niffs_erase_sector(&fs, worn), NIFFS_OK);
+    if (i < 7) TEST_CHECK_EQ(niffs_erase_sector(&fs, half), NIFFS_OK);
+  }
+
+  TEST_CHECK_EQ(NIFFS_wear_info(&fs, &w, sw, EMUL_SECTORS), NIFFS_OK);
+  u32_t s_era_min, s_era_max;
+  niffs_emul_get_sector_erase_count_info(&fs, &s_era_min, &s_era_max);
+  TEST_CHECK_EQ(w.era_min, s_era_min);
+  TEST_CHECK_EQ(w.era_max, s_era_max);
+  TEST_CHECK_EQ(w.era_max - w.era_min, 16);
+  TEST_CHECK_EQ(w.era_mean, w.era_min + (16 + 7) / fs.sectors);
+  TEST_CHECK_EQ(w.hist_width, 16 / NIFFS_WEAR_INFO + 1);
+  TEST_CHECK_EQ(w.hist[0], fs.sectors - 2);
+  TEST_CHECK_EQ(w.hist[7 / w.hist_width], 1);
+  TEST_CHECK_EQ(w.hist[16 / w.hist_width], 1);
+  TEST_CHECK_EQ(w.free_pages, fs.free_pages);
+  TEST_CHECK_EQ(w.dele_pages, fs.dele_pages);
+  TEST_CHECK_EQ(w.free_pages + w.dele_pages + w.busy_pages, fs.sectors * fs.pages_per_sector);
+  TEST_CHECK_EQ(sw[worn].era_cnt, w.era_max);
+  TEST_CHECK_EQ(sw[worn].free_pages, fs.pages_per_sector);
+
+#if NIFFS_SECTOR_INFO
+  // same when scanning without sector info table
+  niffs_sector_info *sector_info = fs.sector_info;
+  fs.sector_info = 0;
+  TEST_CHECK_EQ(NIFFS_wear_info(&fs, &w_scan, sw_scan, 2), NIFFS_OK);
+  fs.sector_info = sector_info;
+  TEST_CHECK_EQ(memcmp(&w, &w_scan, sizeof(niffs_wear_info)), 0);
+  TEST_CHECK_EQ(memcmp(sw, sw_scan, 2 * sizeof(niffs_sector_wear)), 0);
+#else
+  (void)w_scan;
+  (void)sw_scan;
+#endif
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_ASYNC_ERASE && NIFFS_GC_STEP && NIFFS_DEAD_ERASE
+TEST(func_async_erase) {
+  niffs_emul_stats stats;
+  u8_t buf[10];
+  int i;
+  TEST_CHECK_EQ(NIFFS_set_async_erase(&fs, niffs_emul_erase_start, 0), ERR_NIFFS_BAD_CONF);
+  TEST_CHECK_EQ(NIFFS_set_async_erase(&fs, niffs_emul_erase_start, niffs_emul_erase_poll), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_format(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_async_erase(&fs, 0, 0), ERR_NIFFS_MOUNTED);
+
+  // a few sectors with deleted pages only
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "keep", 10), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "junk", 4 * fs.pages_per_sector * _NIFFS_SPIX_2_PDATA_LEN(&fs, 1)), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "junk"), NIFFS_OK);
+  TEST_CHECK(fs.dead_cnt >= 3);
+  u32_t free_pages = fs.free_pages;
+  u32_t dead_cnt = fs.dead_cnt;
+  int fd = NIFFS_open(&fs, "keep", NIFFS_O_RDONLY, 0);
+  TEST_CHECK(fd >= 0);
+
+  // step only starts erase, and polls it until erased
+  niffs_emul_reset_stats();
+  TEST_CHECK_EQ(NIFFS_gc_step(&fs, 1, 1), 1);
+  u32_t sector = fs.er_sector;
+  TEST_CHECK(sector != NIFFS_EXCL_SECT_NONE);
+  niffs_emul_get_stats(&stats);
+  TEST_CHECK_EQ(stats.er_calls, 1);
+  TEST_CHECK_EQ(fs.free_pages, free_pages);
+
+  // open files can be read meanwhile
+  TEST_CHECK_EQ(NIFFS_read(&fs, fd, buf, sizeof(buf)), sizeof(buf));
+  TEST_CHECK_EQ(memcmp(buf, niffs_emul_get_data("keep", 0), sizeof(buf)), 0);
+  TEST_CHECK_EQ(fs.er_sector, sector);
+  TEST_CHECK_EQ(NIFFS_gc_pending(&fs), 1);
+
+  for (i = 0; i < EMUL_ERASE_POLLS; i++) {
+    TEST_CHECK_EQ(fs.er_sector, sector);
+    TEST_CHECK_EQ(NIFFS_gc_step(&fs, 1, 1), 1);
+  }
+  TEST_CHECK_EQ(fs.er_sector, NIFFS_EXCL_SECT_NONE);
+  TEST_CHECK_EQ(fs.free_pages, free_pages + fs.pages_per_sector);
+  TEST_CHECK_EQ(fs.dead_cnt, dead_cnt - 1);
+  niffs_emul_get_stats(&stats);
+  TEST_CHECK_EQ(stats.er_calls, 1);
+  niffs_sector_hdr *shdr = (niffs_sector_hdr *)_NIFFS_SECTOR_2_ADDR(&fs, sector);
+  TEST_CHECK_EQ(shdr->abra, _NIFFS_SECT_MAGIC(&fs));
+  TEST_CHECK_EQ(shdr->era_cnt, 1);
+
+  // writing finishes erase in flight first
+  TEST_CHECK_EQ(NIFFS_gc_step(&fs, 1, 1), 1);
+  TEST_CHECK(fs.er_sector != NIFFS_EXCL_SECT_NONE);
+  TEST_CHECK_EQ(niffs_emul_create_file(&fs, "new", 100), NIFFS_OK);
+  TEST_CHECK_EQ(fs.er_sector, NIFFS_EXCL_SECT_NONE);
+  TEST_CHECK_EQ(fs.dead_cnt, dead_cnt - 2);
+
+  // so does unmounting
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_gc_step(&fs, 1, 1), 1);
+  TEST_CHECK(fs.er_sector != NIFFS_EXCL_SECT_NONE);
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(fs.er_sector, NIFFS_EXCL_SECT_NONE);
+  TEST_CHECK_EQ(NIFFS_chk(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "keep"), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "new"), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
+#if NIFFS_LINEAR_AREA
+
+TEST(func_lin_alloc_virgin) {
+  u32_t start_sect;
+  int res = NIFFS_format(&fs);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+
+  res = niffs_linear_find_space(&fs, 1, &start_sect);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+  TEST_CHECK_EQ(start_sect, fs.sectors);
+
+  res = niffs_linear_find_space(&fs, fs.lin_sectors, &start_sect);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+  TEST_CHECK_EQ(start_sect, fs.sectors);
+
+  res = niffs_linear_find_space(&fs, fs.lin_sectors+1, &start_sect);
+  TEST_CHECK_EQ(res, ERR_NIFFS_LINEAR_NO_SPACE);
+
+  return TEST_RES_OK;
+} TEST_END
+
+TEST(func_lin_alloc_mknod) {
+  u32_t start_sect;
+  int res = NIFFS_format(&fs);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  int fd;
+
+  fd = NIFFS_mknod_linear(&fs, "1_1", 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  NIFFS_close(&fs, fd);
+  res = niffs_linear_find_space(&fs, 1, &start_sect);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+  TEST_CHECK_EQ(start_sect, fs.sectors+1);
+
+  fd = NIFFS_mknod_linear(&fs, "2_1", 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  NIFFS_close(&fs, fd);
+  res = niffs_linear_find_space(&fs, 1, &start_sect);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+  TEST_CHECK_EQ(start_sect, fs.sectors+1+1);
+
+  fd = NIFFS_mknod_linear(&fs, "3_8", fs.sector_size*8-1);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  NIFFS_close(&fs, fd);
+  res = niffs_linear_find_space(&fs, 1, &start_sect);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+  TEST_CHECK_EQ(start_sect, fs.sectors+1+1+8);
+
+  fd = NIFFS_mknod_linear(&fs, "4_1", fs.sector_size/2);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  NIFFS_close(&fs, fd);
+  res = niffs_linear_find_space(&fs, 1, &start_sect);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+  TEST_CHECK_EQ(start_sect, fs.sectors+1+1+8+1);
+
+  fd = NIFFS_mknod_linear(&fs, "5_lots", fs.lin_sectors);
+  TEST_CHECK_GE(fd, ERR_NIFFS_LINEAR_NO_SPACE);
+
+  return TEST_RES_OK;
+} TEST_END
+
+TEST(func_lin_write) {
+  int res = NIFFS_format(&fs);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  int fd;
+
+  const u32_t len = fs.sector_size*5;
+  u8_t *data = niffs_emul_create_data("linear", len);
+  TEST_CHECK(data);
+
+  fd = NIFFS_mknod_linear(&fs, "linear", 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  res = NIFFS_write(&fs, fd, data, len/2);
+  TEST_CHECK_EQ(res, len/2);
+
+  res = NIFFS_write(&fs, fd, &data[len/2], len/2);
+  TEST_CHECK_EQ(res, len/2);
+
+  res = NIFFS_close(&fs, fd);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+
+  res = niffs_emul_verify_file(&fs, "linear");
+  TEST_CHECK_EQ(res, NIFFS_OK);
+
+  // linear file is one segment
+  fd = NIFFS_open(&fs, "linear", NIFFS_O_RDONLY, 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  TEST_CHECK_EQ(func_read_segments_check(fd, data, 100, len - 100), 1);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+
+  return TEST_RES_OK;
+} TEST_END
+
+TEST(func_lin_overwrite) {
+  int res = NIFFS_format(&fs);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  int fd;
+
+  const u32_t len = fs.sector_size*5;
+  u8_t *data = niffs_emul_create_data("linear", len);
+  TEST_CHECK(data);
+
+  fd = NIFFS_mknod_linear(&fs, "linear", 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  res = NIFFS_write(&fs, fd, data, len);
+  TEST_CHECK_EQ(res, len);
+  res = NIFFS_close(&fs, fd);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+
+  fd = NIFFS_open(&fs, "linear", NIFFS_O_RDONLY, 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  niffs_file_desc *desc;
+  res = niffs_get_filedesc(&fs, fd, &desc);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+  u32_t start_sec1 = ((niffs_linear_file_hdr *)_NIFFS_PIX_2_ADDR(&fs, desc->obj_pix))->start_sector;
+
+  res = NIFFS_remove(&fs, "linear");
+  TEST_CHECK_EQ(res, NIFFS_OK);
+
+  data = niffs_emul_create_data("linear2", len);
+  TEST_CHECK(data);
+  fd = NIFFS_mknod_linear(&fs, "linear2", 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  res = NIFFS_write(&fs, fd, data, len);
+  TEST_CHECK_EQ(res, len);
+  res = NIFFS_close(&fs, fd);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+
+  fd = NIFFS_open(&fs, "linear2", NIFFS_O_RDONLY, 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  res = niffs_get_filedesc(&fs, fd, &desc);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+  u32_t start_sec2 = ((niffs_linear_file_hdr *)_NIFFS_PIX_2_ADDR(&fs, desc->obj_pix))->start_sector;
+
+  TEST_CHECK_EQ(start_sec1, start_sec2);
+
+  res = niffs_emul_verify_file(&fs, "linear2");
+  TEST_CHECK_EQ(res, NIFFS_OK);
+
+  res = niffs_emul_verify_file(&fs, "linear");
+  TEST_CHECK_EQ(res, ERR_NIFFS_FILE_NOT_FOUND);
+
+  return TEST_RES_OK;
+} TEST_END
+
+TEST(func_lin_clamp) {
+  int res = NIFFS_format(&fs);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  int fd;
+
+  u32_t len = fs.sector_size*2;
+
+  u8_t *data = niffs_emul_create_data("linear1", len);
+  TEST_CHECK(data);
+  fd = NIFFS_mknod_linear(&fs, "linear1", 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  res = NIFFS_write(&fs, fd, data, len);
+  TEST_CHECK_EQ(res, len);
+  res = NIFFS_close(&fs, fd);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+
+  data = niffs_emul_create_data("linear2", len);
+  TEST_CHECK(data);
+  fd = NIFFS_mknod_linear(&fs, "linear2", 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  res = NIFFS_write(&fs, fd, data, len);
+  TEST_CHECK_EQ(res, len);
+  res = NIFFS_close(&fs, fd);
+  TEST_CHECK_EQ(res, NIFFS_OK);
+
+  res = niffs_emul_verify_file(&fs, "linear1");
+  TEST_CHECK_EQ(res, NIFFS_OK);
+
+  res = niffs_emul_verify_file(&fs, "linear2");
+  TEST_CHECK_EQ(res, NIFFS_OK);
+
+  res = NIFFS_remove(&fs, "linear1");
+  TEST_CHECK_EQ(res, NIFFS_OK);
+
+  len = fs.sector_size*2 + 1;
+
+  data = niffs_emul_create_data("linear1_2", len);
   TEST_CHECK(data);
   fd = NIFFS_mknod_linear(&fs, "linear1_2", 0);
   TEST_CHECK_GE(fd, NIFFS_OK);
@@ -1647,6 +3640,104 @@ TEST(func_lin_full) {
   return TEST_RES_OK;
 } TEST_END
 
+#if NIFFS_LINEAR_EXTENTS
+static int lin_extents_match_flash(niffs *fs) {
+  u8_t map[(EMUL_LIN_SECTORS+7)/8];
+  if (niffs_linear_map(fs) != NIFFS_OK) return 0;
+  niffs_memcpy(map, fs->buf, sizeof(map));
+  u8_t ovf = fs->lin_extents_ovf;
+  fs->lin_extents_ovf = 1;
+  int res = niffs_linear_map(fs);
+  fs->lin_extents_ovf = ovf;
+  if (res != NIFFS_OK) return 0;
+  if (memcmp(map, fs->buf, sizeof(map))) {
+    u32_t lsix;
+    for (lsix = 0; lsix < fs->lin_sectors; lsix++) {
+      printf("%c", (map[lsix/8] & (1<<(lsix&7))) ? 'X' : '.');
+    }
+    printf(" extents\n");
+    for (lsix = 0; lsix < fs->lin_sectors; lsix++) {
+      printf("%c", (fs->buf[lsix/8] & (1<<(lsix&7))) ? 'X' : '.');
+    }
+    printf(" flash\n");
+    return 0;
+  }
+  return 1;
+}
+
+TEST(func_lin_extents) {
+  int res = NIFFS_format(&fs);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_linear_extents(&fs, 0, 0), ERR_NIFFS_MOUNTED);
+  int fd;
+
+  fd = NIFFS_mknod_linear(&fs, "a", 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  fd = NIFFS_mknod_linear(&fs, "b", fs.sector_size*3);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(fs.lin_extents_cnt, 2);
+  TEST_CHECK(lin_extents_match_flash(&fs));
+
+  // grow last file beyond its reservation
+  u32_t len = fs.sector_size*5;
+  u8_t *data = niffs_emul_create_data("b", len);
+  TEST_CHECK(data);
+  fd = NIFFS_open(&fs, "b", NIFFS_O_APPEND | NIFFS_O_WRONLY, 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_write(&fs, fd, data, len), len);
+  u32_t avail;
+  TEST_CHECK_EQ(niffs_linear_avail_size(&fs, fd, &avail), NIFFS_OK);
+  TEST_CHECK_EQ(avail, fs.lin_sectors - 1);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK_EQ(fs.lin_extents_cnt, 2);
+  TEST_CHECK(lin_extents_match_flash(&fs));
+
+  // first file is bounded by second
+  fd = NIFFS_open(&fs, "a", NIFFS_O_APPEND | NIFFS_O_WRONLY, 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  TEST_CHECK_EQ(niffs_linear_avail_size(&fs, fd, &avail), NIFFS_OK);
+  TEST_CHECK_EQ(avail, 1);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+
+  // removed files free their sectors
+  TEST_CHECK_EQ(NIFFS_remove(&fs, "a"), NIFFS_OK);
+  TEST_CHECK_EQ(fs.lin_extents_cnt, 1);
+  TEST_CHECK(lin_extents_match_flash(&fs));
+  u32_t start_sect;
+  TEST_CHECK_EQ(niffs_linear_find_space(&fs, 1, &start_sect), NIFFS_OK);
+  TEST_CHECK_EQ(start_sect, fs.sectors);
+
+  // survives gc moving headers, rebuilt on mount
+  u32_t freed;
+  while (fs.dele_pages > 0) {
+    TEST_CHECK_EQ(niffs_gc(&fs, &freed, 0), NIFFS_OK);
+  }
+  TEST_CHECK_EQ(fs.lin_extents_cnt, 1);
+  TEST_CHECK(lin_extents_match_flash(&fs));
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(fs.lin_extents_cnt, 1);
+  TEST_CHECK(lin_extents_match_flash(&fs));
+  TEST_CHECK_EQ(niffs_emul_verify_file(&fs, "b"), NIFFS_OK);
+
+  // too small map overflows and falls back to scanning
+  niffs_linear_extent small_extents[1];
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_set_linear_extents(&fs, small_extents, sizeof(small_extents)), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+  fd = NIFFS_mknod_linear(&fs, "c", 0);
+  TEST_CHECK_GE(fd, NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_close(&fs, fd), NIFFS_OK);
+  TEST_CHECK(fs.lin_extents_ovf);
+  TEST_CHECK_EQ(niffs_linear_find_space(&fs, 1, &start_sect), NIFFS_OK);
+  TEST_CHECK_EQ(start_sect, fs.sectors + 6);
+
+  return TEST_RES_OK;
+} TEST_END
+#endif
+
 #endif //NIFFS_LINEAR_AREA
 
 SUITE_TESTS(niffs_func_tests)
@@ -1676,12 +3767,79 @@ SUITE_TESTS(niffs_func_tests)
   ADD_TEST(func_gc)
   ADD_TEST(func_gc_big_hog)
   ADD_TEST(func_gc_full)
+  ADD_TEST(func_gc_no_room)
   ADD_TEST(func_gc_long_run)
   ADD_TEST(func_check_aborted_delete)
   ADD_TEST(func_check_orphans)
   ADD_TEST(func_check_aborted_append)
   ADD_TEST(func_check_aborted_modify)
   ADD_TEST(func_check_aborted_erase)
+  ADD_TEST(func_writev_readv)
+  ADD_TEST(func_read_segments)
+  ADD_TEST(func_pread_pwrite)
+#if NIFFS_SPAN_INDEX
+  ADD_TEST(func_span_index)
+#endif
+#if NIFFS_NAME_INDEX
+  ADD_TEST(func_name_index)
+#endif
+#if NIFFS_FREE_MAP
+  ADD_TEST(func_free_map)
+#endif
+#if NIFFS_ID_MAP
+  ADD_TEST(func_id_map)
+#endif
+#if NIFFS_SECTOR_INFO
+  ADD_TEST(func_sector_info)
+#endif
+#if NIFFS_CHECKPOINT
+  ADD_TEST(func_checkpoint)
+#endif
+#if NIFFS_WRITE_CACHE
+  ADD_TEST(func_write_cache)
+#endif
+#if NIFFS_DEFER_LEN
+  ADD_TEST(func_defer_len)
+#endif
+#if NIFFS_INPLACE_APPEND
+  ADD_TEST(func_inplace_append)
+#endif
+#if NIFFS_LEN_SLOTS
+  ADD_TEST(func_len_slots)
+#endif
+#if NIFFS_INPLACE_MODIFY
+  ADD_TEST(func_inplace_modify)
+#endif
+#if NIFFS_FALLOCATE
+  ADD_TEST(func_fallocate)
+#endif
+#if NIFFS_GC_STEP
+  ADD_TEST(func_gc_step)
+#endif
+#if NIFFS_COLD_HEAD
+  ADD_TEST(func_cold_head)
+#endif
+#if NIFFS_GC_POLICY
+  ADD_TEST(func_gc_policy)
+#endif
+#if NIFFS_DEAD_ERASE
+  ADD_TEST(func_dead_erase)
+#if NIFFS_GC_STEP
+  ADD_TEST(func_dead_erase_lagging)
+#endif
+#endif
+#if NIFFS_GC_PLAN
+  ADD_TEST(func_gc_plan)
+#endif
+#if NIFFS_STATIC_WEAR
+  ADD_TEST(func_static_wear)
+#endif
+#if NIFFS_WEAR_INFO
+  ADD_TEST(func_wear_info)
+#endif
+#if NIFFS_ASYNC_ERASE && NIFFS_GC_STEP && NIFFS_DEAD_ERASE
+  ADD_TEST(func_async_erase)
+#endif
 #if NIFFS_LINEAR_AREA
   ADD_TEST(func_lin_alloc_virgin)
   ADD_TEST(func_lin_alloc_mknod)
@@ -1689,5 +3847,8 @@ SUITE_TESTS(niffs_func_tests)
   ADD_TEST(func_lin_overwrite)
   ADD_TEST(func_lin_clamp)
   ADD_TEST(func_lin_full)
+#if NIFFS_LINEAR_EXTENTS
+  ADD_TEST(func_lin_extents)
+#endif
 #endif
 SUITE_END(niffs_func_tests)
@@ -689,6 +689,13 @@ TEST(run_create_modify_append_some_garbled_one_constant_aborted)
   int res;
   u32_t mlen = _NIFFS_SPIX_2_PDATA_LEN(&fs, 1) * fs.pages_per_sector * fs.sectors / 8;
 
+#if NIFFS_WRITE_CACHE
+  // appends are cached and flushed on close
+  TEST_CHECK_EQ(NIFFS_unmount(&fs), NIFFS_OK);
+  TEST_CHECK_EQ(niffs_emul_set_write_cache(), NIFFS_OK);
+  TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
+#endif
+
   u32_t const_len =  _NIFFS_SPIX_2_PDATA_LEN(&fs, 1) * 3;
   TEST_CHECK_EQ(niffs_emul_create_file(&fs, "constant", const_len), NIFFS_OK);
   char name[NIFFS_NAME_LEN];
@@ -736,8 +743,23 @@ TEST(run_create_modify_append_some_garbled_one_constant_aborted)
           (void)NIFFS_close(&fs, fd);
         } else {
           TEST_CHECK_EQ(res, len);
+#if NIFFS_WRITE_CACHE
+          // cached data is flushed on close
+          res = NIFFS_close(&fs, fd);
+          if (res == ERR_NIFFS_FULL) {
+            int res2 = NIFFS_remove(&fs, name);
+            if (res2 == ERR_NIFFS_TEST_ABORTED_WRITE) {
+              res = res2;
+            } else {
+              TEST_CHECK_EQ(res2, NIFFS_OK);
+            }
+          } else if (res != ERR_NIFFS_TEST_ABORTED_WRITE) {
+            TEST_CHECK_EQ(res, NIFFS_OK);
+          }
+#else
           (void)NIFFS_close(&fs, fd);
           res = NIFFS_OK;
+#endif
         }
       } else {
         res = fd;
@@ -825,7 +847,12 @@ TEST(run_create_modify_append_some_garbled_one_constant_aborted)
         free(mdata);
       }
 
+#if NIFFS_WRITE_CACHE
+      int res_close = NIFFS_close(&fs, fd);
+      if (res == (int)len && res_close != NIFFS_OK) res = res_close;
+#else
       (void)NIFFS_close(&fs, fd);
+#endif
       if (res != ERR_NIFFS_FULL && res != ERR_NIFFS_TEST_ABORTED_WRITE) {
         TEST_CHECK_EQ(res, len);
         res = NIFFS_OK;
@@ -926,6 +953,14 @@ TEST(run_create_modify_append_some_garbled_one_constant_aborted)
 
       TEST_CHECK_EQ(NIFFS_mount(&fs), NIFFS_OK);
       TEST_CHECK_EQ(niffs_emul_remove_all_zerosized_files(&fs), NIFFS_OK);
+#if NIFFS_WRITE_CACHE
+      if (create_else_mod) {
+        // created file may keep pages appended before an aborted cache flush
+        res = NIFFS_remove(&fs, name);
+        if (res != ERR_NIFFS_FILE_NOT_FOUND) TEST_CHECK_EQ(res, NIFFS_OK);
+        res = NIFFS_OK;
+      }
+#endif
     }
 
     // check "constant" length
@@ -40,6 +40,8 @@ typedef signed char s8_t;
 #define EMUL_PAGE_SIZE          128
 // give niffs a 128 byte work buffer
 #define EMUL_BUF_SIZE           128
+// split erases are done on the third poll
+#define EMUL_ERASE_POLLS        3
 
 // enable checks for stm32f1 flash writes
 #define TEST_CHECK_UNALIGNED_ACCESS
@@ -50,6 +52,12 @@ typedef signed char s8_t;
 extern u8_t __dbg;
 #define NIFFS_DBG_DEFAULT           0
 #define NIFFS_DBG(_f, ...)          if (__dbg) printf(_f, ## __VA_ARGS__)
+extern u32_t __traversed;
+#define NIFFS_STAT_TRAVERSE(_fs, _pix) __traversed++
+extern u32_t __gc_moves;
+#define NIFFS_STAT_GC_MOVE(_fs)     __gc_moves++
+extern u8_t __reprogram;
+#define NIFFS_HAL_REPROGRAM(_fs, _on) __reprogram = (_on)
 #define NIFFS_NAME_LEN              (16)  // max 16 characters file name
 #define NIFFS_OBJ_ID_BITS           (8)   // max 256-2 files
 #define NIFFS_SPAN_IX_BITS          (8)   // max 256 pages of data per file
@@ -66,6 +74,49 @@ extern u8_t __dbg;
 
 // enable linear features in test
 #define NIFFS_LINEAR_AREA           1
+// enable span index in test
+#define NIFFS_SPAN_INDEX            1
+// enable name index in test
+#define NIFFS_NAME_INDEX            1
+// enable free page map in test
+#define NIFFS_FREE_MAP              1
+// enable object id map in test
+#define NIFFS_ID_MAP                1
+// enable sector info table in test
+#define NIFFS_SECTOR_INFO           1
+// enable linear extent map in test
+#define NIFFS_LINEAR_EXTENTS        1
+// enable mount checkpoints in test
+#define NIFFS_CHECKPOINT            1
+// enable write-back cache
+#define NIFFS_WRITE_CACHE           1
+// enable deferred object header length updates
+#define NIFFS_DEFER_LEN             1
+// enable in place appends
+#define NIFFS_INPLACE_APPEND        1
+// enable in place modifies
+#define NIFFS_INPLACE_MODIFY        1
+// enable object header length slots
+#define NIFFS_LEN_SLOTS             6
+// enable space preallocation
+#define NIFFS_FALLOCATE             1
+// enable incremental garbage collection
+#define NIFFS_GC_STEP               1
+// enable separate allocation of relocated data
+#define NIFFS_COLD_HEAD             1
+// enable runtime garbage collection policies
+#define NIFFS_GC_POLICY             1
+// enable queue of fully deleted sectors
+#define NIFFS_DEAD_ERASE            4
+// enable planned garbage collection of up to 4 sectors
+#define NIFFS_GC_PLAN               4
+// enable static wear leveling at 8 erases difference, checked every 4 erases
+#define NIFFS_STATIC_WEAR           8
+#define NIFFS_STATIC_WEAR_PERIOD    4
+// enable wear info with an 8 bin histogram
+#define NIFFS_WEAR_INFO             8
+// enable split erase HAL
+#define NIFFS_ASYNC_ERASE           1
 
 #define NIFFS_ASSERT(x) do { \
   if (!(x)) { \
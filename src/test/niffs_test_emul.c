@@ -13,9 +13,33 @@
 #include "niffs_test_emul.h"
 
 u8_t __dbg = NIFFS_DBG_DEFAULT;
+u32_t __traversed = 0;
+u32_t __gc_moves = 0;
+u8_t __reprogram = 0;
 static u8_t _flash[(EMUL_SECTORS+EMUL_LIN_SECTORS) * EMUL_SECTOR_SIZE];
 static u8_t buf[EMUL_BUF_SIZE];
 static niffs_file_desc descs[EMUL_FILE_DESCS];
+#if NIFFS_SPAN_INDEX
+static niffs_span_index_entry span_index[2 * EMUL_SECTORS * EMUL_SECTOR_SIZE / EMUL_PAGE_SIZE];
+#endif
+#if NIFFS_NAME_INDEX
+static niffs_name_index_entry name_index[EMUL_SECTORS * EMUL_SECTOR_SIZE / EMUL_PAGE_SIZE];
+#endif
+#if NIFFS_FREE_MAP
+static u32_t free_map[(EMUL_SECTORS * EMUL_SECTOR_SIZE / EMUL_PAGE_SIZE + 31) / 32];
+#endif
+#if NIFFS_ID_MAP
+static u32_t id_map[(EMUL_SECTORS * EMUL_SECTOR_SIZE / EMUL_PAGE_SIZE + 31) / 32];
+#endif
+#if NIFFS_SECTOR_INFO
+static niffs_sector_info sector_info[EMUL_SECTORS];
+#endif
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+static niffs_linear_extent lin_extents[EMUL_LIN_SECTORS];
+#endif
+#if NIFFS_WRITE_CACHE
+static u8_t wcache[EMUL_FILE_DESCS * EMUL_PAGE_SIZE];
+#endif
 niffs fs;
 
 typedef struct fdata_s{
@@ -28,6 +52,12 @@ typedef struct fdata_s{
 static fdata *dhead = 0;
 static fdata *dlast = 0;
 static u32_t valid_byte_writes = 0;
+static niffs_emul_stats stats;
+#if NIFFS_ASYNC_ERASE
+// sector being erased by niffs_emul_erase_start, and polls left until erased
+static u8_t *er_addr = 0;
+static u32_t er_polls = 0;
+#endif
 
 static int emul_hal_erase_f(u8_t *addr, u32_t len) {
   if (addr < &_flash[0]) {
@@ -44,6 +74,13 @@ static int emul_hal_erase_f(u8_t *addr, u32_t len) {
     return ERR_NIFFS_TEST_BAD_ADDR;
   }
   if (len != EMUL_SECTOR_SIZE) return ERR_NIFFS_TEST_BAD_ADDR;
+#if NIFFS_ASYNC_ERASE
+  if (er_addr) {
+    printf("erasing while erasing\n");
+    return ERR_NIFFS_TEST_FATAL;
+  }
+#endif
+  stats.er_calls++;
   memset(addr, 0xff, len);
   return NIFFS_OK;
 }
@@ -62,6 +99,12 @@ static int emul_hal_write_f(u8_t *addr, const u8_t *src, u32_t len) {
     printf("writing nothing\n");
     return ERR_NIFFS_TEST_BAD_ADDR;
   }
+#if NIFFS_ASYNC_ERASE
+  if (er_addr) {
+    printf("writing while erasing\n");
+    return ERR_NIFFS_TEST_FATAL;
+  }
+#endif
 //  if (len % NIFFS_WORD_ALIGN != 0) {
 //    printf("unaligned write length %08x\n", len);
 //    return ERR_NIFFS_TEST_UNLIGNED_WRITE_LEN;
@@ -73,11 +116,14 @@ static int emul_hal_write_f(u8_t *addr, const u8_t *src, u32_t len) {
   }
 #endif
 //  printf("                       WRIT     %p : %i\n", addr, len);
+  stats.wr_calls++;
+  stats.wr_bytes += len;
   int i;
   for (i = 0;  i < len; i++) {
     u8_t b = *src;
 #ifdef TEST_CHECK_WRITE_ON_NONERASED_DATA_OTHER_THAN_ZERO
-    if (b != 0 && *addr != 0xff) {
+    // in place modifies need a flash allowing bits to be cleared in programmed data
+    if (__reprogram ? (b & *addr) != b : (b != 0 && *addr != 0xff)) {
       printf("writing illegally to address %p (addr:%i): %02x @ %02x, ix:%i\n",
           addr, (u32_t)((intptr_t)addr - (intptr_t)_flash), b, *addr, i);
       return ERR_NIFFS_TEST_WRITE_TO_NONERASED_DATA;
@@ -99,16 +145,66 @@ static int emul_hal_write_f(u8_t *addr, const u8_t *src, u32_t len) {
   return NIFFS_OK;
 }
 
+#if NIFFS_ASYNC_ERASE
+int niffs_emul_erase_start(u8_t *addr, u32_t len) {
+  int res = emul_hal_erase_f(addr, len);
+  if (res != NIFFS_OK) return res;
+  // contents are undefined until erased
+  memrand(addr, len, (u32_t)(addr - &_flash[0]));
+  er_addr = addr;
+  er_polls = EMUL_ERASE_POLLS;
+  return NIFFS_OK;
+}
+
+int niffs_emul_erase_poll(u8_t *addr) {
+  if (addr != er_addr) {
+    printf("polling erase not started\n");
+    return ERR_NIFFS_TEST_FATAL;
+  }
+  if (--er_polls > 0) return 1;
+  memset(addr, 0xff, EMUL_SECTOR_SIZE);
+  er_addr = 0;
+  return NIFFS_OK;
+}
+#endif
+
 int niffs_emul_init(void) {
   dhead = 0;
   dlast = 0;
   memset(_flash, 0xff, sizeof(_flash));
   valid_byte_writes = 0;
-  return NIFFS_init(&fs, (u8_t *)&_flash[0], EMUL_SECTORS, EMUL_SECTOR_SIZE, EMUL_PAGE_SIZE,
+#if NIFFS_ASYNC_ERASE
+  er_addr = 0;
+#endif
+  int res = NIFFS_init(&fs, (u8_t *)&_flash[0], EMUL_SECTORS, EMUL_SECTOR_SIZE, EMUL_PAGE_SIZE,
       buf, sizeof(buf),
       descs, EMUL_FILE_DESCS,
       emul_hal_erase_f, emul_hal_write_f, EMUL_LIN_SECTORS);
-  return 0;
+  if (res != NIFFS_OK) return res;
+#if NIFFS_SPAN_INDEX
+  res = NIFFS_set_span_index(&fs, span_index, sizeof(span_index));
+  if (res != NIFFS_OK) return res;
+#endif
+#if NIFFS_NAME_INDEX
+  res = NIFFS_set_name_index(&fs, name_index, sizeof(name_index));
+  if (res != NIFFS_OK) return res;
+#endif
+#if NIFFS_FREE_MAP
+  res = NIFFS_set_free_map(&fs, free_map, sizeof(free_map));
+  if (res != NIFFS_OK) return res;
+#endif
+#if NIFFS_ID_MAP
+  res = NIFFS_set_id_map(&fs, id_map, sizeof(id_map));
+  if (res != NIFFS_OK) return res;
+#endif
+#if NIFFS_SECTOR_INFO
+  res = NIFFS_set_sector_info(&fs, sector_info, sizeof(sector_info));
+  if (res != NIFFS_OK) return res;
+#endif
+#if NIFFS_LINEAR_AREA && NIFFS_LINEAR_EXTENTS
+  res = NIFFS_set_linear_extents(&fs, lin_extents, sizeof(lin_extents));
+#endif
+  return res;
 }
 
 void niffs_emul_rand_filesystem(void) {
@@ -122,6 +218,24 @@ void niffs_emul_set_write_byte_limit(u32_t limit) {
   valid_byte_writes = limit;
 }
 
+#if NIFFS_WRITE_CACHE
+int niffs_emul_set_write_cache(void) {
+  return NIFFS_set_write_cache(&fs, wcache, sizeof(wcache));
+}
+#endif
+
+void niffs_emul_reset_stats(void) {
+  memset(&stats, 0, sizeof(stats));
+  __traversed = 0;
+  __gc_moves = 0;
+}
+
+void niffs_emul_get_stats(niffs_emul_stats *s) {
+  *s = stats;
+  s->traversed = __traversed;
+  s->gc_moves = __gc_moves;
+}
+
 void memdump(u8_t *addr, u32_t len) {
   u8_t *a = addr;
   while (a < addr + len) {
@@ -158,7 +272,7 @@ void niffs_emul_dump_pix(niffs *fs, niffs_page_ix pix) {
   u32_t len = _NIFFS_SPIX_2_PDATA_LEN(fs, 1);
   if (!_NIFFS_IS_FREE(phdr) && !_NIFFS_IS_DELE(phdr) &&_NIFFS_IS_ID_VALID(phdr) && phdr->id.spix == 0) {
     niffs_object_hdr *ohdr = (niffs_object_hdr *)phdr;
-    printf("  length:%08x  name:%s\n", ohdr->len, ohdr->name);
+    printf("  length:%08x  name:%s\n", _NIFFS_OHDR_LEN(ohdr), ohdr->name);
     data = (u8_t *)phdr + sizeof(niffs_object_hdr);
     len = _NIFFS_SPIX_2_PDATA_LEN(fs, 0);
   }
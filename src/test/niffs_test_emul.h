@@ -14,6 +14,20 @@
 
 extern niffs fs;
 
+/* flash operation counters */
+typedef struct {
+  // number of hal_wr calls
+  u32_t wr_calls;
+  // number of bytes written by hal_wr
+  u32_t wr_bytes;
+  // number of hal_er calls
+  u32_t er_calls;
+  // number of page headers visited when traversing, scanning or looking up
+  u32_t traversed;
+  // number of pages moved by garbage collection
+  u32_t gc_moves;
+} niffs_emul_stats;
+
 void memrand(u8_t *d, u32_t len, u32_t seed);
 void memdump(u8_t *addr, u32_t len);
 
@@ -33,6 +47,8 @@ void niffs_emul_destroy_all_data(void);
 
 void niffs_emul_get_sector_erase_count_info(niffs *fs, u32_t *s_era_min, u32_t *s_era_max);
 void niffs_emul_set_write_byte_limit(u32_t limit);
+void niffs_emul_reset_stats(void);
+void niffs_emul_get_stats(niffs_emul_stats *s);
 int niffs_emul_create_file(niffs *fs, char *name, u32_t len);
 int niffs_emul_verify_file(niffs *fs, char *name);
 int niffs_emul_verify_file_against_data(niffs *fs, char *name, u8_t *data);
@@ -40,4 +56,13 @@ int niffs_emul_remove_all_zerosized_files(niffs *fs);
 
 int niffs_emul_read_ptr(niffs *fs, int fd_ix, u8_t **data, u32_t *avail);
 
+#if NIFFS_WRITE_CACHE
+int niffs_emul_set_write_cache(void);
+#endif
+
+#if NIFFS_ASYNC_ERASE
+int niffs_emul_erase_start(u8_t *addr, u32_t len);
+int niffs_emul_erase_poll(u8_t *addr);
+#endif
+
 #endif /* NIFFS_TEST_EMUL_H_ */